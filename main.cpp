@@ -11,41 +11,13 @@ extern "C"
 }
 
 #include <iostream>
+#include <memory>
+#include <string.h>
+#include "caccel.h"
 
-static AVBufferRef *hw_device_ctx = NULL;
-static enum AVPixelFormat hw_pix_fmt;
+static CAccel *accel = NULL;	// 加速后端(vaapi 等硬件设备或 cpu)
 static FILE *output_file = NULL;
 
-// 硬件加速初始化
-static int hw_decoder_init(AVCodecContext *ctx, const enum AVHWDeviceType type)
-{
-	int err = 0;
-	// 创建一个硬件设备上下文
-	if ((err = av_hwdevice_ctx_create(&hw_device_ctx, type,	NULL, NULL, 0)) < 0)
-	{
-		fprintf(stderr, "Failed to create specified HW device.\n");
-		return err;
-	}
-	ctx->hw_device_ctx = av_buffer_ref(hw_device_ctx);
-
-	return err;
-}
-
-// 获取GPU硬件解码帧的格式
-static enum AVPixelFormat get_hw_format(AVCodecContext *ctx, const enum AVPixelFormat *pix_fmts)
-{
-	const enum AVPixelFormat *p;
-
-	for (p = pix_fmts; *p != -1; p++)
-	{
-		if (*p == hw_pix_fmt)
-			return *p;
-	}
-
-	fprintf(stderr, "Failed to get HW surface format.\n");
-	return AV_PIX_FMT_NONE;
-}
-
 // 解码后数据格式转换，GPU到CPU拷贝，YUV数据dump到文件
 static int decode_write(AVCodecContext *avctx, AVPacket *packet)
 {
@@ -84,10 +56,10 @@ static int decode_write(AVCodecContext *avctx, AVPacket *packet)
 			goto fail;
 		}
 
-		if (frame->format == hw_pix_fmt)
+		if (frame->hw_frames_ctx)
 		{
 			/* 将解码后的数据从GPU内存存格式转为CPU内存格式，并完成GPU到CPU内存的拷贝*/
-			if ((ret = av_hwframe_transfer_data(sw_frame, frame, 0)) < 0)
+			if ((ret = accel->Download(sw_frame, frame)) < 0)
 			{
 				fprintf(stderr, "Error transferring the data to system memory\n");
 				goto fail;
@@ -137,8 +109,6 @@ int main(int argc, char *argv[])
 	AVCodecContext *decoder_ctx = NULL;
 	const AVCodec * decoder = NULL;
 	AVPacket packet;
-	enum AVHWDeviceType type;
-	int i;
 
 	if (argc < 4)
 	{
@@ -146,16 +116,15 @@ int main(int argc, char *argv[])
 		return -1;
 	}
 	// 设备类型为：cuda dxva2 qsv d3d11va opencl，通常在windows使用d3d11va或者dxva2
-	type = av_hwdevice_find_type_by_name(argv[1]); // 根据设备名找到设备类型
-	if (type == AV_HWDEVICE_TYPE_NONE)
+	// cpu：软件解码，帧从和硬件一样固定大小的池里取
+	if (strcmp(argv[1], "cpu") != 0 && av_hwdevice_find_type_by_name(argv[1]) == AV_HWDEVICE_TYPE_NONE)
 	{
 		fprintf(stderr, "Device type %s is not supported.\n", argv[1]);
-		fprintf(stderr, "Available device types:");
-		while ((type = av_hwdevice_iterate_types(type)) != AV_HWDEVICE_TYPE_NONE)
-			fprintf(stderr, " %s", av_hwdevice_get_type_name(type));
-		fprintf(stderr, "\n");
+		fprintf(stderr, "Available device types: %s\n", AccelNames().c_str());
 		return -1;
 	}
+	std::unique_ptr<CAccel> accel_holder(CreateAccel(argv[1]));
+	accel = accel_holder.get();
 
 	/* open the input file */
 	if (avformat_open_input(&input_ctx, argv[2], NULL, NULL) != 0)
@@ -179,24 +148,6 @@ int main(int argc, char *argv[])
 	}
 	video_stream = ret;
 
-	// 查找到对应硬件类型解码后的数据格式
-	for (i = 0;; i++)
-	{
-		const AVCodecHWConfig *config = avcodec_get_hw_config(decoder, i);
-		if (!config)
-		{
-			fprintf(stderr, "Decoder %s does not support device type %s.\n",
-					decoder->name, av_hwdevice_get_type_name(type));
-			return -1;
-		}
-		if (config->methods & AV_CODEC_HW_CONFIG_METHOD_HW_DEVICE_CTX &&
-			config->device_type == type)
-		{
-			hw_pix_fmt = config->pix_fmt;
-			break;
-		}
-	}
-
 	if (!(decoder_ctx = avcodec_alloc_context3(decoder)))
 		return AVERROR(ENOMEM);
 
@@ -204,10 +155,8 @@ int main(int argc, char *argv[])
 	if (avcodec_parameters_to_context(decoder_ctx, video->codecpar) < 0)
 		return -1;
 
-	decoder_ctx->get_format = get_hw_format;
-
-	// 硬件加速初始化
-	if (hw_decoder_init(decoder_ctx, type) < 0)
+	// 硬件加速初始化(解码格式协商、设备)，cpu 时设置从池里取帧
+	if (accel->InitDecoder(decoder_ctx, decoder, 0) < 0)
 		return -1;
 
 	if ((ret = avcodec_open2(decoder_ctx, decoder, NULL)) < 0)
@@ -241,7 +190,6 @@ int main(int argc, char *argv[])
 		fclose(output_file);
 	avcodec_free_context(&decoder_ctx);
 	avformat_close_input(&input_ctx);
-	av_buffer_unref(&hw_device_ctx);
 
 	return 0;
 }
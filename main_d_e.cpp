@@ -15,110 +15,86 @@ extern "C"
 #include <libavutil/imgutils.h>
 #include <libswscale/swscale.h>
 #include <libavutil/opt.h>
+#include <libavutil/pixdesc.h>
 #include <libavutil/imgutils.h>
 }
 
+#include <algorithm>
 #include <iostream>
+#include <memory>
 #include <sys/time.h>
-//#include "cspdlog.h"
+#include "cspdlog.h"
+#include "ccmdline.h"
+#include "cmemtrack.h"
+#include "cframetee.h"
+#include "cpacketring.h"
+#include "cencodesink.h"
+#include "cframecache.h"
+#include "checkpoint.h"
+#include "caffinity.h"
+#include "ctrace.h"
+#include "timestamp.h"
+#include "caccel.h"
+#include "pixfmttraits.h"
+#include "ctilesink.h"
+#include "cjobstats.h"
+#include "cautotune.h"
 #include <pthread.h>
 
 
 
 
-static AVBufferRef *hw_device_ctx = NULL;// 硬件设备上下文
-static enum AVPixelFormat hw_pix_fmt;
-static FILE *output_file = NULL; // 解码后 编码前 输出文件
+static CFrameTee *frame_tee = NULL; // 解码后的输出端(编码/原始数据/丢弃/校验)
+static int64_t resume_pts = AV_NOPTS_VALUE; // 断点续传时丢掉这个 PTS 之前的帧
+static int64_t max_frames = 0; // >0 时只处理这么多帧(调参时的短时测试)
+static bool frames_limited = false; // 因为 max_frames 提前结束，输入不完整
 
-AVCodecContext* codec_ctx_en = nullptr; // 编码器上下文
-// 帧率（30帧/秒）
-const AVRational frame_rate = { 30, 1 };// 帧率
+// 帧率（默认30帧/秒，打开输入后取输入视频的帧率）
+AVRational frame_rate = { 30, 1 };// 帧率
 // 输出文件名
 const char* output_filename = "encode_output.mp4"; // 编码后输出文件名
-AVFormatContext* fmt_ctx_en = nullptr;  // 输出文件上下文
-AVPacket * pkt = nullptr;             // 编码后的数据包
-AVStream * stream = nullptr;	// 编码后输出流
 
-#define ENCODE_OPEN 1
-#define WRITE_NV12  0
 
-
-int64_t num_frames = 0; // 解码帧数
 int width_en = 0;
 int height_en = 0;
+enum AVPixelFormat sw_format_en = AV_PIX_FMT_NV12; // 解码出来的内存格式：硬件解码 NV12/P010，cpu 为解码器的原始格式
 int bit_rate = 4;//M
 int gop_size = 0;//多少帧出一帧关键帧
 
 
 
 
-int64_t GetCurrentStamp()
-{
-	struct timeval tv;
-    struct timezone tz;
-    gettimeofday(&tv, &tz);
-	return tv.tv_sec * 1000 + tv.tv_usec / 1000;
-}
-
-
-
-// 硬件加速初始化
-static int hw_decoder_init(AVCodecContext *ctx, const enum AVHWDeviceType type)
-{
-	int err = 0;
-	// 创建一个硬件设备上下文
-	if ((err = av_hwdevice_ctx_create(&hw_device_ctx, type,	NULL, NULL, 0)) < 0)
-	{
-		fprintf(stderr, "Failed to create specified HW device.\n");
-		return err;
-	}
-	ctx->hw_device_ctx = av_buffer_ref(hw_device_ctx);
-
-	return err;
-}
-
-// 获取GPU硬件解码帧的格式
-static enum AVPixelFormat get_hw_format(AVCodecContext *ctx, const enum AVPixelFormat *pix_fmts)
-{
-	const enum AVPixelFormat *p;
-
-	for (p = pix_fmts; *p != -1; p++)
-	{
-		if (*p == hw_pix_fmt)
-			return *p;
-	}
-
-	fprintf(stderr, "Failed to get HW surface format.\n");
-	return AV_PIX_FMT_NONE;
-}
-
-// 解码后数据格式转换，GPU到CPU拷贝，YUV数据dump到文件
+// 解码，解码后的帧交给各输出端
 static int decode_write(AVCodecContext *avctx, AVPacket *packet)
 {
-	AVFrame *frame = NULL, *sw_frame = NULL;
-	AVFrame *tmp_frame = NULL;
-	uint8_t *buffer = NULL;
-	int size;
+	CMemTrack *mem = CMemTrack::GetInstance();
+	AVFrame *frame = NULL;
 	int ret = 0;
 
+	static int64_t decoded_frames = 0;
 	int64_t decode_start = GetCurrentStamp();
-	ret = avcodec_send_packet(avctx, packet);
+	{
+		TRACE_SCOPE("decode_send", decoded_frames);
+		ret = avcodec_send_packet(avctx, packet);
+	}
 	if (ret < 0)
 	{
-		fprintf(stderr, "Error during decoding\n");
+		MYLOG_ERROR(LOG_MOD_DECODE, "Error during decoding");
 		return ret;
 	}
 
 	while (1)
 	{
-		if (!(frame = av_frame_alloc()) || !(sw_frame = av_frame_alloc()))
+		if (!(frame = mem->FrameAlloc(MEM_STAGE_DECODE)))
 		{
-			fprintf(stderr, "Can not alloc frame\n");
-			ret = AVERROR(ENOMEM);
-			goto failed;
+			MYLOG_ERROR(LOG_MOD_DECODE, "Can not alloc frame");
+			return AVERROR(ENOMEM);
 		}
 
-		ret = avcodec_receive_frame(avctx, frame);
+		{
+			TRACE_SCOPE("decode_receive", decoded_frames);
+			ret = avcodec_receive_frame(avctx, frame);
+		}
 
 		
 		{
@@ -126,144 +102,56 @@ static int decode_write(AVCodecContext *avctx, AVPacket *packet)
 			decode_end = GetCurrentStamp();
 			int64_t temp = decode_end - decode_start;
 			if(temp > 50)
-				printf("--------------decode spends %ld us\n", temp);
+				MYLOG_WARN(LOG_MOD_DECODE, "--------------decode spends %ld ms", temp);
 			else
-				printf("decode spends %ld us\n", temp);
+				MYLOG_DEBUG(LOG_MOD_DECODE, "decode spends %ld ms", temp);
 
 		}
 		
 		if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
 		{
-			av_frame_free(&frame);
-			av_frame_free(&sw_frame);
+			mem->FrameFree(&frame);
 			return 0;
 		}
 		else if (ret < 0)
 		{
-			fprintf(stderr, "Error while decoding\n");
-			goto failed;
+			MYLOG_ERROR(LOG_MOD_DECODE, "Error while decoding");
+			mem->FrameFree(&frame);
+			return ret;
 		}
+		mem->FrameUpdate(frame);
 
-		
-
-		// if (frame->format == hw_pix_fmt)
-		// {
-		// 	/* 将解码后的数据从GPU内存存格式转为CPU内存格式，并完成GPU到CPU内存的拷贝*/
-		// 	if ((ret = av_hwframe_transfer_data(sw_frame, frame, 0)) < 0)
-		// 	{
-		// 		fprintf(stderr, "Error transferring the data to system memory\n");
-		// 		goto fail;
-		// 	}
-		// 	tmp_frame = sw_frame;
-		// }
-		// else
-		//	tmp_frame = frame;
-		
-
-		
-		if(ENCODE_OPEN)
+		// 续传时从关键帧开始解码，已提交的帧不再输出
+		frame->pts = frame->best_effort_timestamp;
+		if (resume_pts != AV_NOPTS_VALUE && frame->pts != AV_NOPTS_VALUE && frame->pts < resume_pts)
 		{
-			// 设置帧的显示时间戳（PTS）
-			//tmp_frame->pts = num_frames * 3000;
-			//num_frames++;
-
-			// 设置帧的显示时间戳（PTS）
-			frame->pts = num_frames * 6000;
-			num_frames ++;
-
-
-			int64_t now_start = GetCurrentStamp();
-			// 发送帧到编码器
-			ret = avcodec_send_frame(codec_ctx_en, frame);
-			if (ret < 0)
-			{
-				throw std::runtime_error("Error sending frame to encoder");
-			}
-	
-			// 接收编码后的数据包
-			pkt = av_packet_alloc();
-			while (ret >= 0)
-			{				
-				ret = avcodec_receive_packet(codec_ctx_en, pkt);
-				if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
-				{
-					av_packet_free(&pkt);
-					ret = 0;
-					break;
-				}
-
-				int64_t now_end = GetCurrentStamp();
-
-				int64_t temp = now_end - now_start;
-				if(temp > 50)
-					printf("++++++++++++++++++encode spends %ld us\n", temp);
-				else
-					printf("encode spends %ld us\n", temp);				
-				
-				// 设置数据包的流索引和时间基
-				pkt->stream_index = stream->index;
-				//pkt->time_base = AVRational{1, 90000};
-	
-				// 写入数据包到输出文件
-				ret = av_interleaved_write_frame(fmt_ctx_en, pkt);
-				if (ret < 0)
-				{
-					throw std::runtime_error("Error writing packet to file");
-				}
-	
-				// 释放数据包
-				av_packet_unref(pkt);
-			}
-
+			mem->FrameFree(&frame);
+			continue;
 		}
 
-		if(WRITE_NV12)
+		// 解码器的硬件帧池在第一帧出来后才确定
+		static bool decode_pool_registered = false;
+		if (!decode_pool_registered && frame->hw_frames_ctx)
 		{
-			if (frame->format == hw_pix_fmt)
-			{
-				/* 将解码后的数据从GPU内存存格式转为CPU内存格式，并完成GPU到CPU内存的拷贝*/
-				if ((ret = av_hwframe_transfer_data(sw_frame, frame, 0)) < 0)
-				{
-					fprintf(stderr, "Error transferring the data to system memory\n");
-					goto failed;
-				}
-				tmp_frame = sw_frame;
-			}
-			else
-				tmp_frame = frame;
+			AVHWFramesContext *pool = (AVHWFramesContext *)frame->hw_frames_ctx->data;
+			mem->SetHwPool(frame->hw_frames_ctx, "decode", pool->initial_pool_size);
+			decode_pool_registered = true;
+		}
 
-			// 计算一张YUV图需要的内存 大小
-			size = av_image_get_buffer_size((AVPixelFormat)tmp_frame->format, tmp_frame->width, tmp_frame->height, 1);
-			// 分配内存
-			buffer = (uint8_t *)av_malloc(size);
-			if (!buffer)
-			{
-				fprintf(stderr, "Can not alloc buffer\n");
-				ret = AVERROR(ENOMEM);
-				goto failed;
-			}
-			// 将图片数据拷贝的buffer中(按行拷贝)
-			ret = av_image_copy_to_buffer(buffer, size, (const uint8_t *const *)tmp_frame->data, (const int *)tmp_frame->linesize,
-										  (AVPixelFormat)tmp_frame->format, tmp_frame->width, tmp_frame->height, 1);
-			if (ret < 0)
-			{
-				fprintf(stderr, "Can not copy image to buffer\n");
-				goto failed;
-			}
-			// buffer数据dump到文件
-			if ((ret = fwrite(buffer, 1, size, output_file)) < 0)
-			{
-				fprintf(stderr, "Failed to dump raw data.\n");
-				goto failed;
-			}
+		if (max_frames > 0 && decoded_frames >= max_frames)
+		{
+			frames_limited = true;
+			mem->FrameFree(&frame);
+			return AVERROR_EOF;
 		}
-		
-        
 
-	failed:
-		av_frame_free(&frame);
-		av_frame_free(&sw_frame);
-		av_freep(&buffer);
+		// 每个输出端拿到一个引用，在各自的线程里处理；队列满时在这里等
+		{
+			TRACE_SCOPE("tee_push", decoded_frames);
+			ret = frame_tee->Push(frame);
+		}
+		decoded_frames++;
+		mem->FrameFree(&frame);
 		if (ret < 0)
 			return ret;
 	}
@@ -271,284 +159,561 @@ static int decode_write(AVCodecContext *avctx, AVPacket *packet)
 
 
 
-int main(int argc, char *argv[])
+// 从帧缓存读帧交给各输出端
+static int cache_read(CFrameCacheReader &reader)
+{
+	CMemTrack *mem = CMemTrack::GetInstance();
+	int64_t frames = 0;
+	int ret = 0;
+
+	while (ret >= 0)
+	{
+		if (max_frames > 0 && frames++ >= max_frames)
+		{
+			frames_limited = true;
+			break;
+		}
+		AVFrame *frame = mem->FrameAlloc(MEM_STAGE_CACHE);
+		if (!frame)
+			return AVERROR(ENOMEM);
+
+		{
+			TRACE_SCOPE("cache_read");
+			ret = reader.Read(frame);
+		}
+		if (ret >= 0)
+		{
+			mem->FrameUpdate(frame);
+			TRACE_SCOPE("tee_push");
+			ret = frame_tee->Push(frame);
+		}
+		mem->FrameFree(&frame);
+	}
+	return ret == AVERROR_EOF ? 0 : ret;
+}
+
+// 打开输入文件，找到视频流并打开硬件解码器
+static int open_input(const char *filename, CAccel *accel, int extra_hw_frames,
+					  AVFormatContext **input_ctx, AVCodecContext **decoder_ctx, int *video_stream)
 {
-	//std::shared_ptr<MYSPDLOG::CSpdlog> splog(MYSPDLOG::GetInstance());
-	AVFormatContext *input_ctx = NULL;
-	int video_stream, ret;
 	AVStream *video = NULL;
-	AVCodecContext *decoder_ctx = NULL;
 	AVCodec * decoder_codec = NULL;
-	AVPacket packet;
-	enum AVHWDeviceType type;
-	int i;
+	int ret;
 
-	if (argc < 4)
+	/* open the input file */
+	if (avformat_open_input(input_ctx, filename, NULL, NULL) != 0)
 	{
-		fprintf(stderr, "Usage: %s <device type> <input file> <output file>\n", argv[0]);
+		MYLOG_ERROR(LOG_MOD_DEMUX, "Cannot open input file '%s'", filename);
 		return -1;
 	}
-	// 设备类型为：cuda dxva2 qsv d3d11va opencl，通常在windows使用d3d11va或者dxva2
-	type = av_hwdevice_find_type_by_name(argv[1]); // 根据设备名找到设备类型
-	if (type == AV_HWDEVICE_TYPE_NONE)
+
+	if (avformat_find_stream_info(*input_ctx, NULL) < 0)
 	{
-		fprintf(stderr, "Device type %s is not supported.\n", argv[1]);
-		fprintf(stderr, "Available device types:");
-		while ((type = av_hwdevice_iterate_types(type)) != AV_HWDEVICE_TYPE_NONE)
-			fprintf(stderr, " %s", av_hwdevice_get_type_name(type));
-		fprintf(stderr, "\n");
+		MYLOG_ERROR(LOG_MOD_DEMUX, "Cannot find input stream information.");
 		return -1;
 	}
 
-	/* open the input file */
-	if (avformat_open_input(&input_ctx, argv[2], NULL, NULL) != 0)
+	/* find the video stream information */// 查找视频流信息
+	ret = av_find_best_stream(*input_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, &decoder_codec, 0);
+	if (ret < 0)
 	{
-		fprintf(stderr, "Cannot open input file '%s'\n", argv[2]);
+		MYLOG_ERROR(LOG_MOD_DEMUX, "Cannot find a video stream in the input file");
 		return -1;
 	}
+	*video_stream = ret;
 
-	output_filename = argv[3];
-	int nTmp = atoi(argv[4]);
-	if(nTmp > 0)
-		bit_rate = nTmp;
-
+	if (!(*decoder_ctx = avcodec_alloc_context3(decoder_codec)))
+		return AVERROR(ENOMEM);
 
+	video = (*input_ctx)->streams[*video_stream];
+	if (avcodec_parameters_to_context(*decoder_ctx, video->codecpar) < 0)
+		return -1;
 	
-	if (avformat_find_stream_info(input_ctx, NULL) < 0)
+	MYLOG_INFO(LOG_MOD_MAIN, "width:%d,height:%d", video->codecpar->width, video->codecpar->height);
+	width_en = video->codecpar->width;
+	height_en = video->codecpar->height;
+	// 硬件解码只有 4:2:0 10 位(Main10/HDR)出来是 P010，其他是 NV12；
+	// cpu 软件解码直接输出解码器的格式(yuv420p、yuv420p10le 等)，不是 P010
+	const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get((enum AVPixelFormat)video->codecpar->format);
+	if (!accel->Device())
+		sw_format_en = desc ? (enum AVPixelFormat)video->codecpar->format : AV_PIX_FMT_YUV420P;
+	else if (desc && desc->comp[0].depth == 10 && desc->log2_chroma_w == 1 && desc->log2_chroma_h == 1)
+		sw_format_en = AV_PIX_FMT_P010;
+	else
+		sw_format_en = AV_PIX_FMT_NV12;
+	MYLOG_INFO(LOG_MOD_DECODE, "decoded frames are %s", av_get_pix_fmt_name(sw_format_en));
+
+	// 拷贝音频/字幕时视频时间要和输入一致，编码帧率跟随输入
+	AVRational rate = av_guess_frame_rate(*input_ctx, video, NULL);
+	if (rate.num > 0 && rate.den > 0)
+		frame_rate = rate;
+
+	// 硬件加速初始化，cpu 时软件解码；输出端队列里的帧还占着解码器的帧
+	if (accel->InitDecoder(*decoder_ctx, decoder_codec, extra_hw_frames) < 0)
 	{
-		fprintf(stderr, "Cannot find input stream information.\n");
+		MYLOG_ERROR(LOG_MOD_DECODE, "Decoder %s does not support device type %s.", decoder_codec->name, accel->Name());
 		return -1;
 	}
 
-	/* find the video stream information */// 查找视频流信息
-	ret = av_find_best_stream(input_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, &decoder_codec, 0);
-	if (ret < 0)
+	if ((ret = avcodec_open2(*decoder_ctx, decoder_codec, NULL)) < 0)
 	{
-		fprintf(stderr, "Cannot find a video stream in the input file\n");
+		MYLOG_ERROR(LOG_MOD_DECODE, "Failed to open codec for stream #%u", *video_stream);
 		return -1;
 	}
-	video_stream = ret;
 
-	// 查找到对应硬件类型解码后的数据格式
-	for (i = 0;; i++)
-	{
-		const AVCodecHWConfig *config = avcodec_get_hw_config(decoder_codec, i);
-		if (!config)
-		{
-			fprintf(stderr, "Decoder %s does not support device type %s.\n",
-				decoder_codec->name, av_hwdevice_get_type_name(type));
-			return -1;
-		}
-		if (config->methods & AV_CODEC_HW_CONFIG_METHOD_HW_DEVICE_CTX &&
-			config->device_type == type)
-		{
-			hw_pix_fmt = config->pix_fmt;
-			break;
-		}
-	}
+	return 0;
+}
 
-	if (!(decoder_ctx = avcodec_alloc_context3(decoder_codec)))
-		return AVERROR(ENOMEM);
 
-	video = input_ctx->streams[video_stream];
-	if (avcodec_parameters_to_context(decoder_ctx, video->codecpar) < 0)
-		return -1;
-	
-	printf("width:%d,height:%d\n",video->codecpar->width,video->codecpar->height);
-	width_en = video->codecpar->width;
-	height_en = video->codecpar->height;
 
-	decoder_ctx->get_format = get_hw_format;
+int main(int argc, char *argv[])
+{
+	std::shared_ptr<MYSPDLOG::CSpdlog> splog(MYSPDLOG::GetInstance());
+	CCmdLine cmdline;
+	CMemTrack *mem = CMemTrack::GetInstance();
+	AVFormatContext *input_ctx = NULL;
+	int video_stream = -1, ret = 0;
+	AVCodecContext *decoder_ctx = NULL;
+	AVPacket *packet = NULL;
 
-	// 硬件加速初始化
-	if (ret = hw_decoder_init(decoder_ctx, type) < 0)
+	CJobStats::GetInstance()->Start();
+	cmdline.Parse(argc, argv);
+	if (cmdline.PositionalCount() > 0 && strcmp(cmdline.Positional(0), "autotune") == 0)
+		return RunAutotune(argc, argv, cmdline);
+	if (cmdline.Has("profile") && !cmdline.LoadProfile(cmdline.GetStr("profile")))
+	{
+		fprintf(stderr, "Cannot read profile '%s'\n", cmdline.GetStr("profile"));
+		return -1;
+	}
+	if (cmdline.PositionalCount() < 3)
+	{
+		fprintf(stderr, "Usage: %s <device type|cpu> <input file> <output file> [bit rate(M)] [options]\n", argv[0]);
+		fprintf(stderr, "       %s autotune <device type|cpu> <sample clip> <profile> [bit rate(M)] [options]\n", argv[0]);
+		fprintf(stderr, "  --profile=<path>         read options from a profile (name=value per line, e.g. written by autotune); command line wins\n");
+		fprintf(stderr, "  --log-level=<spec>       per-module levels, e.g. \"info,decode=debug\" (trace/debug/info/warn/error/off)\n");
+		fprintf(stderr, "  --log-level-file=<path>  reload log levels from this file when it changes\n");
+		fprintf(stderr, "  --log-file=<path>        also write log to file\n");
+		fprintf(stderr, "  --log-syslog             also write log to syslog\n");
+		fprintf(stderr, "  --log-rate=<n>           max messages per second per call site (0 = unlimited)\n");
+		fprintf(stderr, "  --session=<name>         session name used in reports (default: output file)\n");
+		fprintf(stderr, "  --mem-report=<path>      write the memory report as JSON\n");
+		fprintf(stderr, "  --mem-fail-on-leak       exit with status 2 when tracked buffers leak\n");
+		fprintf(stderr, "  --sink=<list>            comma separated outputs (default: encode):\n");
+		fprintf(stderr, "                             encode[:file]  encode to <output file> or file\n");
+		fprintf(stderr, "                             raw[:file]     raw decoded frames (default testout.<format>: nv12, p010, or the decoder format with cpu)\n");
+		fprintf(stderr, "                             null           discard, decode throughput only\n");
+		fprintf(stderr, "                             hash[:file]    per-frame md5 for determinism checks\n");
+		fprintf(stderr, "                             tiles:<c>x<r>  split each frame into c x r tiles, one encoder per tile (<output>.tileN.mp4)\n");
+		fprintf(stderr, "  --encoder=<name>         vaapi (default), x264, x265, svtav1, auto (default for cpu)\n");
+		fprintf(stderr, "  --encode-preset=<name>   software encoder preset (default: picked from cores and --encode-fps)\n");
+		fprintf(stderr, "  --encode-threads=<n>     software encoder threads (default: available cores)\n");
+		fprintf(stderr, "  --encode-fps=<fps>       software encoder throughput target (default: frame rate)\n");
+		fprintf(stderr, "  --gop=<n>                frames per GOP (default 0, encoder default)\n");
+		fprintf(stderr, "  --max-b-frames=<n>       B frames (default 0)\n");
+		fprintf(stderr, "  --rc-buffer=<seconds>    HRD buffer size as seconds of bit rate (default 2)\n");
+		fprintf(stderr, "  --encode-pool=<n>        vaapi encoder surface pool size (default 20)\n");
+		fprintf(stderr, "  --static-sad=<n>         skip frames whose 1/8 luma+chroma thumbnail differs from the last encoded frame by at most n per pixel (0 off, default)\n");
+		fprintf(stderr, "  --static-max-diff=<n>    but never when any thumbnail pixel differs by more than n (default 24)\n");
+		fprintf(stderr, "  --static-sparse          build the thumbnail from one luma row per 8x8 block (reads 1/8 of the frame, misses chroma-only and thin changes)\n");
+		fprintf(stderr, "  --static-keyint=<n>      after n skipped frames encode a keyframe (default gop size, 2 s of frames when gop is 0; 0 = unlimited)\n");
+		fprintf(stderr, "  --sink-queue=<n>         frames queued per output (default 8)\n");
+		fprintf(stderr, "  --frames=<n>             stop after n frames\n");
+		fprintf(stderr, "  --publish=<list>         extra outputs fed from the encoded packets, no second encode:\n");
+		fprintf(stderr, "                             ts:udp://127.0.0.1:<port>  ts:unix:<path>  hls:<index.m3u8>  file:<path>\n");
+		fprintf(stderr, "  --publish-ring=<n>       packets kept for slow outputs before they skip to a keyframe (default 1024)\n");
+		fprintf(stderr, "  --frame-cache=<dir>      reuse decoded frames cached under dir; filled on the first run\n");
+		fprintf(stderr, "  --frame-cache-segment=<MB>  cache segment file size (default 1024)\n");
+		fprintf(stderr, "  --checkpoint=<seconds>   write GOP aligned segments and a journal; rerun resumes after the last segment\n");
+		fprintf(stderr, "  --checkpoint-restart     ignore an existing journal and start over\n");
+		fprintf(stderr, "  --keyframe-index=0       do not write the <output>.kfi keyframe index next to each mp4/mov/ts output file\n");
+		fprintf(stderr, "  --stream-copy=0          drop audio/subtitle instead of copying them into the encoded output\n");
+		fprintf(stderr, "  --trace=<path>           record per-frame stage timeline, write Chrome trace JSON (open in Perfetto)\n");
+		fprintf(stderr, "  --trace-stall=<ms>       when a stage runs longer, dump the recent timeline to <trace>.stall-N.json\n");
+		fprintf(stderr, "  --trace-window=<ms>      timeline length in stall dumps (default 2000)\n");
+		fprintf(stderr, "  --trace-buffer=<n>       events kept per thread (default 65536)\n");
+		fprintf(stderr, "  --affinity=<policy>      pin threads and memory: none (default), auto, node:<n>, cpus:<list>\n");
+		fprintf(stderr, "  --thread-report=<path>   write per-thread CPU time as JSON\n");
+		fprintf(stderr, "  --job-report=<path>      write CPU time, context switches, bytes read/written and hw transfer bytes per frame as JSON\n");
 		return -1;
+	}
 
-	if ((ret = avcodec_open2(decoder_ctx, decoder_codec, NULL)) < 0)
+	// 日志配置
+	if (cmdline.Has("log-level") && !splog->SetLevels(cmdline.GetStr("log-level")))
+		fprintf(stderr, "Invalid --log-level '%s'\n", cmdline.GetStr("log-level"));
+	if (cmdline.Has("log-level-file"))
+		splog->WatchLevelFile(cmdline.GetStr("log-level-file"));
+	if (cmdline.Has("log-file") && !splog->SetLogFile(cmdline.GetStr("log-file")))
+		fprintf(stderr, "Cannot open log file '%s'\n", cmdline.GetStr("log-file"));
+	if (cmdline.GetBool("log-syslog"))
+		splog->AddSinks(MYSPDLOG::LOG_SINK_SYSLOG);
+	splog->SetRateLimit((int)cmdline.GetInt("log-rate", 50));
+
+	std::vector<std::pair<std::string, std::string> > sink_specs;
+	if (!ParseSinkSpec(cmdline.GetStr("sink", "encode"), sink_specs))
 	{
-		fprintf(stderr, "Failed to open codec for stream #%u\n", video_stream);
+		fprintf(stderr, "Invalid --sink '%s'\n", cmdline.GetStr("sink", "encode"));
 		return -1;
 	}
+	// 分块输出每块一个线程，算解码器额外帧时按块数计
+	int sink_count = 0;
+	for (auto &spec : sink_specs)
+	{
+		int cols = 1, rows = 1;
+		if (spec.first == "tiles" && !ParseTileGrid(spec.second, cols, rows))
+		{
+			fprintf(stderr, "Invalid tile grid '%s', expected tiles:<cols>x<rows>\n", spec.second.c_str());
+			return -1;
+		}
+		sink_count += cols * rows;
+	}
+	int sink_queue = (int)cmdline.GetInt("sink-queue", 8);
+	if (sink_queue < 1)
+		sink_queue = 1;
 
-//****************************************** */
+	// 绑核，之后主线程(解复用+解码)分配的缓冲区都在本节点
+	CAffinity *affinity = CAffinity::GetInstance();
+	if (!affinity->Init(cmdline.GetStr("affinity", "none")))
+	{
+		fprintf(stderr, "Invalid --affinity '%s'\n", cmdline.GetStr("affinity", "none"));
+		return -1;
+	}
+	affinity->BindThread("demux+decode");
 
-	if(ENCODE_OPEN)
+	// 时间线跟踪和卡顿看门狗
+	CTrace *trace = CTrace::GetInstance();
+	if (cmdline.Has("trace") || cmdline.Has("trace-stall"))
 	{
+		trace->Start(cmdline.GetStr("trace"), (size_t)cmdline.GetInt("trace-buffer", 65536),
+					 (int)cmdline.GetInt("trace-stall", 0), (int)cmdline.GetInt("trace-window", 2000));
+		trace->SetThreadName("demux+decode");
+	}
 
-		// 2. 创建硬件帧上下文
-		AVBufferRef *hw_frames_ref = av_hwframe_ctx_alloc(hw_device_ctx);
-		if (!hw_frames_ref)
-		{
-			throw std::runtime_error("Failed to create hardware frames context");
-		}
+	// 设备类型为：cuda dxva2 qsv d3d11va opencl，通常在windows使用d3d11va或者dxva2
+	// cpu：没有显卡的机器，软件解码(帧池和硬件一样固定大小)，编码用软件编码器
+	if (strcmp(cmdline.Positional(0), "cpu") != 0 && av_hwdevice_find_type_by_name(cmdline.Positional(0)) == AV_HWDEVICE_TYPE_NONE)
+	{
+		fprintf(stderr, "Device type %s is not supported.\n", cmdline.Positional(0));
+		fprintf(stderr, "Available device types: %s\n", AccelNames().c_str());
+		return -1;
+	}
 
-		// 配置硬件帧上下文参数
-		AVHWFramesContext *hw_frames_ctx = (AVHWFramesContext *)hw_frames_ref->data;
-		hw_frames_ctx->format = AV_PIX_FMT_VAAPI;	// 硬件像素格式
-		hw_frames_ctx->sw_format = AV_PIX_FMT_NV12; // 软件像素格式
-		//hw_frames_ctx->sw_format = AV_PIX_FMT_VAAPI; // 软件像素格式
-		hw_frames_ctx->width = width_en;				// 视频宽度
-		hw_frames_ctx->height = height_en;				// 视频高度
-		hw_frames_ctx->initial_pool_size = 20;		// 初始帧池大小
-
-		// 3. 查找编码器（使用 hevc_vaapi 编码器）
-		const AVCodec *codec_en = avcodec_find_encoder_by_name("hevc_vaapi");
-		//const AVCodec *codec_en = avcodec_find_encoder_by_name("hevc_nvenc");
-		if (!codec_en)
+	output_filename = cmdline.Positional(2);
+	mem->SetSession(cmdline.GetStr("session", output_filename));
+	CJobStats::GetInstance()->SetSession(cmdline.GetStr("session", output_filename));
+	int nTmp = atoi(cmdline.Positional(3, "0"));
+	if(nTmp > 0)
+		bit_rate = nTmp;
+	gop_size = (int)cmdline.GetInt("gop", gop_size);
+	max_frames = cmdline.GetInt("frames", 0);
+
+	// 断点续传：读上次的日志，已完成就直接退出
+	double checkpoint_sec = cmdline.GetDouble("checkpoint", 0);
+	CheckpointState resume;
+	CheckpointReset(resume);
+	if (checkpoint_sec > 0 && !cmdline.GetBool("checkpoint-restart") && CheckpointLoad(output_filename, resume))
+	{
+		if (resume.complete)
 		{
-			throw std::runtime_error("Codec vaapi not found");
+			MYLOG_INFO(LOG_MOD_MAIN, "%s is already complete (%d segments)", output_filename, resume.segments);
+			return 0;
 		}
+		resume_pts = resume.input_pts;
+		MYLOG_INFO(LOG_MOD_MAIN, "resuming %s at segment %d, frame %ld",
+				   output_filename, resume.segments, (long)resume.frames);
+	}
 
-		// 4. 创建编码器上下文
-		codec_ctx_en = avcodec_alloc_context3(codec_en);
-		if (!codec_ctx_en)
+	// 帧缓存：命中时直接读缓存里的帧，不再解封装和解码
+	CFrameCacheReader cache_reader;
+	std::string cache_dir;
+	bool from_cache = false;
+	if (cmdline.Has("frame-cache"))
+	{
+		cache_dir = FrameCacheDir(cmdline.GetStr("frame-cache"), cmdline.Positional(1));
+		if (cache_dir.empty())
 		{
-			throw std::runtime_error("Could not allocate video codec context");
+			MYLOG_ERROR(LOG_MOD_CACHE, "Cannot open input file '%s'", cmdline.Positional(1));
+			return -1;
 		}
+		from_cache = cache_reader.Open(cache_dir);
+	}
+	// 续传时只有后半段的帧，--frames 限制帧数时只有前一部分，都不能用来填缓存
+	bool fill_cache = !cache_dir.empty() && !from_cache && resume_pts == AV_NOPTS_VALUE && max_frames <= 0;
 
-		// 配置编码器参数
-		codec_ctx_en->hw_frames_ctx = av_buffer_ref(hw_frames_ref); // 绑定硬件帧上下文
-		codec_ctx_en->width = width_en;									// 视频宽度
-		codec_ctx_en->height = height_en;								// 视频高度
-		codec_ctx_en->time_base = av_inv_q(frame_rate);				// 时间基（帧率的倒数）
-		codec_ctx_en->framerate = frame_rate;						// 帧率
-		codec_ctx_en->pix_fmt = AV_PIX_FMT_VAAPI;					// 像素格式
-		codec_ctx_en->bit_rate = bit_rate * 1024 * 1024;					// 码率（ Mbps）
-		codec_ctx_en->rc_min_rate =  bit_rate * 1024 * 1024;
-		codec_ctx_en->rc_max_rate = bit_rate * 1024 * 1024;
-		codec_ctx_en->bit_rate_tolerance = bit_rate * 1024 * 1024 /2; //允许比特流偏离参考的比特数
-		codec_ctx_en->rc_buffer_size = bit_rate * 2;
-
-
-		//codec_ctx_en->rc_initial_buffer_occupancy = codec_ctx_en->rc_buffer_size * 3 / 4;
-		//codec_ctx_en->rc_buffer_aggressivity = (float)1.0;
-		//codec_ctx_en->rc_initial_cplx = 0.5;
-
-		codec_ctx_en->gop_size = gop_size;									// GOP 大小（关键帧间隔）
-		codec_ctx_en->max_b_frames = 0;
-		
-
-		av_opt_set(codec_ctx_en->priv_data,"nal-hrd", "cbr", 0);
-		av_opt_set(codec_ctx_en->priv_data, "profile", "high", 0);
-
-
+	// 加速后端：创建设备，解码和编码共用
+	std::unique_ptr<CAccel> accel(CreateAccel(cmdline.Positional(0)));
+	MYLOG_INFO(LOG_MOD_HW, "accelerator %s", accel->Name());
 
-		
+	if (from_cache)
+	{
+		width_en = cache_reader.Width();
+		height_en = cache_reader.Height();
+		sw_format_en = (enum AVPixelFormat)cache_reader.Format();
+		MYLOG_INFO(LOG_MOD_MAIN, "width:%d,height:%d", width_en, height_en);
+		// 不需要解码器，只用加速后端的设备编码
+	}
+	else if (open_input(cmdline.Positional(1), accel.get(), sink_queue * (sink_count + fill_cache) + 2,
+						&input_ctx, &decoder_ctx, &video_stream) < 0)
+		return -1;
 
-		// 打开编码器
-		ret = avcodec_open2(codec_ctx_en, codec_en, nullptr);		
-		if (ret < 0)
+	// 跳到续传点之前最近的关键帧，之前的帧在 decode_write 中丢掉
+	if (resume_pts != AV_NOPTS_VALUE)
+	{
+		if (from_cache)
+			cache_reader.Seek(resume_pts);
+		else if (av_seek_frame(input_ctx, video_stream, resume_pts, AVSEEK_FLAG_BACKWARD) < 0)
 		{
-			throw std::runtime_error("Could not open codec");
+			MYLOG_ERROR(LOG_MOD_DEMUX, "Cannot seek '%s' to resume point", cmdline.Positional(1));
+			return -1;
 		}
+	}
 
-		// 7. 创建输出文件上下文
-		ret = avformat_alloc_output_context2(&fmt_ctx_en, nullptr, nullptr, output_filename);
-		if (ret < 0)
+	// 音频/字幕流不解码，数据包直接拷贝到编码输出文件
+	std::vector<AVStream *> copy_streams;
+	if (input_ctx && cmdline.GetBool("stream-copy", true))
+	{
+		for (unsigned i = 0; i < input_ctx->nb_streams; i++)
 		{
-			throw std::runtime_error("Could not create output context");
+			AVStream *st = input_ctx->streams[i];
+			if ((int)i != video_stream &&
+				(st->codecpar->codec_type == AVMEDIA_TYPE_AUDIO || st->codecpar->codec_type == AVMEDIA_TYPE_SUBTITLE))
+				copy_streams.push_back(st);
 		}
+	}
+	else if (from_cache && cmdline.GetBool("stream-copy", true))
+		MYLOG_WARN(LOG_MOD_MAIN, "reading from frame cache, audio and subtitle streams are not copied");
 
-		// 8. 创建视频流
-		stream = avformat_new_stream(fmt_ctx_en, nullptr);
-		if (!stream)
-		{
-			throw std::runtime_error("Could not create video stream");
-		}
+//****************************************** */
 
-		// 从编码器上下文复制参数到视频流
-		avcodec_parameters_from_context(stream->codecpar, codec_ctx_en);
-		stream->time_base = AVRational{1, 90000}; // 时间基
+	// 输出端，可以同时有多个，每个一个线程
+	// 直播/录制输出共用主编码器的数据包，不再重复编码
+	std::vector<std::pair<std::string, std::string> > publish_specs;
+	if (cmdline.Has("publish") && !ParseOutputSpec(cmdline.GetStr("publish"), publish_specs))
+	{
+		fprintf(stderr, "Invalid --publish '%s'\n", cmdline.GetStr("publish"));
+		return -1;
+	}
+	std::unique_ptr<CPacketRing> ring;
+	std::vector<std::unique_ptr<CRingOutput> > outputs;
+	if (!publish_specs.empty())
+	{
+		ring.reset(new CPacketRing((size_t)cmdline.GetInt("publish-ring", 1024)));
+		for (auto &spec : publish_specs)
+			outputs.emplace_back(new CRingOutput(ring.get(), spec.first, spec.second));
+	}
 
-		// 9. 打开输出文件
-		if (!(fmt_ctx_en->oformat->flags & AVFMT_NOFILE))
+	// 编码输出端的公共配置
+	auto encode_config = [&](const std::string &filename)
+	{
+		EncodeConfig cfg;
+		cfg.hw_device_ctx = accel->Device();
+		cfg.width = width_en;
+		cfg.height = height_en;
+		cfg.sw_format = sw_format_en;
+		cfg.color_primaries = input_ctx ? input_ctx->streams[video_stream]->codecpar->color_primaries : AVCOL_PRI_UNSPECIFIED;
+		cfg.color_trc = input_ctx ? input_ctx->streams[video_stream]->codecpar->color_trc : AVCOL_TRC_UNSPECIFIED;
+		cfg.colorspace = input_ctx ? input_ctx->streams[video_stream]->codecpar->color_space : AVCOL_SPC_UNSPECIFIED;
+		cfg.color_range = input_ctx ? input_ctx->streams[video_stream]->codecpar->color_range : AVCOL_RANGE_UNSPECIFIED;
+		cfg.frame_rate = frame_rate;
+		cfg.bit_rate = (int64_t)bit_rate * 1024 * 1024;
+		cfg.gop_size = gop_size;
+		cfg.max_b_frames = (int)cmdline.GetInt("max-b-frames", 0);
+		cfg.rc_buffer = cmdline.GetDouble("rc-buffer", 2);
+		cfg.pool_size = (int)cmdline.GetInt("encode-pool", 20);
+		cfg.output_filename = filename;
+		// 断点续传只对主输出文件生效
+		cfg.checkpoint_frames = filename == output_filename ? (int)(checkpoint_sec * av_q2d(frame_rate)) : 0;
+		cfg.resume = resume;
+		if (filename != output_filename)
+			CheckpointReset(cfg.resume);
+		cfg.src_time_base = input_ctx ? input_ctx->streams[video_stream]->time_base : av_inv_q(frame_rate);
+		cfg.copy_streams = copy_streams;
+		cfg.encoder = cmdline.GetStr("encoder", accel->DefaultEncoder());
+		cfg.preset = cmdline.GetStr("encode-preset", "");
+		cfg.threads = (int)cmdline.GetInt("encode-threads", 0);
+		cfg.target_fps = cmdline.GetDouble("encode-fps", 0);
+		cfg.static_cfg.mean_diff = cmdline.GetDouble("static-sad", 0);
+		cfg.static_cfg.max_diff = (int)cmdline.GetInt("static-max-diff", 24);
+		cfg.static_cfg.sparse = cmdline.GetBool("static-sparse");
+		// 静止画面也要定期有关键帧，后加入的环/HLS 观众才能开始播放
+		cfg.static_cfg.keyint = (int)cmdline.GetInt("static-keyint", gop_size > 0 ? gop_size : std::max(1, (int)(2 * av_q2d(frame_rate) + 0.5)));
+		cfg.keyframe_index = cmdline.GetBool("keyframe-index", true);
+		cfg.ring = NULL;
+		return cfg;
+	};
+
+	std::unique_ptr<CFrameTee> tee(new CFrameTee());
+	std::vector<CEncodeSink *> encode_sinks;
+	std::vector<std::shared_ptr<CTileStats> > tile_stats;
+	for (auto &spec : sink_specs)
+	{
+		if (spec.first == "encode")
 		{
-			ret = avio_open(&fmt_ctx_en->pb, output_filename, AVIO_FLAG_WRITE);
-			if (ret < 0)
+			EncodeConfig cfg = encode_config(spec.second.empty() ? output_filename : spec.second);
+			// 只有第一个编码输出写环
+			cfg.ring = encode_sinks.empty() ? ring.get() : NULL;
+			CEncodeSink *sink = new CEncodeSink(cfg);
+			tee->AddSink(sink);
+			encode_sinks.push_back(sink);
+		}
+		else if (spec.first == "tiles")
+		{
+			int cols, rows;
+			ParseTileGrid(spec.second, cols, rows);
+			std::vector<TileRect> rects = TileLayout(width_en, height_en, cols, rows);
+			if (rects.empty())
+			{
+				fprintf(stderr, "%dx%d is too small for %s tiles\n", width_en, height_en, spec.second.c_str());
+				return -1;
+			}
+			std::shared_ptr<CTileStats> stats(new CTileStats(rects));
+			tile_stats.push_back(stats);
+			std::shared_ptr<CTileSource> source(new CTileSource((int)rects.size()));
+			// 码率按面积分，按累计面积取整，舍入的零头落到各块上，总和正好是目标码率
+			std::vector<int64_t> tile_rate;
+			int64_t total_rate = (int64_t)bit_rate * 1024 * 1024;
+			int64_t total_area = (int64_t)width_en * height_en;
+			int64_t area = 0;
+			for (const TileRect &rect : rects)
+			{
+				int64_t start = total_rate * area / total_area;
+				area += (int64_t)rect.w * rect.h;
+				tile_rate.push_back(total_rate * area / total_area - start);
+			}
+			for (size_t i = 0; i < rects.size(); i++)
 			{
-				throw std::runtime_error("Could not open output file");
+				// 每块独立的编码会话：码率按面积分，软件编码的线程平分可用核，
+				// 不拷贝音频、不做断点和静止帧跳过(各块跳的帧不同，拼不回去)
+				EncodeConfig cfg = encode_config(TilePath(output_filename, (int)i));
+				cfg.width = rects[i].w;
+				cfg.height = rects[i].h;
+				cfg.bit_rate = tile_rate[i];
+				if (cfg.threads == 0)
+					cfg.threads = std::max(1, AvailableCores() / (int)rects.size());
+				cfg.copy_streams.clear();
+				cfg.checkpoint_frames = 0;
+				cfg.static_cfg.mean_diff = 0;
+				tee->AddSink(new CTileSink(new CEncodeSink(cfg), (int)i, rects[i], source, stats));
 			}
 		}
-
-		// 10. 写入文件头
-		ret = avformat_write_header(fmt_ctx_en, nullptr);
-		if (ret < 0)
+		else if (spec.first == "raw")
 		{
-			throw std::runtime_error("Error writing header to output file");
+			// 默认文件名按实际的内存格式，yuv420p10le 不会叫成 .p010
+			std::string raw_path = spec.second;
+			if (raw_path.empty())
+				raw_path = std::string("testout.") + (sw_format_en == AV_PIX_FMT_NV12 ? Nv12Traits::Name() :
+													  sw_format_en == AV_PIX_FMT_P010 ? P010Traits::Name() : av_get_pix_fmt_name(sw_format_en));
+			tee->AddSink(new CRawDumpSink(raw_path.c_str()));
 		}
+		else if (spec.first == "null")
+			tee->AddSink(new CNullSink());
+		else if (spec.first == "hash")
+			tee->AddSink(new CHashSink(spec.second.c_str()));
 	}
-
-
-
-
-//****************************************** */
-
-	if(WRITE_NV12)
+	if (fill_cache)
+		tee->AddSink(new CFrameCacheSink(cache_dir, cmdline.Positional(1), cmdline.GetInt("frame-cache-segment", 1024) << 20));
+	if (ring && encode_sinks.empty())
 	{
-		/* open the file to dump raw data */
-		output_file = fopen("testout.nv12", "w+b");
+		fprintf(stderr, "--publish needs an encode sink\n");
+		return -1;
 	}
-	
-
 
-	/* actual decoding and dump the raw data */
-	while (ret >= 0)
+	// 结束时才用的选项先取出来，再检查没用到的选项：多半是拼错了(--sink-queu=4)，或者这次运行用不上
+	const char *autotune_result = cmdline.GetStr("autotune-result");
+	const char *thread_report = cmdline.GetStr("thread-report");
+	const char *job_report = cmdline.GetStr("job-report");
+	const char *mem_report = cmdline.GetStr("mem-report");
+	bool mem_fail_on_leak = cmdline.GetBool("mem-fail-on-leak");
+	for (auto &name : cmdline.Unused())
+		MYLOG_WARN(LOG_MOD_MAIN, "option --%s is unknown or not used by this run, ignored", name);
+
+	tee->Open();
+	tee->Start(sink_queue);
+	for (auto &output : outputs)
+		output->Start();
+	frame_tee = tee.get();
+	int64_t run_start = GetCurrentStamp();
+
+	// 输入是否完整读完：读到文件尾、解码器已刷新、没有被 --frames 截断
+	bool input_complete = false;
+	if (from_cache)
 	{
-		if ((ret = av_read_frame(input_ctx, &packet)) < 0)
-			break;
-
-		if (video_stream == packet.stream_index)
-			ret = decode_write(decoder_ctx, &packet); // 解码并dump文件
-
-		av_packet_unref(&packet);
+		ret = cache_read(cache_reader);
+		input_complete = ret >= 0;
 	}
-
-	// /* flush the decoder */
-	// packet.data = NULL;
-	// packet.size = 0;
-	// ret = decode_write(decoder_ctx, &packet);
-
-	if(ENCODE_OPEN)
+	else
 	{
-		// 12. 刷新编码器（发送空帧以刷新缓冲区）
-		ret = avcodec_send_frame(codec_ctx_en, nullptr);
+		packet = mem->PacketAlloc(MEM_STAGE_DEMUX);
+		if (!packet)
+			return AVERROR(ENOMEM);
+
+		/* actual decoding and dump the raw data */
 		while (ret >= 0)
 		{
-			pkt = av_packet_alloc();
-			ret = avcodec_receive_packet(codec_ctx_en, pkt);
-			if (ret == AVERROR_EOF)
 			{
+				TRACE_SCOPE("demux");
+				ret = av_read_frame(input_ctx, packet);
+			}
+			if (ret < 0)
 				break;
+			mem->PacketUpdate(packet);
+
+			if (video_stream == packet->stream_index)
+				ret = decode_write(decoder_ctx, packet); // 解码并dump文件
+			else
+			{
+				for (CEncodeSink *sink : encode_sinks)
+					sink->PushPacket(packet);
 			}
 
-			// 写入剩余的数据包到输出文件
-			pkt->stream_index = stream->index;
-			// pkt->time_base = AVRational{1, 90000};
-			ret = av_interleaved_write_frame(fmt_ctx_en, pkt);
-			av_packet_unref(pkt);
+			av_packet_unref(packet);
+			mem->PacketUpdate(packet);
 		}
 
-		// 13. 写入文件尾
-		av_write_trailer(fmt_ctx_en);
-
-		// 14. 释放资源
-		if (fmt_ctx_en && !(fmt_ctx_en->oformat->flags & AVFMT_NOFILE))
+		// 读到文件尾后刷新解码器，取出还在解码器里的最后几帧
+		if (ret == AVERROR_EOF && !frames_limited)
 		{
-			avio_closep(&fmt_ctx_en->pb);
+			ret = decode_write(decoder_ctx, NULL);
+			input_complete = ret >= 0;
 		}
-
-		avformat_free_context(fmt_ctx_en);
-		av_packet_free(&pkt);
-		avcodec_free_context(&codec_ctx_en);
 	}
+	if (frames_limited)
+		input_complete = false;
+	if (!input_complete)
+		MYLOG_WARN(LOG_MOD_MAIN, "input did not end cleanly (%s)", frames_limited ? "--frames reached" : "read or decode error");
+
+	// 等各输出端处理完剩余的帧，编码器在这里刷新并写文件尾
+	int sink_ret = frame_tee->Finish(input_complete);
+	// autotune 的一次测试：写出吞吐量、延迟和码率
+	if (autotune_result && !encode_sinks.empty())
+		WriteTrialResult(autotune_result, encode_sinks[0]->Stats(),
+						 GetCurrentStamp() - run_start, av_q2d(frame_rate), sink_ret);
+	for (auto &stats : tile_stats)
+		stats->Report();
+	// 编码输出关闭时结束了环，各输出写完剩下的包
+	for (auto &output : outputs)
+		output->Join();
+	outputs.clear();
+	frame_tee = NULL;
+	tee.reset();
+	ring.reset();
+
+	mem->PacketFree(&packet);
 
-	av_packet_unref(&packet);
-
-	if (output_file)
-		fclose(output_file);
 	avcodec_free_context(&decoder_ctx);
 	avformat_close_input(&input_ctx);
-	av_buffer_unref(&hw_device_ctx);
+
+	trace->Stop();
+	affinity->ThreadDone();
+	affinity->Report(thread_report);
+	CJobStats::GetInstance()->Report(job_report);
+	mem->Report(mem_report);
+	if (mem_fail_on_leak && mem->HasLeaks())
+	{
+		MYLOG_ERROR(LOG_MOD_MAIN, "Leaked buffers detected");
+		return 2;
+	}
+	if (sink_ret < 0)
+		return -1;
 
 	return 0;
 }
@@ -11,6 +11,12 @@ extern "C"
 }
 
 #include <iostream>
+#include <memory>
+#include <string.h>
+#include <time.h>
+#include "pixfmttraits.h"
+#include "cshmring.h"
+#include "caccel.h"
 
 
 // 帧率（30帧/秒）
@@ -21,72 +27,78 @@ const AVRational frame_rate = { 30, 1 };
 const char* output_filename = "encode_output.mp4";
 
 
-AVBufferRef* hw_device_ctx = nullptr; // 硬件设备上下文
 AVCodecContext* codec_ctx = nullptr; // 编码器上下文
 
 // FFmpeg 相关上下文和结构体
 AVFormatContext* fmt_ctx = nullptr;  // 输出文件上下文
-AVFrame* hw_frame = nullptr;         // 硬件帧
+AVFrame* hw_frame = nullptr;         // 硬件帧(cpu 后端是池里的内存帧)
 AVFrame* sw_frame = nullptr;         // 软件帧
 AVPacket* pkt = nullptr;             // 编码后的数据包
 
 
-// 视频分辨率
-const int width = 1280;
-const int height = 534;
+// 视频分辨率和输入文件，可以从命令行指定
+int width = 1280;
+int height = 534;
+const char *input_filename = "output.nv12";
+enum AVPixelFormat sw_format = AV_PIX_FMT_NV12; // nv12 或 p010(10 位，Main10)
+const char *accel_name = "vaapi"; // 加速后端：vaapi 或 cpu(软件编码，表面池语义和硬件一样)
 
+// 按像素格式特化的读帧
+struct ReadOp
+{
+    template <typename T>
+    static int Run(FILE *f, AVFrame *frame)
+    {
+        return ReadFrame<T>(f, frame);
+    }
+};
 
 
 int main(int argc, char *argv[])
 {
-
-    enum AVHWDeviceType type;
-    // 设备类型为：cuda dxva2 qsv d3d11va opencl，通常在windows使用d3d11va或者dxva2
-	type = av_hwdevice_find_type_by_name("vaapi"); // 根据设备名找到设备类型
-    if (type == AV_HWDEVICE_TYPE_NONE)
-	{
-		//fprintf(stderr, "Device type %s is not supported.\n", argv[1]);
-		fprintf(stderr, "Available device types:");
-		while ((type = av_hwdevice_iterate_types(type)) != AV_HWDEVICE_TYPE_NONE)
-			fprintf(stderr, " %s", av_hwdevice_get_type_name(type));
-		fprintf(stderr, "\n");
-		return -1;
-	}
-
-    // 1. 初始化硬件设备上下文 // 硬件加速初始化
-    int ret = av_hwdevice_ctx_create(&hw_device_ctx, type, nullptr, nullptr, 0);
-    if (ret < 0)
+    // testEncodeFFmpeg [input file] [width] [height] [nv12|p010] [vaapi|cpu]
+    // 输入为 shm:/name 或 fd:N 时从共享内存帧环读取，分辨率和格式以环里的为准，直到生产者结束
+    if (argc > 1)
+        input_filename = argv[1];
+    if (argc > 3)
     {
-        throw std::runtime_error("Failed to create hardware device context");
+        width = atoi(argv[2]);
+        height = atoi(argv[3]);
     }
+    if (argc > 4 && strcmp(argv[4], "p010") == 0)
+        sw_format = AV_PIX_FMT_P010;
+    if (argc > 5)
+        accel_name = argv[5];
 
-    // 2. 创建硬件帧上下文
-    AVBufferRef *hw_frames_ref = av_hwframe_ctx_alloc(hw_device_ctx);
-    if (!hw_frames_ref)
+    std::unique_ptr<CShmRing> shm_ring;
+    if (CShmRing::IsSpec(input_filename))
     {
-        throw std::runtime_error("Failed to create hardware frames context");
+        shm_ring.reset(CShmRing::Open(input_filename));
+        width = shm_ring->Width();
+        height = shm_ring->Height();
+        sw_format = shm_ring->Format();
     }
 
-    // 配置硬件帧上下文参数
-    AVHWFramesContext *hw_frames_ctx = (AVHWFramesContext *)hw_frames_ref->data;
-    hw_frames_ctx->format = AV_PIX_FMT_VAAPI;     // 硬件像素格式
-    hw_frames_ctx->sw_format = AV_PIX_FMT_NV12; // 软件像素格式
-    hw_frames_ctx->width = width;               // 视频宽度
-    hw_frames_ctx->height = height;             // 视频高度
-    hw_frames_ctx->initial_pool_size = 20;      // 初始帧池大小
-
-    // 初始化硬件帧上下文
-    ret = av_hwframe_ctx_init(hw_frames_ref);
-    if (ret < 0)
+    // 设备类型为：cuda dxva2 qsv d3d11va opencl，通常在windows使用d3d11va或者dxva2
+    if (strcmp(accel_name, "cpu") != 0 && av_hwdevice_find_type_by_name(accel_name) == AV_HWDEVICE_TYPE_NONE)
     {
-        throw std::runtime_error("Failed to initialize hardware frames context");
+        fprintf(stderr, "Device type %s is not supported.\n", accel_name);
+        fprintf(stderr, "Available device types: %s\n", AccelNames().c_str());
+        return -1;
     }
 
-    // 3. 查找编码器（使用 hevc_vaapi 编码器）
-    const AVCodec *codec = avcodec_find_encoder_by_name("hevc_vaapi");
+    // 1. 初始化加速后端(硬件设备上下文)
+    std::unique_ptr<CAccel> accel(CreateAccel(accel_name));
+
+    // 2. 创建表面池(硬件帧上下文)
+    std::unique_ptr<CSurfacePool> pool(accel->CreatePool(sw_format, width, height, 20));
+    AVBufferRef *hw_frames_ref = pool->FramesCtx();
+
+    // 3. 查找编码器（vaapi 使用 hevc_vaapi 编码器，cpu 使用支持该像素格式的软件编码器）
+    const AVCodec *codec = accel->FindEncoder(sw_format);
     if (!codec)
     {
-        throw std::runtime_error("Codec vaapi not found");
+        throw std::runtime_error(std::string("No encoder for ") + accel->Name());
     }
 
     // 4. 创建编码器上下文
@@ -97,38 +109,32 @@ int main(int argc, char *argv[])
     }
 
     // 配置编码器参数
-    codec_ctx->hw_frames_ctx = av_buffer_ref(hw_frames_ref); // 绑定硬件帧上下文
+    if (hw_frames_ref)
+        codec_ctx->hw_frames_ctx = av_buffer_ref(hw_frames_ref); // 绑定硬件帧上下文
     codec_ctx->width = width;                                // 视频宽度
     codec_ctx->height = height;                              // 视频高度
-    codec_ctx->time_base = av_inv_q(frame_rate);             // 时间基（帧率的倒数）
+    // 时间基：文件为帧率的倒数；共享内存直接用生产者的微秒时间戳，帧率不固定也不会挤到同一个时刻
+    codec_ctx->time_base = shm_ring ? AVRational{1, 1000000} : av_inv_q(frame_rate);
     codec_ctx->framerate = frame_rate;                       // 帧率
-    codec_ctx->pix_fmt = AV_PIX_FMT_VAAPI;                     // 像素格式
+    codec_ctx->pix_fmt = hw_frames_ref ? ((AVHWFramesContext *)hw_frames_ref->data)->format : sw_format; // 像素格式
     codec_ctx->bit_rate = 4000000;                           // 码率（4 Mbps）
     codec_ctx->gop_size = 1;                                 // GOP 大小（关键帧间隔）
+    if (sw_format == AV_PIX_FMT_P010)
+        av_opt_set(codec_ctx->priv_data, "profile", "main10", 0); // 10 位用 Main10
 
     // 打开编码器
-    ret = avcodec_open2(codec_ctx, codec, nullptr);
+    int ret = avcodec_open2(codec_ctx, codec, nullptr);
     if (ret < 0)
     {
         throw std::runtime_error("Could not open codec");
     }
 
-    // 5. 创建硬件帧
+    // 5. 创建硬件帧，每帧上传时从表面池取，送进编码器后归还
     hw_frame = av_frame_alloc();
     if (!hw_frame)
     {
         throw std::runtime_error("Could not allocate video frame");
     }
-    hw_frame->format = AV_PIX_FMT_VAAPI; // 硬件像素格式
-    hw_frame->width = width;           // 视频宽度
-    hw_frame->height = height;         // 视频高度
-
-    // 为硬件帧分配内存
-    ret = av_hwframe_get_buffer(av_buffer_ref(hw_frames_ref), hw_frame, 0);
-    if (ret < 0)
-    {
-        throw std::runtime_error("Could not allocate hardware frame buffer");
-    }
 
     // 6. 创建软件帧
     sw_frame = av_frame_alloc();
@@ -136,7 +142,7 @@ int main(int argc, char *argv[])
     {
         throw std::runtime_error("Could not allocate software frame");
     }
-    sw_frame->format = AV_PIX_FMT_NV12; // 软件像素格式
+    sw_frame->format = sw_format;       // 软件像素格式
     sw_frame->width = width;            // 视频宽度
     sw_frame->height = height;          // 视频高度
 
@@ -183,57 +189,111 @@ int main(int argc, char *argv[])
     }
 
     // 11. 编码帧
-    FILE *f = fopen("output.nv12", "rb"); // 打开 NV12 文件
-    if (!f)
+    FILE *f = NULL;
+    AVFrame *shm_frame = NULL;  // 引用共享内存槽位的帧，上传后释放，槽位还给生产者
+    int64_t max_latency_us = 0; // 采集到上传完成的最大延迟
+    int64_t last_pts = AV_NOPTS_VALUE; // 上一帧的 PTS(编码器时间基)
+    int64_t bad_pts = 0;               // 生产者时间戳不递增而丢掉的帧
+    if (shm_ring)
+    {
+        shm_frame = av_frame_alloc();
+        if (!shm_frame)
+        {
+            throw std::runtime_error("Could not allocate shm frame");
+        }
+    }
+    else
     {
-        throw std::runtime_error("Could not open YUV file");
+        f = fopen(input_filename, "rb"); // 打开 NV12/P010 文件
+        if (!f)
+        {
+            throw std::runtime_error("Could not open YUV file");
+        }
     }
 
-    int read_size = width * height * 15 / 10;//(15 / 10) = 1.5f
+    // 数据包只分配一次，每次取包后 unref 复用
+    pkt = av_packet_alloc();
+    if (!pkt)
+    {
+        throw std::runtime_error("Could not allocate packet");
+    }
 
-    for (int i = 0; i < 100; i++)
-    { // 编码 50 帧
-        // 从 NV12 文件读取数据到软件帧        
-        size_t redasize = fread(sw_frame->data[0], 1, read_size, f);     // YUV  yyyy yyyy uv uv 分量
-        //fread(sw_frame->data[0], 1, width * height, f);     // Y 分量
-        //fread(sw_frame->data[1], 1, width * height / 2, f); // UV 分量
-        if (redasize != read_size)
+    int i;
+    for (i = 0; shm_ring || i < 100; i++)
+    { // 文件编码 100 帧，共享内存编码到生产者结束
+        AVFrame *src_frame = sw_frame;
+        if (shm_ring)
+        {
+            // 原地引用槽位，不拷贝
+            ret = shm_ring->Read(shm_frame, 1000);
+            if (ret == AVERROR(EAGAIN))
+            {
+                i--;
+                continue;
+            }
+            if (ret < 0)
+            {
+                break;
+            }
+            src_frame = shm_frame;
+        }
+        // 从文件读取 Y 平面和 UV 平面到软件帧(按 linesize 逐行)
+        else if (DispatchPixFmt<ReadOp>(sw_format, f, sw_frame) < 0)
         {
             break;
         }
 
+        // 设置帧的显示时间戳（PTS，编码器时间基）：共享内存为生产者的时间戳(微秒)，文件按帧序号
+        int64_t pts = shm_ring ? shm_frame->pts : i;
+        if (pts == AV_NOPTS_VALUE || (last_pts != AV_NOPTS_VALUE && pts <= last_pts))
+        {
+            // 编码器要求递增，不改时间戳，丢掉这一帧
+            if (bad_pts++ == 0)
+                std::cerr << "shm frame " << shm_ring->LastSeq() << ": pts " << pts << " us not after " << last_pts << " us, dropped" << std::endl;
+            av_frame_unref(shm_frame);
+            i--;
+            continue;
+        }
+        last_pts = pts;
+
         // 将软件帧数据拷贝到硬件帧
-        ret = av_hwframe_transfer_data(hw_frame, sw_frame, 0);
+        ret = accel->Upload(pool.get(), hw_frame, src_frame);
+        if (shm_ring)
+        {
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            int64_t latency = (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000 - shm_ring->LastCaptureUs();
+            if (latency > max_latency_us)
+                max_latency_us = latency;
+            av_frame_unref(shm_frame);
+        }
         if (ret < 0)
         {
             throw std::runtime_error("Error transferring data to hardware frame");
         }
 
-        // 设置帧的显示时间戳（PTS）
-        hw_frame->pts = i * 3000;                   // PTS = 帧序号 * 帧间隔
-        //hw_frame->time_base = AVRational{1, 90000}; // 时间基
+        hw_frame->pts = pts;
 
-        // 发送帧到编码器
+        // 发送帧到编码器，编码器自己持有引用
         ret = avcodec_send_frame(codec_ctx, hw_frame);
+        av_frame_unref(hw_frame);
         if (ret < 0)
         {
             throw std::runtime_error("Error sending frame to encoder");
         }
 
         // 接收编码后的数据包
-        pkt = av_packet_alloc();
         while (ret >= 0)
         {
             ret = avcodec_receive_packet(codec_ctx, pkt);
             if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
             {
-                av_packet_free(&pkt);
                 break;
             }
 
             // 设置数据包的流索引和时间基
             pkt->stream_index = stream->index;
-            //pkt->time_base = AVRational{1, 90000};
+            av_packet_rescale_ts(pkt, codec_ctx->time_base, stream->time_base);
 
             // 写入数据包到输出文件
             ret = av_interleaved_write_frame(fmt_ctx, pkt);
@@ -251,7 +311,6 @@ int main(int argc, char *argv[])
     ret = avcodec_send_frame(codec_ctx, nullptr);
     while (ret >= 0)
     {
-        pkt = av_packet_alloc();
         ret = avcodec_receive_packet(codec_ctx, pkt);
         if (ret == AVERROR_EOF)
         {
@@ -260,18 +319,23 @@ int main(int argc, char *argv[])
 
         // 写入剩余的数据包到输出文件
         pkt->stream_index = stream->index;
-        //pkt->time_base = AVRational{1, 90000};
+        av_packet_rescale_ts(pkt, codec_ctx->time_base, stream->time_base);
         ret = av_interleaved_write_frame(fmt_ctx, pkt);
         av_packet_unref(pkt);
     }
+    av_packet_free(&pkt);
 
     // 13. 写入文件尾
     av_write_trailer(fmt_ctx);
 
     // 关闭 YUV 文件
-    fclose(f);
+    if (f)
+        fclose(f);
+    av_frame_free(&shm_frame);
 
     std::cout << "Encoding completed successfully!" << std::endl;
+    if (shm_ring)
+        std::cout << "shm frames: " << i << ", dropped for bad pts: " << bad_pts << ", max capture to upload latency: " << max_latency_us / 1000.0 << " ms" << std::endl;
 
     // 计算并输出编码过程的总耗时
     // std::cout << "Total time taken: "
@@ -286,9 +350,7 @@ int main(int argc, char *argv[])
     avformat_free_context(fmt_ctx);
     av_frame_free(&hw_frame);
     av_frame_free(&sw_frame);
-    av_packet_free(&pkt);
     avcodec_free_context(&codec_ctx);
-    av_buffer_unref(&hw_device_ctx);
 
     return 0;
 }
\ No newline at end of file
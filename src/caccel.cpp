@@ -0,0 +1,471 @@
+#include "caccel.h"
+#include "cjobstats.h"
+
+extern "C"
+{
+#include <libavutil/cpu.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/log.h>
+#include <libavutil/pixdesc.h>
+}
+
+#include <atomic>
+#include <mutex>
+#include <stdexcept>
+#include <string.h>
+
+#define ACCEL_ALIGN 64
+#define ACCEL_DPB_FRAMES 18		// 解码器自己的参考帧和输出帧(HEVC/H.264 最多 16 个参考帧)
+
+// 硬件后端：设备类型对应的表面格式和编码器，加新硬件在这里加一行
+struct HwAccelInfo
+{
+	AVHWDeviceType type;
+	AVPixelFormat hw_format;	// 表面像素格式
+	const char *encoder;		// FFmpeg 编码器名
+	const char *backend;		// CEncoderBackend 名
+};
+
+static const HwAccelInfo s_hw_accels[] = {
+	{ AV_HWDEVICE_TYPE_VAAPI, AV_PIX_FMT_VAAPI, "hevc_vaapi", "vaapi" },
+};
+
+static const HwAccelInfo *FindHwAccel(AVHWDeviceType type)
+{
+	for (const HwAccelInfo &info : s_hw_accels)
+	{
+		if (info.type == type)
+			return &info;
+	}
+	return nullptr;
+}
+
+AVBufferRef *CreateHwFramesCtx(AVBufferRef *device, AVPixelFormat hw_format, AVPixelFormat sw_format,
+							   int width, int height, int pool_size)
+{
+	AVBufferRef *hw_frames_ref = av_hwframe_ctx_alloc(device);
+	if (!hw_frames_ref)
+	{
+		throw std::runtime_error("Failed to create hardware frames context");
+	}
+
+	// 配置硬件帧上下文参数
+	AVHWFramesContext *hw_frames_ctx = (AVHWFramesContext *)hw_frames_ref->data;
+	hw_frames_ctx->format = hw_format;			// 硬件像素格式
+	hw_frames_ctx->sw_format = sw_format;		// 软件像素格式
+	hw_frames_ctx->width = width;				// 视频宽度
+	hw_frames_ctx->height = height;				// 视频高度
+	hw_frames_ctx->initial_pool_size = pool_size;	// 初始帧池大小，固定大小，用完取帧失败
+
+	// 初始化硬件帧上下文
+	if (av_hwframe_ctx_init(hw_frames_ref) < 0)
+	{
+		av_buffer_unref(&hw_frames_ref);
+		throw std::runtime_error("Failed to initialize hardware frames context");
+	}
+	return hw_frames_ref;
+}
+
+// 内存帧的映射就是加一个引用；要写时源帧必须可写(没有别人引用)，否则写会改到别人的帧
+static int MapMemoryFrame(AVFrame *dst, const AVFrame *src, int flags)
+{
+	if ((flags & (AV_HWFRAME_MAP_WRITE | AV_HWFRAME_MAP_OVERWRITE)) && !av_frame_is_writable((AVFrame *)src))
+		return AVERROR(ENOSYS);
+	return av_frame_ref(dst, src);
+}
+
+//****************************************** */
+// 硬件后端
+
+class CHwSurfacePool : public CSurfacePool
+{
+public:
+	CHwSurfacePool(AVBufferRef *frames, int size) : m_frames(frames)
+	{
+		AVHWFramesContext *ctx = (AVHWFramesContext *)frames->data;
+		m_sw_format = ctx->sw_format;
+		m_width = ctx->width;
+		m_height = ctx->height;
+		m_size = size;
+	}
+	~CHwSurfacePool() override { av_buffer_unref(&m_frames); }
+
+	int Get(AVFrame *frame) override { return av_hwframe_get_buffer(m_frames, frame, 0); }
+	AVBufferRef *FramesCtx() const override { return m_frames; }
+
+private:
+	AVBufferRef *m_frames;
+};
+
+class CHwAccel : public CAccel
+{
+public:
+	explicit CHwAccel(AVHWDeviceType type) : m_type(type), m_info(FindHwAccel(type))
+	{
+		// 1. 初始化硬件设备上下文
+		if (av_hwdevice_ctx_create(&m_device, type, NULL, NULL, 0) < 0)
+		{
+			throw std::runtime_error(std::string("Failed to create ") + av_hwdevice_get_type_name(type) + " device");
+		}
+	}
+	~CHwAccel() override { av_buffer_unref(&m_device); }
+
+	const char *Name() const override { return av_hwdevice_get_type_name(m_type); }
+	AVBufferRef *Device() const override { return m_device; }
+
+	CSurfacePool *CreatePool(AVPixelFormat sw_format, int width, int height, int size) override
+	{
+		if (!m_info)
+			throw std::runtime_error(std::string("No surface format for device ") + Name());
+		return new CHwSurfacePool(CreateHwFramesCtx(m_device, m_info->hw_format, sw_format, width, height, size), size);
+	}
+
+	int InitDecoder(AVCodecContext *ctx, const AVCodec *codec, int extra_frames) override
+	{
+		// 查找到对应硬件类型解码后的数据格式
+		for (int i = 0;; i++)
+		{
+			const AVCodecHWConfig *config = avcodec_get_hw_config(codec, i);
+			if (!config)
+			{
+				av_log(ctx, AV_LOG_ERROR, "Decoder %s does not support device type %s.\n", codec->name, Name());
+				return AVERROR(ENOSYS);
+			}
+			if (config->methods & AV_CODEC_HW_CONFIG_METHOD_HW_DEVICE_CTX && config->device_type == m_type)
+			{
+				m_decode_format = config->pix_fmt;
+				break;
+			}
+		}
+
+		ctx->opaque = this;
+		ctx->get_format = GetFormat;
+		// 输出端队列里的帧还占着解码器的硬件帧
+		ctx->extra_hw_frames = extra_frames;
+		ctx->hw_device_ctx = av_buffer_ref(m_device);
+		return ctx->hw_device_ctx ? 0 : AVERROR(ENOMEM);
+	}
+
+	const AVCodec *FindEncoder(AVPixelFormat sw_format) const override
+	{
+		return m_info ? avcodec_find_encoder_by_name(m_info->encoder) : nullptr;
+	}
+
+	// 没有对应硬件编码器时用软件编码
+	const char *DefaultEncoder() const override { return m_info ? m_info->backend : "auto"; }
+
+	int Upload(CSurfacePool *pool, AVFrame *dst, const AVFrame *src) override
+	{
+		int ret;
+		if ((ret = pool->Get(dst)) < 0 ||
+			(ret = HwTransfer(dst, src)) < 0 ||
+			(ret = av_frame_copy_props(dst, src)) < 0)
+		{
+			av_frame_unref(dst);
+			return ret;
+		}
+		return 0;
+	}
+
+	int Download(AVFrame *dst, const AVFrame *src) override
+	{
+		int ret;
+		if ((ret = HwTransfer(dst, src)) < 0 ||
+			(ret = av_frame_copy_props(dst, src)) < 0)
+		{
+			av_frame_unref(dst);
+			return ret;
+		}
+		return 0;
+	}
+
+	int Map(AVFrame *dst, const AVFrame *src, int flags) override
+	{
+		if (!src->hw_frames_ctx)
+			return MapMemoryFrame(dst, src, flags);
+		if (dst->format == AV_PIX_FMT_NONE)
+			dst->format = ((AVHWFramesContext *)src->hw_frames_ctx->data)->sw_format;
+		return HwMap(dst, src, flags);
+	}
+
+private:
+	// 获取GPU硬件解码帧的格式
+	static AVPixelFormat GetFormat(AVCodecContext *ctx, const AVPixelFormat *pix_fmts)
+	{
+		CHwAccel *accel = (CHwAccel *)ctx->opaque;
+		for (const AVPixelFormat *p = pix_fmts; *p != AV_PIX_FMT_NONE; p++)
+		{
+			if (*p == accel->m_decode_format)
+				return *p;
+		}
+
+		av_log(ctx, AV_LOG_ERROR, "Failed to get HW surface format.\n");
+		return AV_PIX_FMT_NONE;
+	}
+
+	AVHWDeviceType m_type;
+	const HwAccelInfo *m_info;
+	AVBufferRef *m_device = nullptr;
+	AVPixelFormat m_decode_format = AV_PIX_FMT_NONE;
+};
+
+//****************************************** */
+// cpu 参考后端
+
+// 内存帧池，和硬件帧池一样最多 size 个表面，都在用时取帧失败；
+// 池释放后，外面还引用着的表面等最后一个引用释放时才真正释放(AVBufferPool 保证)
+class CCpuSurfacePool : public CSurfacePool
+{
+public:
+	// codec 不为空时按解码器的要求对齐宽高
+	CCpuSurfacePool(AVPixelFormat sw_format, int width, int height, int size, AVCodecContext *codec = nullptr)
+	{
+		m_sw_format = sw_format;
+		m_width = width;
+		m_height = height;
+		m_size = size;
+
+		int aligned_w = width, aligned_h = height;
+		if (codec)
+		{
+			int align[8];
+			avcodec_align_dimensions2(codec, &aligned_w, &aligned_h, align);
+		}
+		aligned_w = (aligned_w + ACCEL_ALIGN - 1) & ~(ACCEL_ALIGN - 1);
+
+		// 各平面在一块内存里，行宽按 64 字节对齐
+		const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(sw_format);
+		int planes = av_pix_fmt_count_planes(sw_format);
+		if (!desc || planes <= 0 || av_image_fill_linesizes(m_linesize, sw_format, aligned_w) < 0)
+			throw std::runtime_error(std::string("Unsupported surface format ") + (desc ? desc->name : "none"));
+		size_t offset = 0;
+		for (int i = 0; i < planes; i++)
+		{
+			int rows = (i == 1 || i == 2) ? (aligned_h + (1 << desc->log2_chroma_h) - 1) >> desc->log2_chroma_h : aligned_h;
+			m_offset[i] = offset;
+			offset += ((size_t)m_linesize[i] * rows + ACCEL_ALIGN - 1) & ~(size_t)(ACCEL_ALIGN - 1);
+		}
+		m_planes = planes;
+
+		// 解码器可能越界读写一点，留出余量
+		PoolState *state = new PoolState();
+		state->max = size;
+		m_pool = av_buffer_pool_init2((int)offset + ACCEL_ALIGN, state, Alloc, PoolFree);
+		if (!m_pool)
+		{
+			delete state;
+			throw std::runtime_error("Failed to create surface pool");
+		}
+	}
+	~CCpuSurfacePool() override { av_buffer_pool_uninit(&m_pool); }
+
+	int Get(AVFrame *frame) override
+	{
+		AVBufferRef *buf = av_buffer_pool_get(m_pool);
+		if (!buf)
+			return AVERROR(ENOMEM);
+
+		frame->buf[0] = buf;
+		for (int i = 0; i < m_planes; i++)
+		{
+			frame->data[i] = buf->data + m_offset[i];
+			frame->linesize[i] = m_linesize[i];
+		}
+		frame->extended_data = frame->data;
+		if (frame->format == AV_PIX_FMT_NONE)
+		{
+			frame->format = m_sw_format;
+			frame->width = m_width;
+			frame->height = m_height;
+		}
+		return 0;
+	}
+
+	// 调色板、码流和硬件格式不是普通的平面布局，池排不了
+	static bool CanLayout(AVPixelFormat format)
+	{
+		const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(format);
+		return desc && !(desc->flags & (AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_BITSTREAM | AV_PIX_FMT_FLAG_HWACCEL)) &&
+			   av_pix_fmt_count_planes(format) > 0;
+	}
+
+	bool Match(AVPixelFormat format, int width, int height) const
+	{
+		return format == m_sw_format && width == m_width && height == m_height;
+	}
+
+private:
+	struct PoolState
+	{
+		int max;
+		std::atomic<int> allocated{0};
+	};
+
+	// 池里没有空闲表面时调用，超过池大小返回空
+	static AVBufferRef *Alloc(void *opaque, int size)
+	{
+		PoolState *state = (PoolState *)opaque;
+		if (state->allocated.fetch_add(1) >= state->max)
+		{
+			state->allocated.fetch_sub(1);
+			return nullptr;
+		}
+		return av_buffer_alloc(size);
+	}
+
+	static void PoolFree(void *opaque)
+	{
+		delete (PoolState *)opaque;
+	}
+
+	AVBufferPool *m_pool = nullptr;
+	int m_linesize[4] = { 0 };
+	size_t m_offset[4] = { 0 };
+	int m_planes = 0;
+};
+
+class CCpuAccel : public CAccel
+{
+public:
+	~CCpuAccel() override { delete m_decode_pool; }
+
+	const char *Name() const override { return "cpu"; }
+
+	CSurfacePool *CreatePool(AVPixelFormat sw_format, int width, int height, int size) override
+	{
+		return new CCpuSurfacePool(sw_format, width, height, size);
+	}
+
+	int InitDecoder(AVCodecContext *ctx, const AVCodec *codec, int extra_frames) override
+	{
+		// 软件解码，帧从固定大小的池里取，池的大小和硬件解码一样按 extra_frames 留余量；
+		// 解码器不支持自定义缓冲区(没有 DR1)时用 FFmpeg 默认的分配
+		ctx->thread_count = 0;	// 软件解码线程数自动
+		if (!(codec->capabilities & AV_CODEC_CAP_DR1))
+		{
+			av_log(ctx, AV_LOG_INFO, "%s does not support custom buffers, using default allocation\n", codec->name);
+			return 0;
+		}
+		ctx->opaque = this;
+		ctx->get_buffer2 = GetBuffer;
+		m_extra_frames = extra_frames;
+		return 0;
+	}
+
+	const AVCodec *FindEncoder(AVPixelFormat sw_format) const override
+	{
+		// 和硬件编码一样优先 HEVC，要求编码器直接支持内存中的格式
+		static const char *s_encoders[] = { "libx265", "libx264" };
+		for (const char *name : s_encoders)
+		{
+			const AVCodec *codec = avcodec_find_encoder_by_name(name);
+			for (const AVPixelFormat *p = codec ? codec->pix_fmts : nullptr; p && *p != AV_PIX_FMT_NONE; p++)
+			{
+				if (*p == sw_format)
+					return codec;
+			}
+		}
+		return nullptr;
+	}
+
+	const char *DefaultEncoder() const override { return "auto"; }
+
+	int Upload(CSurfacePool *pool, AVFrame *dst, const AVFrame *src) override
+	{
+		int ret;
+		if (src->format != pool->SwFormat() || src->width != pool->Width() || src->height != pool->Height())
+			return AVERROR(EINVAL);
+		dst->format = pool->SwFormat();
+		dst->width = pool->Width();
+		dst->height = pool->Height();
+		if ((ret = pool->Get(dst)) < 0 ||
+			(ret = av_frame_copy(dst, src)) < 0 ||
+			(ret = av_frame_copy_props(dst, src)) < 0)
+		{
+			av_frame_unref(dst);
+			return ret;
+		}
+		return 0;
+	}
+
+	int Download(AVFrame *dst, const AVFrame *src) override
+	{
+		int ret;
+		dst->format = src->format;
+		dst->width = src->width;
+		dst->height = src->height;
+		if ((ret = av_frame_get_buffer(dst, 0)) < 0 ||
+			(ret = av_frame_copy(dst, src)) < 0 ||
+			(ret = av_frame_copy_props(dst, src)) < 0)
+		{
+			av_frame_unref(dst);
+			return ret;
+		}
+		return 0;
+	}
+
+	// 表面本来就在内存里
+	int Map(AVFrame *dst, const AVFrame *src, int flags) override
+	{
+		return MapMemoryFrame(dst, src, flags);
+	}
+
+private:
+	// 帧线程解码时在多个线程里调用
+	static int GetBuffer(AVCodecContext *ctx, AVFrame *frame, int flags)
+	{
+		CCpuAccel *accel = (CCpuAccel *)ctx->opaque;
+		AVPixelFormat format = (AVPixelFormat)frame->format;
+		if (!CCpuSurfacePool::CanLayout(format))
+			return avcodec_default_get_buffer2(ctx, frame, flags);
+
+		std::lock_guard<std::mutex> lock(accel->m_mutex);
+
+		// 第一次取帧或者分辨率变化时建池，旧池等外面的帧释放完再释放
+		if (!accel->m_decode_pool || !accel->m_decode_pool->Match(format, frame->width, frame->height))
+		{
+			delete accel->m_decode_pool;
+			accel->m_decode_pool = nullptr;
+			int threads = ctx->thread_count > 0 ? ctx->thread_count : av_cpu_count();
+			try
+			{
+				accel->m_decode_pool = new CCpuSurfacePool(format, frame->width, frame->height,
+														   ACCEL_DPB_FRAMES + threads + accel->m_extra_frames, ctx);
+			}
+			catch (const std::exception &e)
+			{
+				av_log(ctx, AV_LOG_ERROR, "%s\n", e.what());
+				return AVERROR(EINVAL);
+			}
+		}
+		return accel->m_decode_pool->Get(frame);
+	}
+
+	std::mutex m_mutex;
+	CCpuSurfacePool *m_decode_pool = nullptr;
+	int m_extra_frames = 0;
+};
+
+//****************************************** */
+
+CAccel *CreateAccel(const std::string &name)
+{
+	if (name == "cpu")
+		return new CCpuAccel();
+	AVHWDeviceType type = av_hwdevice_find_type_by_name(name.c_str());
+	if (type == AV_HWDEVICE_TYPE_NONE)
+		throw std::runtime_error("Device type " + name + " is not supported");
+	return new CHwAccel(type);
+}
+
+std::string AccelNames()
+{
+	std::string names = "cpu";
+	AVHWDeviceType type = AV_HWDEVICE_TYPE_NONE;
+	while ((type = av_hwdevice_iterate_types(type)) != AV_HWDEVICE_TYPE_NONE)
+	{
+		names += " ";
+		names += av_hwdevice_get_type_name(type);
+	}
+	return names;
+}
@@ -0,0 +1,76 @@
+#ifndef CACCEL_H
+#define CACCEL_H
+
+// 加速后端：设备创建、表面池、上传/下载/映射、解码器和编码器选择
+// 硬件后端走 FFmpeg hwcontext(目前是 vaapi，加 cuda/qsv 只需要在表里加一行)；
+// cpu 后端是参考实现，表面池同样固定大小、用完取帧失败，解码器也从池里取帧，
+// 没有显卡的机器上也能开发和测试帧池、在途帧窗口、零拷贝这些机制。
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavutil/hwcontext.h>
+}
+
+#include <string>
+
+// 固定大小的表面池
+class CSurfacePool
+{
+public:
+	virtual ~CSurfacePool() {}
+
+	// 从池里取一个表面，池用完时失败(和硬件帧池一样)
+	virtual int Get(AVFrame *frame) = 0;
+	// 硬件帧上下文，编码器绑定用；cpu 后端为空
+	virtual AVBufferRef *FramesCtx() const { return nullptr; }
+
+	AVPixelFormat SwFormat() const { return m_sw_format; }
+	int Width() const { return m_width; }
+	int Height() const { return m_height; }
+	int Size() const { return m_size; }
+
+protected:
+	AVPixelFormat m_sw_format = AV_PIX_FMT_NONE;
+	int m_width = 0;
+	int m_height = 0;
+	int m_size = 0;
+};
+
+class CAccel
+{
+public:
+	virtual ~CAccel() {}
+
+	virtual const char *Name() const = 0;
+	// 硬件设备上下文，cpu 后端为空
+	virtual AVBufferRef *Device() const { return nullptr; }
+
+	// 创建表面池，sw_format 为内存中的像素格式；失败抛 std::runtime_error
+	virtual CSurfacePool *CreatePool(AVPixelFormat sw_format, int width, int height, int size) = 0;
+
+	// 在 avcodec_open2 之前设置解码器；extra_frames 为解码器之外还占着的帧数(输出端队列)
+	virtual int InitDecoder(AVCodecContext *ctx, const AVCodec *codec, int extra_frames) = 0;
+	// 编码 sw_format 的帧用的编码器，没有返回 nullptr
+	virtual const AVCodec *FindEncoder(AVPixelFormat sw_format) const = 0;
+	// CEncoderBackend 的默认选择(EncodeConfig::encoder)
+	virtual const char *DefaultEncoder() const = 0;
+
+	// 内存帧拷贝到池里的表面
+	virtual int Upload(CSurfacePool *pool, AVFrame *dst, const AVFrame *src) = 0;
+	// 表面拷贝到新分配的内存帧
+	virtual int Download(AVFrame *dst, const AVFrame *src) = 0;
+	// 不拷贝直接访问表面内容，flags 为 AV_HWFRAME_MAP_*，做不到(比如要写一个别人也引用着的帧)时返回 AVERROR(ENOSYS)
+	virtual int Map(AVFrame *dst, const AVFrame *src, int flags) = 0;
+};
+
+// 按名字创建：cpu 或者 FFmpeg 的硬件设备类型名(vaapi 等)；失败抛 std::runtime_error
+CAccel *CreateAccel(const std::string &name);
+// 可用的后端名，空格分隔，用于提示
+std::string AccelNames();
+
+// 创建并初始化硬件帧上下文，失败抛 std::runtime_error
+AVBufferRef *CreateHwFramesCtx(AVBufferRef *device, AVPixelFormat hw_format, AVPixelFormat sw_format,
+							   int width, int height, int pool_size);
+
+#endif // CACCEL_H
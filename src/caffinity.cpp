@@ -0,0 +1,249 @@
+#include "caffinity.h"
+#include "cspdlog.h"
+#include "cjobstats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
+CAffinity *CAffinity::GetInstance()
+{
+	static CAffinity instance;
+	return &instance;
+}
+
+bool CAffinity::ParseCpuList(const char *list, cpu_set_t &set)
+{
+	CPU_ZERO(&set);
+	const char *p = list;
+	while (*p && *p != '\n')
+	{
+		char *end;
+		long first = strtol(p, &end, 10);
+		if (end == p || first < 0)
+			return false;
+		long last = first;
+		p = end;
+		if (*p == '-')
+		{
+			last = strtol(p + 1, &end, 10);
+			if (end == p + 1 || last < first)
+				return false;
+			p = end;
+		}
+		for (long c = first; c <= last && c < CPU_SETSIZE; c++)
+			CPU_SET(c, &set);
+		if (*p == ',')
+			p++;
+		else if (*p && *p != '\n')
+			return false;
+	}
+	return CPU_COUNT(&set) > 0;
+}
+
+void CAffinity::LoadTopology()
+{
+	m_node_cpus.clear();
+	for (int node = 0;; node++)
+	{
+		char path[128], buf[1024];
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+		FILE *f = fopen(path, "r");
+		if (!f)
+			break;
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		if (fgets(buf, sizeof(buf), f))
+			ParseCpuList(buf, set);
+		fclose(f);
+		m_node_cpus.push_back(set);
+	}
+
+	// 没有 NUMA 信息时当作一个节点
+	if (m_node_cpus.empty())
+	{
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+		for (long c = 0; c < n && c < CPU_SETSIZE; c++)
+			CPU_SET(c, &set);
+		m_node_cpus.push_back(set);
+	}
+}
+
+// 显卡所在的节点，帧在这个节点和显存之间传输最近
+int CAffinity::DeviceNode()
+{
+	FILE *f = fopen("/sys/class/drm/renderD128/device/numa_node", "r");
+	if (!f)
+		return -1;
+	int node = -1;
+	if (fscanf(f, "%d", &node) != 1)
+		node = -1;
+	fclose(f);
+	return node;
+}
+
+bool CAffinity::Init(const char *policy)
+{
+	LoadTopology();
+	m_bind = false;
+	m_node = -1;
+	CPU_ZERO(&m_cpus);
+
+	if (!policy || !strcmp(policy, "none"))
+		return true;
+
+	if (!strcmp(policy, "auto"))
+	{
+		m_node = DeviceNode();
+		// 多个会话跑在同一台机器上时按进程号分散到各节点
+		if (m_node < 0 || m_node >= NodeCount())
+			m_node = getpid() % NodeCount();
+		m_cpus = m_node_cpus[m_node];
+	}
+	else if (!strncmp(policy, "node:", 5))
+	{
+		char *end;
+		long node = strtol(policy + 5, &end, 10);
+		if (*end || node < 0 || node >= NodeCount())
+			return false;
+		m_node = (int)node;
+		m_cpus = m_node_cpus[m_node];
+	}
+	else if (!strncmp(policy, "cpus:", 5))
+	{
+		if (!ParseCpuList(policy + 5, m_cpus))
+			return false;
+		// 内存放在第一个核所在的节点
+		for (int node = 0; node < NodeCount() && m_node < 0; node++)
+		{
+			for (int c = 0; c < CPU_SETSIZE; c++)
+			{
+				if (CPU_ISSET(c, &m_cpus))
+				{
+					if (CPU_ISSET(c, &m_node_cpus[node]))
+						m_node = node;
+					break;
+				}
+			}
+		}
+	}
+	else
+		return false;
+
+	m_bind = true;
+	MYLOG_INFO(LOG_MOD_MAIN, "affinity: %d cpus on node %d of %d", CPU_COUNT(&m_cpus), m_node, NodeCount());
+	return true;
+}
+
+void CAffinity::SetMemPolicy()
+{
+	if (m_node < 0 || NodeCount() < 2)
+		return;
+
+	// 优先本节点，本节点内存不够时仍可以用其他节点
+	unsigned long mask[16] = { 0 };
+	mask[m_node / (8 * sizeof(unsigned long))] |= 1UL << (m_node % (8 * sizeof(unsigned long)));
+	if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, sizeof(mask) * 8) != 0)
+		MYLOG_WARN(LOG_MOD_MAIN, "set_mempolicy for node %d failed", m_node);
+}
+
+void CAffinity::BindThread(const char *name)
+{
+	pid_t tid = (pid_t)syscall(SYS_gettid);
+	if (m_bind)
+	{
+		int ret = pthread_setaffinity_np(pthread_self(), sizeof(m_cpus), &m_cpus);
+		if (ret != 0)
+			MYLOG_WARN(LOG_MOD_MAIN, "thread %s: setaffinity failed: %d", name, ret);
+		SetMemPolicy();
+	}
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	ThreadStat st;
+	st.name = name;
+	st.tid = tid;
+	st.done = false;
+	st.user_sec = st.sys_sec = 0;
+	st.nvcsw = st.nivcsw = 0;
+	m_threads.push_back(st);
+}
+
+void CAffinity::ThreadDone()
+{
+	struct rusage ru;
+	if (getrusage(RUSAGE_THREAD, &ru) != 0)
+		return;
+
+	pid_t tid = (pid_t)syscall(SYS_gettid);
+	std::lock_guard<std::mutex> lock(m_mutex);
+	for (auto &st : m_threads)
+	{
+		if (st.tid == tid && !st.done)
+		{
+			st.done = true;
+			st.user_sec = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6;
+			st.sys_sec = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+			st.nvcsw = ru.ru_nvcsw;
+			st.nivcsw = ru.ru_nivcsw;
+			break;
+		}
+	}
+}
+
+std::vector<CAffinity::ThreadStat> CAffinity::Threads()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	std::vector<ThreadStat> done;
+	for (auto &st : m_threads)
+	{
+		if (st.done)
+			done.push_back(st);
+	}
+	return done;
+}
+
+void CAffinity::Report(const char *json_path)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	MYLOG_INFO(LOG_MOD_MAIN, "thread report: node %d, %d threads", m_node, (int)m_threads.size());
+	for (auto &st : m_threads)
+	{
+		if (!st.done)
+			continue;
+		MYLOG_INFO(LOG_MOD_MAIN, "  thread %s: user %.3f s, sys %.3f s, ctx switches %ld voluntary, %ld involuntary",
+				   st.name, st.user_sec, st.sys_sec, st.nvcsw, st.nivcsw);
+	}
+
+	if (!json_path)
+		return;
+
+	FILE *f = fopen(json_path, "w");
+	if (!f)
+	{
+		MYLOG_ERROR(LOG_MOD_MAIN, "Cannot open thread report file '%s'", json_path);
+		return;
+	}
+	fprintf(f, "{\n  \"node\": %d,\n  \"nodes\": %d,\n  \"cpus\": %d,\n  \"threads\": [", m_node, NodeCount(), CPU_COUNT(&m_cpus));
+	bool first = true;
+	for (auto &st : m_threads)
+	{
+		if (!st.done)
+			continue;
+		fprintf(f, "%s\n    { \"name\": \"%s\", \"tid\": %d, \"user_sec\": %.6f, \"sys_sec\": %.6f, \"voluntary_ctxsw\": %ld, \"involuntary_ctxsw\": %ld }",
+				first ? "" : ",", JsonEscape(st.name).c_str(), (int)st.tid, st.user_sec, st.sys_sec, st.nvcsw, st.nivcsw);
+		first = false;
+	}
+	fprintf(f, "\n  ]\n}\n");
+	fclose(f);
+}
@@ -0,0 +1,66 @@
+#ifndef CAFFINITY_H
+#define CAFFINITY_H
+
+// 线程绑核
+// 一个会话的所有阶段线程(解复用+解码、各输出端)都绑到同一个 NUMA 节点的核上，
+// 内存策略设为优先本节点，线程里分配的帧/包缓冲区都落在本节点内存；
+// 退出时统计每个线程的 CPU 时间和上下文切换次数。
+
+#include <sched.h>
+#include <sys/types.h>
+#include <mutex>
+#include <string>
+#include <vector>
+
+class CAffinity
+{
+public:
+	struct ThreadStat
+	{
+		std::string name;
+		pid_t tid;
+		bool done;
+		double user_sec;
+		double sys_sec;
+		long nvcsw;		// 主动切换
+		long nivcsw;	// 被动切换
+	};
+
+	static CAffinity *GetInstance();
+
+	// none: 不绑核，只统计；auto: 显卡所在节点，取不到时按进程号轮流分配；
+	// node:<n>: 指定节点；cpus:<list>: 指定核，如 "0-7,16-23"
+	bool Init(const char *policy);
+
+	// 当前线程按策略绑核并登记，线程开始时调用
+	void BindThread(const char *name);
+	// 记录当前线程的 CPU 时间，线程结束前调用
+	void ThreadDone();
+
+	int Node() const { return m_node; }
+	int NodeCount() const { return (int)m_node_cpus.size(); }
+
+	// 输出到日志；json_path 非空时另外写一份 JSON
+	void Report(const char *json_path = nullptr);
+	// 已结束线程的统计
+	std::vector<ThreadStat> Threads();
+
+	static bool ParseCpuList(const char *list, cpu_set_t &set);
+
+private:
+	CAffinity() {}
+
+	void LoadTopology();
+	static int DeviceNode();
+	void SetMemPolicy();
+
+	std::vector<cpu_set_t> m_node_cpus;	// 每个节点的核
+	bool m_bind = false;
+	int m_node = -1;
+	cpu_set_t m_cpus;
+
+	std::mutex m_mutex;
+	std::vector<ThreadStat> m_threads;
+};
+
+#endif // CAFFINITY_H
@@ -0,0 +1,273 @@
+#include "cautotune.h"
+#include "cencoderbackend.h"
+#include "cspdlog.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#define TUNE_MARGIN 0.02	// 快这么多以上才换，小于这个当作测量误差
+
+// 不传给测试的选项(按前缀)：测试只是短时编码，不能写缓存、推流，也不能覆盖用户的报告和跟踪文件
+static const char *s_trial_strip[] = { "autotune-", "frame-cache", "publish", "job-report", "mem-report", "trace" };
+
+typedef std::map<std::string, std::string> TuneConfig;
+
+struct TuneParam
+{
+	const char *option;
+	const char *def;
+	std::vector<std::string> values;
+};
+
+struct TrialResult
+{
+	bool ok;
+	double fps;
+	double latency_ms;
+	double latency_max_ms;
+	double bit_rate;		// bit/s
+};
+
+void WriteTrialResult(const char *path, const EncodeStats &stats, int64_t run_ms, double frame_rate, int status)
+{
+	FILE *f = fopen(path, "w");
+	if (!f)
+		return;
+	double duration = frame_rate > 0 ? stats.frames / frame_rate : 0;
+	fprintf(f, "status=%d\nframes=%lld\nrun_ms=%lld\nfps=%.3f\nlatency_us=%.1f\nlatency_max_us=%lld\nbit_rate=%.0f\n",
+			status, (long long)stats.frames, (long long)run_ms,
+			run_ms > 0 ? stats.frames * 1000.0 / run_ms : 0.0, stats.latency_us, (long long)stats.latency_max_us,
+			duration > 0 ? stats.bytes * 8 / duration : 0.0);
+	fclose(f);
+}
+
+static std::string ConfigKey(const TuneConfig &cfg)
+{
+	std::string key;
+	for (auto &it : cfg)
+		key += (key.empty() ? "" : " ") + it.first + "=" + it.second;
+	return key;
+}
+
+// 子进程跑一次短时编码，结果从 result_path 读
+static TrialResult RunTrial(const std::vector<std::string> &base, const TuneConfig &cfg,
+							const std::string &result_path, bool verbose)
+{
+	TrialResult r;
+	memset(&r, 0, sizeof(r));
+	unlink(result_path.c_str());
+
+	std::vector<std::string> args = base;
+	for (auto &it : cfg)
+		args.push_back("--" + it.first + "=" + it.second);
+	args.push_back("--autotune-result=" + result_path);
+	std::vector<char *> argv;
+	for (auto &a : args)
+		argv.push_back(const_cast<char *>(a.c_str()));
+	argv.push_back(nullptr);
+
+	pid_t pid = fork();
+	if (pid < 0)
+		return r;
+	if (pid == 0)
+	{
+		if (!verbose)
+		{
+			int fd = open("/dev/null", O_RDWR);
+			if (fd >= 0)
+			{
+				dup2(fd, STDOUT_FILENO);
+				dup2(fd, STDERR_FILENO);
+				close(fd);
+			}
+		}
+		execv("/proc/self/exe", argv.data());
+		_exit(127);
+	}
+
+	int status = 0;
+	while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+		;
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		return r;
+
+	// 结果文件和配置文件格式一样，每行 name=value
+	CCmdLine result;
+	if (!result.LoadProfile(result_path.c_str()) || result.GetInt("status", -1) < 0 || result.GetInt("frames", 0) <= 0)
+		return r;
+	r.ok = true;
+	r.fps = result.GetDouble("fps");
+	r.latency_ms = result.GetDouble("latency_us") / 1000;
+	r.latency_max_ms = result.GetDouble("latency_max_us") / 1000;
+	r.bit_rate = result.GetDouble("bit_rate");
+	return r;
+}
+
+int RunAutotune(int argc, char *argv[], const CCmdLine &cmdline)
+{
+	if (cmdline.PositionalCount() < 4)
+	{
+		fprintf(stderr, "Usage: %s autotune <device type|cpu> <sample clip> <profile> [bit rate(M)] [options]\n", argv[0]);
+		fprintf(stderr, "  --autotune-frames=<n>        frames per trial (default 300)\n");
+		fprintf(stderr, "  --autotune-rate-error=<f>    max relative bit rate error against the target (default 0.1)\n");
+		fprintf(stderr, "  --autotune-latency=<ms>      max average encode latency (0 = no limit, default)\n");
+		fprintf(stderr, "  --autotune-rounds=<n>        passes over all parameters (default 2)\n");
+		fprintf(stderr, "  --autotune-verbose           show the output of each trial\n");
+		fprintf(stderr, "  other options (--encoder, --encode-preset, ...) are passed to every trial and kept fixed\n");
+		return -1;
+	}
+
+	// 1. 参数和约束
+	const char *device = cmdline.Positional(1);
+	const char *sample = cmdline.Positional(2);
+	std::string profile = cmdline.Positional(3);
+	int bit_rate = atoi(cmdline.Positional(4, "4"));
+	if (bit_rate <= 0)
+		bit_rate = 4;
+	double target = (double)bit_rate * 1024 * 1024;
+	int64_t frames = cmdline.GetInt("autotune-frames", 300);
+	double max_rate_error = cmdline.GetDouble("autotune-rate-error", 0.1);
+	double max_latency = cmdline.GetDouble("autotune-latency", 0);
+	int rounds = (int)cmdline.GetInt("autotune-rounds", 2);
+	bool verbose = cmdline.GetBool("autotune-verbose");
+
+	// 2. 每次测试的公共参数：用户的其他选项原样传(去掉 s_trial_strip 里的)，只编码一路，不写附带文件
+	std::string output = profile + ".trial.mp4";
+	std::string result_path = profile + ".trial.txt";
+	std::vector<std::string> base;
+	base.push_back(argv[0]);
+	base.push_back(device);
+	base.push_back(sample);
+	base.push_back(output);
+	base.push_back(std::to_string(bit_rate));
+	for (int i = 1; i < argc; i++)
+	{
+		if (strncmp(argv[i], "--", 2) != 0)
+			continue;
+		bool strip = false;
+		for (const char *prefix : s_trial_strip)
+			strip = strip || strncmp(argv[i] + 2, prefix, strlen(prefix)) == 0;
+		if (!strip)
+			base.push_back(argv[i]);
+	}
+	base.push_back("--sink=encode");
+	base.push_back("--checkpoint=0");
+	base.push_back("--keyframe-index=0");
+	base.push_back("--frames=" + std::to_string((long long)frames));
+
+	// 3. 搜索空间，起点是命令行(或 --profile)给的值，没有时是程序默认值
+	std::string encoder = cmdline.GetStr("encoder", strcmp(device, "cpu") == 0 ? "auto" : "vaapi");
+	bool software = encoder != "vaapi" && !(encoder == "auto" && strcmp(device, "vaapi") == 0);
+	std::vector<TuneParam> params;
+	// 只搜索不影响画质的参数；GOP、B 帧、码率缓冲会拿画质换速度，没有画质指标时不能比，按用户给的值固定
+	params.push_back(TuneParam{ "sink-queue", "8", { "2", "4", "8", "16" } });
+	if (software)
+	{
+		int cores = AvailableCores();
+		TuneParam threads{ "encode-threads", "0", { "0" } };
+		for (int n = cores / 2; n >= 1 && threads.values.size() < 4; n /= 2)
+			threads.values.push_back(std::to_string(n));
+		params.push_back(threads);
+	}
+	else
+		params.push_back(TuneParam{ "encode-pool", "20", { "8", "12", "20", "32" } });
+
+	TuneConfig best;
+	for (auto &p : params)
+		best[p.option] = cmdline.GetStr(p.option, p.def);
+
+	std::map<std::string, TrialResult> tried;
+	auto feasible = [&](const TrialResult &r)
+	{
+		return r.ok && fabs(r.bit_rate - target) <= target * max_rate_error &&
+			   (max_latency <= 0 || r.latency_ms <= max_latency);
+	};
+	auto evaluate = [&](const TuneConfig &cfg)
+	{
+		std::string key = ConfigKey(cfg);
+		auto it = tried.find(key);
+		if (it != tried.end())
+			return it->second;
+		TrialResult r = RunTrial(base, cfg, result_path, verbose);
+		if (r.ok)
+			MYLOG_INFO(LOG_MOD_MAIN, "autotune %s: %.1f fps, latency %.2f ms (max %.1f ms), bit rate %.2f M (%+.1f%%)%s",
+					   key, r.fps, r.latency_ms, r.latency_max_ms, r.bit_rate / (1024 * 1024),
+					   (r.bit_rate - target) * 100 / target, feasible(r) ? "" : ", out of constraints");
+		else
+			MYLOG_WARN(LOG_MOD_MAIN, "autotune %s: trial failed", key);
+		tried[key] = r;
+		return r;
+	};
+
+	// 4. 预热一次(文件缓存、驱动初始化)，结果不用
+	MYLOG_INFO(LOG_MOD_MAIN, "autotune %s on %s, %ld frames per trial, target %d M", device, sample, (long)frames, bit_rate);
+	if (!RunTrial(base, best, result_path, verbose).ok)
+	{
+		MYLOG_ERROR(LOG_MOD_MAIN, "autotune: the starting configuration does not run, check the device and options");
+		unlink(output.c_str());
+		unlink(result_path.c_str());
+		return -1;
+	}
+	TrialResult best_r = evaluate(best);
+
+	// 5. 坐标下降：一次改一个参数，其他保持当前最优
+	for (int round = 0; round < rounds; round++)
+	{
+		bool changed = false;
+		for (auto &p : params)
+		{
+			for (auto &value : p.values)
+			{
+				if (value == best[p.option])
+					continue;
+				TuneConfig cfg = best;
+				cfg[p.option] = value;
+				TrialResult r = evaluate(cfg);
+				if (feasible(r) && (!feasible(best_r) || r.fps > best_r.fps * (1 + TUNE_MARGIN)))
+				{
+					best = cfg;
+					best_r = r;
+					changed = true;
+				}
+			}
+		}
+		if (!changed)
+			break;
+	}
+	unlink(output.c_str());
+	unlink(result_path.c_str());
+
+	if (!feasible(best_r))
+	{
+		MYLOG_ERROR(LOG_MOD_MAIN, "autotune: no configuration met the constraints (bit rate error %.0f%%, latency %.0f ms), %d tried",
+					max_rate_error * 100, max_latency, (int)tried.size());
+		return 1;
+	}
+
+	// 6. 写配置文件
+	FILE *f = fopen(profile.c_str(), "w");
+	if (!f)
+	{
+		MYLOG_ERROR(LOG_MOD_MAIN, "Cannot open profile '%s'", profile);
+		return -1;
+	}
+	fprintf(f, "# testFFmpeg autotune: %s, encoder %s, %s, %ld frames per trial, %d trials\n",
+			device, encoder.c_str(), sample, (long)frames, (int)tried.size());
+	fprintf(f, "# %.1f fps, latency %.2f ms (max %.1f ms), bit rate %.2f M for target %d M\n",
+			best_r.fps, best_r.latency_ms, best_r.latency_max_ms, best_r.bit_rate / (1024 * 1024), bit_rate);
+	for (auto &it : best)
+		fprintf(f, "%s=%s\n", it.first.c_str(), it.second.c_str());
+	fclose(f);
+
+	MYLOG_INFO(LOG_MOD_MAIN, "autotune: best %s, %.1f fps, written to %s", ConfigKey(best), best_r.fps, profile);
+	return 0;
+}
@@ -0,0 +1,19 @@
+#ifndef CAUTOTUNE_H
+#define CAUTOTUNE_H
+
+// 编码参数自动调优：用样片做多次短时编码(每次一个子进程，--frames 限制帧数)，
+// 逐个参数在候选值里搜索(坐标下降，只调不影响画质的队列、线程、表面池)，测吞吐量、编码延迟和实际码率，
+// 满足码率误差和延迟约束的配置里取最快的，写成 --profile 可以直接读的配置文件。
+// 不同代的显卡和驱动最优值不同，每种机器跑一次。
+
+#include <stdint.h>
+#include "ccmdline.h"
+#include "cencodesink.h"
+
+// testFFmpeg autotune <device type|cpu> <sample clip> <profile> [bit rate(M)] [options]
+int RunAutotune(int argc, char *argv[], const CCmdLine &cmdline);
+
+// 子进程(--autotune-result=<path>)结束时写这次测试的结果
+void WriteTrialResult(const char *path, const EncodeStats &stats, int64_t run_ms, double frame_rate, int status);
+
+#endif // CAUTOTUNE_H
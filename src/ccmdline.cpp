@@ -0,0 +1,93 @@
+#include "ccmdline.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void CCmdLine::Parse(int argc, char *argv[])
+{
+	for (int i = 1; i < argc; i++)
+	{
+		const char *arg = argv[i];
+		if (strncmp(arg, "--", 2) != 0 || arg[2] == 0)
+		{
+			m_positional.push_back(arg);
+			continue;
+		}
+
+		const char *eq = strchr(arg + 2, '=');
+		if (eq)
+			m_options[std::string(arg + 2, eq - arg - 2)] = eq + 1;
+		else
+			m_options[arg + 2] = "";
+	}
+}
+
+const char *CCmdLine::GetStr(const char *name, const char *def) const
+{
+	m_used[name] = true;
+	auto it = m_options.find(name);
+	return it == m_options.end() ? def : it->second.c_str();
+}
+
+int64_t CCmdLine::GetInt(const char *name, int64_t def) const
+{
+	const char *s = GetStr(name);
+	if (!s || !*s)
+		return def;
+	return strtoll(s, nullptr, 0);
+}
+
+double CCmdLine::GetDouble(const char *name, double def) const
+{
+	const char *s = GetStr(name);
+	if (!s || !*s)
+		return def;
+	return strtod(s, nullptr);
+}
+
+bool CCmdLine::GetBool(const char *name, bool def) const
+{
+	const char *s = GetStr(name);
+	if (!s)
+		return def;
+	if (!*s)
+		return true;
+	return !(strcmp(s, "0") == 0 || strcmp(s, "no") == 0 || strcmp(s, "false") == 0 || strcmp(s, "off") == 0);
+}
+
+bool CCmdLine::LoadProfile(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	if (!f)
+		return false;
+
+	char line[512];
+	while (fgets(line, sizeof(line), f))
+	{
+		line[strcspn(line, "\r\n")] = 0;
+		const char *p = line;
+		while (*p == ' ' || *p == '\t')
+			p++;
+		if (*p == '#' || *p == 0)
+			continue;
+
+		const char *eq = strchr(p, '=');
+		std::string name = eq ? std::string(p, eq - p) : std::string(p);
+		if (!m_options.count(name))
+			m_options[name] = eq ? eq + 1 : "";
+	}
+	fclose(f);
+	return true;
+}
+
+std::vector<std::string> CCmdLine::Unused() const
+{
+	std::vector<std::string> names;
+	for (auto &it : m_options)
+	{
+		if (!m_used.count(it.first))
+			names.push_back(it.first);
+	}
+	return names;
+}
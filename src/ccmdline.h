@@ -0,0 +1,45 @@
+#ifndef CCMDLINE_H
+#define CCMDLINE_H
+
+// 命令行解析：位置参数按顺序保留，"--name=value" / "--name" 作为选项
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+
+class CCmdLine
+{
+public:
+	void Parse(int argc, char *argv[]);
+
+	size_t PositionalCount() const { return m_positional.size(); }
+	const char *Positional(size_t i, const char *def = nullptr) const
+	{
+		return i < m_positional.size() ? m_positional[i].c_str() : def;
+	}
+
+	bool Has(const char *name) const
+	{
+		m_used[name] = true;
+		return m_options.count(name) != 0;
+	}
+	const char *GetStr(const char *name, const char *def = nullptr) const;
+	int64_t GetInt(const char *name, int64_t def = 0) const;
+	double GetDouble(const char *name, double def = 0.0) const;
+	// 开关选项："--name" 或 "--name=1/0/yes/no"
+	bool GetBool(const char *name, bool def = false) const;
+
+	// 读配置文件(每行 "name=value"，# 开头为注释)，命令行上已有的选项不覆盖
+	bool LoadProfile(const char *path);
+
+	// 没有被 Get/Has 访问过的选项，用于提示拼写错误
+	std::vector<std::string> Unused() const;
+
+private:
+	std::vector<std::string> m_positional;
+	std::map<std::string, std::string> m_options;
+	mutable std::map<std::string, bool> m_used;
+};
+
+#endif // CCMDLINE_H
@@ -0,0 +1,398 @@
+#include "cencoderbackend.h"
+#include "cmemtrack.h"
+#include "cspdlog.h"
+#include "pixfmttraits.h"
+#include "caccel.h"
+#include "cjobstats.h"
+
+extern "C"
+{
+#include <libavutil/hwcontext.h>
+#include <libavutil/opt.h>
+#include <libavutil/pixdesc.h>
+#include <libswscale/swscale.h>
+}
+
+#include <sched.h>
+#include <unistd.h>
+#include <limits.h>
+#include <string.h>
+#include <stdexcept>
+
+int AvailableCores()
+{
+	cpu_set_t set;
+	if (sched_getaffinity(0, sizeof(set), &set) == 0 && CPU_COUNT(&set) > 0)
+		return CPU_COUNT(&set);
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (int)n : 1;
+}
+
+// HRD 缓冲(比特)，高码率时会超过 int
+static int RcBufferSize(int64_t bit_rate, double seconds)
+{
+	double size = bit_rate * seconds;
+	return size > INT_MAX ? INT_MAX : (int)size;
+}
+
+//****************************************** */
+
+AVCodecContext *CVaapiEncoder::Open(const EncodeConfig &cfg)
+{
+	CMemTrack *mem = CMemTrack::GetInstance();
+	int ret;
+
+	if (!cfg.hw_device_ctx)
+	{
+		throw std::runtime_error("vaapi encoder needs a hardware device");
+	}
+
+	// 2. 创建硬件帧上下文，内存中的帧(如帧缓存)上传时从这里取显存
+	AVBufferRef *hw_frames_ref = CreateHwFramesCtx(cfg.hw_device_ctx, AV_PIX_FMT_VAAPI, cfg.sw_format,
+												   cfg.width, cfg.height, cfg.pool_size);
+	int pool_size = ((AVHWFramesContext *)hw_frames_ref->data)->initial_pool_size;
+
+	// 3. 查找编码器（使用 hevc_vaapi 编码器）
+	const AVCodec *codec_en = avcodec_find_encoder_by_name("hevc_vaapi");
+	if (!codec_en)
+	{
+		av_buffer_unref(&hw_frames_ref);
+		throw std::runtime_error("Codec vaapi not found");
+	}
+
+	// 4. 创建编码器上下文
+	AVCodecContext *codec_ctx = avcodec_alloc_context3(codec_en);
+	if (!codec_ctx)
+	{
+		av_buffer_unref(&hw_frames_ref);
+		throw std::runtime_error("Could not allocate video codec context");
+	}
+
+	// 配置编码器参数
+	int64_t bit_rate = cfg.bit_rate;
+	codec_ctx->hw_frames_ctx = av_buffer_ref(hw_frames_ref);	// 绑定硬件帧上下文
+	mem->SetHwPool(hw_frames_ref, "encode", pool_size);
+	av_buffer_unref(&hw_frames_ref);
+	codec_ctx->width = cfg.width;								// 视频宽度
+	codec_ctx->height = cfg.height;								// 视频高度
+	codec_ctx->time_base = av_inv_q(cfg.frame_rate);			// 时间基（帧率的倒数）
+	codec_ctx->framerate = cfg.frame_rate;						// 帧率
+	codec_ctx->pix_fmt = AV_PIX_FMT_VAAPI;						// 像素格式
+	codec_ctx->bit_rate = bit_rate;								// 码率（bit/s）
+	codec_ctx->rc_min_rate = bit_rate;
+	codec_ctx->rc_max_rate = bit_rate;
+	codec_ctx->bit_rate_tolerance = bit_rate / 2;				//允许比特流偏离参考的比特数
+	codec_ctx->rc_buffer_size = RcBufferSize(bit_rate, cfg.rc_buffer);	// HRD 缓冲(比特)
+	codec_ctx->color_primaries = cfg.color_primaries;
+	codec_ctx->color_trc = cfg.color_trc;
+	codec_ctx->colorspace = cfg.colorspace;
+	codec_ctx->color_range = cfg.color_range;
+
+	codec_ctx->gop_size = cfg.gop_size;							// GOP 大小（关键帧间隔）
+	codec_ctx->max_b_frames = cfg.max_b_frames;
+	if (cfg.checkpoint_frames > 0)
+		codec_ctx->flags |= AV_CODEC_FLAG_CLOSED_GOP;			// 分段在关键帧处切开，GOP 不能跨段引用
+
+	av_opt_set(codec_ctx->priv_data, "nal-hrd", "cbr", 0);
+	av_opt_set(codec_ctx->priv_data, "profile", cfg.sw_format == AV_PIX_FMT_P010 ? "main10" : "high", 0);
+
+	// 打开编码器
+	ret = avcodec_open2(codec_ctx, codec_en, nullptr);
+	if (ret < 0)
+	{
+		avcodec_free_context(&codec_ctx);
+		throw std::runtime_error("Could not open codec");
+	}
+	return codec_ctx;
+}
+
+int CVaapiEncoder::Prepare(AVCodecContext *ctx, AVFrame *in, AVFrame **out)
+{
+	CMemTrack *mem = CMemTrack::GetInstance();
+	int ret;
+
+	*out = in;
+	if (in->hw_frames_ctx)
+		return 0;
+
+	// 内存中的帧先拷贝到硬件帧
+	AVFrame *hw_frame = mem->FrameAlloc(MEM_STAGE_ENCODE);
+	if (!hw_frame)
+		return AVERROR(ENOMEM);
+	if ((ret = av_hwframe_get_buffer(ctx->hw_frames_ctx, hw_frame, 0)) < 0 ||
+		(ret = HwTransfer(hw_frame, in)) < 0 ||
+		(ret = av_frame_copy_props(hw_frame, in)) < 0)
+	{
+		MYLOG_ERROR(LOG_MOD_HW, "Error transferring data to hardware frame");
+		mem->FrameFree(&hw_frame);
+		return ret;
+	}
+	mem->FrameUpdate(hw_frame);
+	*out = hw_frame;
+	return 0;
+}
+
+//****************************************** */
+
+// 每核每秒能编多少百万像素，按 preset 从慢到快；只用来粗略选档
+struct PresetSpeed
+{
+	const char *preset;
+	double mpix_per_core;
+};
+
+static const PresetSpeed s_x264_presets[] = {
+	{ "slow", 8 }, { "medium", 15 }, { "fast", 22 }, { "faster", 30 },
+	{ "veryfast", 50 }, { "superfast", 80 }, { "ultrafast", 120 }, { nullptr, 0 },
+};
+static const PresetSpeed s_x265_presets[] = {
+	{ "slow", 1.5 }, { "medium", 3.5 }, { "fast", 6 }, { "faster", 10 },
+	{ "veryfast", 12 }, { "superfast", 20 }, { "ultrafast", 25 }, { nullptr, 0 },
+};
+static const PresetSpeed s_svtav1_presets[] = {
+	{ "4", 1 }, { "5", 1.8 }, { "6", 3 }, { "7", 5 }, { "8", 9 },
+	{ "9", 14 }, { "10", 20 }, { "11", 30 }, { "12", 40 }, { nullptr, 0 },
+};
+
+const char *CSoftEncoder::CodecName(const std::string &name)
+{
+	if (name == "x264")
+		return "libx264";
+	if (name == "x265")
+		return "libx265";
+	if (name == "svtav1")
+		return "libsvtav1";
+	return nullptr;
+}
+
+const char *CSoftEncoder::PickPreset(const std::string &name, int cores, int width, int height, double fps)
+{
+	const PresetSpeed *table = name == "x264" ? s_x264_presets : name == "x265" ? s_x265_presets : s_svtav1_presets;
+
+	// 留 25% 余量给解码和其他输出端
+	double need = (double)width * height * fps / 1e6 * 1.25;
+	const PresetSpeed *p = table;
+	for (; p[1].preset; p++)
+	{
+		if (p->mpix_per_core * cores >= need)
+			break;
+	}
+	return p->preset;
+}
+
+CSoftEncoder::~CSoftEncoder()
+{
+	sws_freeContext(m_sws);
+	CMemTrack::GetInstance()->FrameFree(&m_conv);
+}
+
+AVCodecContext *CSoftEncoder::Open(const EncodeConfig &cfg)
+{
+	const char *codec_name = CodecName(m_name);
+	const AVCodec *codec_en = codec_name ? avcodec_find_encoder_by_name(codec_name) : nullptr;
+	if (!codec_en)
+	{
+		throw std::runtime_error("Software encoder " + m_name + " not found");
+	}
+
+	AVCodecContext *codec_ctx = avcodec_alloc_context3(codec_en);
+	if (!codec_ctx)
+	{
+		throw std::runtime_error("Could not allocate video codec context");
+	}
+
+	// 优先用解码出来的格式，其次位深相同的格式，都没有时用编码器的第一个格式，送帧前转换
+	const AVPixFmtDescriptor *sw_desc = av_pix_fmt_desc_get(cfg.sw_format);
+	int depth = sw_desc ? sw_desc->comp[0].depth : 8;
+	enum AVPixelFormat pix_fmt = AV_PIX_FMT_NONE;
+	int best = -1;
+	for (const enum AVPixelFormat *p = codec_en->pix_fmts; p && *p != AV_PIX_FMT_NONE; p++)
+	{
+		const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(*p);
+		int score = *p == cfg.sw_format ? 2 : desc && desc->comp[0].depth == depth ? 1 : 0;
+		if (score > best)
+		{
+			best = score;
+			pix_fmt = *p;
+		}
+	}
+	if (pix_fmt == AV_PIX_FMT_NONE)
+		pix_fmt = AV_PIX_FMT_YUV420P;
+	const AVPixFmtDescriptor *pix_desc = av_pix_fmt_desc_get(pix_fmt);
+	bool ten_bit = pix_desc && pix_desc->comp[0].depth > 8;
+
+	// 码率设置和 hevc_vaapi 一致(CBR)，HRD 缓冲以比特计
+	int64_t bit_rate = cfg.bit_rate;
+	codec_ctx->width = cfg.width;
+	codec_ctx->height = cfg.height;
+	codec_ctx->time_base = av_inv_q(cfg.frame_rate);
+	codec_ctx->framerate = cfg.frame_rate;
+	codec_ctx->pix_fmt = pix_fmt;
+	codec_ctx->bit_rate = bit_rate;
+	codec_ctx->rc_min_rate = bit_rate;
+	codec_ctx->rc_max_rate = bit_rate;
+	codec_ctx->bit_rate_tolerance = bit_rate / 2;
+	codec_ctx->rc_buffer_size = RcBufferSize(bit_rate, cfg.rc_buffer);
+	// 0 为编码器默认：libx264 把 0 当成全 I 帧，不能直接传
+	if (cfg.gop_size > 0)
+		codec_ctx->gop_size = cfg.gop_size;
+	codec_ctx->max_b_frames = cfg.max_b_frames;
+	codec_ctx->color_primaries = cfg.color_primaries;
+	codec_ctx->color_trc = cfg.color_trc;
+	codec_ctx->colorspace = cfg.colorspace;
+	codec_ctx->color_range = cfg.color_range;
+	if (cfg.checkpoint_frames > 0)
+		codec_ctx->flags |= AV_CODEC_FLAG_CLOSED_GOP;
+
+	// 线程数和 preset：绑核后按绑定的核数算
+	int cores = AvailableCores();
+	double fps = cfg.target_fps > 0 ? cfg.target_fps : av_q2d(cfg.frame_rate);
+	const char *preset = cfg.preset.empty() ? PickPreset(m_name, cores, cfg.width, cfg.height, fps) : cfg.preset.c_str();
+	codec_ctx->thread_count = cfg.threads > 0 ? cfg.threads : cores;
+	codec_ctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+	av_opt_set(codec_ctx->priv_data, "preset", preset, 0);
+
+	if (m_name == "x264")
+	{
+		av_opt_set(codec_ctx->priv_data, "nal-hrd", "cbr", 0);
+		av_opt_set(codec_ctx->priv_data, "profile", ten_bit ? "high10" : "high", 0);
+	}
+	else if (m_name == "x265")
+	{
+		// x265 没有 nal-hrd 选项，HRD 和严格 CBR 通过 x265-params 打开
+		char params[128];
+		snprintf(params, sizeof(params), "hrd=1:strict-cbr=1:pools=%d", codec_ctx->thread_count);
+		av_opt_set(codec_ctx->priv_data, "x265-params", params, 0);
+		av_opt_set(codec_ctx->priv_data, "profile", ten_bit ? "main10" : "main", 0);
+	}
+	else if (m_name == "svtav1")
+	{
+		// SVT-AV1 的 CBR 只支持低延迟结构，这里用最大码率封顶的 VBR
+		char params[64];
+		snprintf(params, sizeof(params), "rc=1:lp=%d", codec_ctx->thread_count);
+		av_opt_set(codec_ctx->priv_data, "svtav1-params", params, 0);
+	}
+
+	int ret = avcodec_open2(codec_ctx, codec_en, nullptr);
+	if (ret < 0)
+	{
+		avcodec_free_context(&codec_ctx);
+		throw std::runtime_error("Could not open codec " + std::string(codec_name));
+	}
+
+	MYLOG_INFO(LOG_MOD_ENCODE, "%s: preset %s, %d threads, %d cores, %s, target %.1f fps",
+			   codec_name, preset, codec_ctx->thread_count, cores, av_get_pix_fmt_name(pix_fmt), fps);
+	return codec_ctx;
+}
+
+int CSoftEncoder::Prepare(AVCodecContext *ctx, AVFrame *in, AVFrame **out)
+{
+	CMemTrack *mem = CMemTrack::GetInstance();
+	int ret = 0;
+
+	// 硬件帧先下载到内存
+	AVFrame *sw_frame = mem->FrameAlloc(MEM_STAGE_ENCODE);
+	if (!sw_frame)
+		return AVERROR(ENOMEM);
+	if (in->hw_frames_ctx)
+	{
+		if ((ret = HwTransfer(sw_frame, in)) >= 0)
+			ret = av_frame_copy_props(sw_frame, in);
+	}
+	else
+		ret = av_frame_ref(sw_frame, in);
+	if (ret < 0)
+	{
+		MYLOG_ERROR(LOG_MOD_HW, "Error transferring the data to system memory");
+		mem->FrameFree(&sw_frame);
+		return ret;
+	}
+	mem->FrameUpdate(sw_frame);
+
+	if (sw_frame->format == ctx->pix_fmt)
+	{
+		*out = sw_frame;
+		return 0;
+	}
+
+	// 像素格式转换，输出帧复用；编码器还引用着上一帧时 make_writable 会重新分配
+	if (!m_conv)
+	{
+		m_conv = mem->FrameAlloc(MEM_STAGE_ENCODE);
+		if (!m_conv)
+		{
+			mem->FrameFree(&sw_frame);
+			return AVERROR(ENOMEM);
+		}
+		m_conv->format = ctx->pix_fmt;
+		m_conv->width = ctx->width;
+		m_conv->height = ctx->height;
+		if ((ret = av_frame_get_buffer(m_conv, 0)) < 0)
+		{
+			mem->FrameFree(&sw_frame);
+			return ret;
+		}
+	}
+	if ((ret = av_frame_make_writable(m_conv)) < 0)
+	{
+		mem->FrameFree(&sw_frame);
+		return ret;
+	}
+	if (IsSemiPlanar(sw_frame->format) && IsSemiPlanar(ctx->pix_fmt))
+	{
+		// NV12 <-> P010 只是样本宽度不同，不走 swscale
+		if (sw_frame->format == AV_PIX_FMT_P010)
+			ConvertFrame<P010Traits, Nv12Traits>(sw_frame, m_conv);
+		else
+			ConvertFrame<Nv12Traits, P010Traits>(sw_frame, m_conv);
+	}
+	else
+	{
+		m_sws = sws_getCachedContext(m_sws, sw_frame->width, sw_frame->height, (AVPixelFormat)sw_frame->format,
+									 ctx->width, ctx->height, ctx->pix_fmt, SWS_BILINEAR, nullptr, nullptr, nullptr);
+		if (!m_sws)
+		{
+			mem->FrameFree(&sw_frame);
+			return AVERROR(EINVAL);
+		}
+		sws_scale(m_sws, sw_frame->data, sw_frame->linesize, 0, sw_frame->height, m_conv->data, m_conv->linesize);
+	}
+	mem->FrameUpdate(m_conv);
+
+	AVFrame *conv = mem->FrameAlloc(MEM_STAGE_ENCODE);
+	if (!conv || (ret = av_frame_ref(conv, m_conv)) < 0 || (ret = av_frame_copy_props(conv, sw_frame)) < 0)
+	{
+		mem->FrameFree(&conv);
+		mem->FrameFree(&sw_frame);
+		return ret < 0 ? ret : AVERROR(ENOMEM);
+	}
+	mem->FrameUpdate(conv);
+	mem->FrameFree(&sw_frame);
+	*out = conv;
+	return 0;
+}
+
+//****************************************** */
+
+CEncoderBackend *CreateEncoderBackend(const EncodeConfig &cfg)
+{
+	std::string name = cfg.encoder.empty() ? "vaapi" : cfg.encoder;
+	if (name == "auto")
+	{
+		if (cfg.hw_device_ctx && ((AVHWDeviceContext *)cfg.hw_device_ctx->data)->type == AV_HWDEVICE_TYPE_VAAPI)
+			return new CVaapiEncoder();
+		// 和硬件编码一样优先 HEVC
+		static const char *s_order[] = { "x265", "x264", "svtav1" };
+		for (const char *n : s_order)
+		{
+			if (avcodec_find_encoder_by_name(CSoftEncoder::CodecName(n)))
+				return new CSoftEncoder(n);
+		}
+		throw std::runtime_error("No hardware device and no software encoder available");
+	}
+	if (name == "vaapi")
+		return new CVaapiEncoder();
+	if (CSoftEncoder::CodecName(name))
+		return new CSoftEncoder(name);
+	throw std::runtime_error("Unknown encoder " + name);
+}
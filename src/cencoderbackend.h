@@ -0,0 +1,104 @@
+#ifndef CENCODERBACKEND_H
+#define CENCODERBACKEND_H
+
+// 编码后端
+// vaapi: hevc_vaapi 硬件编码，10 位输入用 Main10；x264/x265/svtav1: 没有显卡的机器上用 CPU 软件编码，
+// 码率/GOP/HRD 设置和硬件编码一致，线程数和 preset 按可用核数和目标吞吐量自动选。
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+
+#include <string>
+#include <vector>
+#include "checkpoint.h"
+#include "cstaticdetect.h"
+
+struct SwsContext;
+class CPacketRing;
+
+struct EncodeConfig
+{
+	AVBufferRef *hw_device_ctx;		// 硬件设备上下文，软件编码时可以为空
+	int width;
+	int height;
+	AVPixelFormat sw_format;		// 内存中的像素格式，NV12 或 P010(10 位，Main10)
+	// 色彩信息，HDR 源原样写入码流
+	AVColorPrimaries color_primaries;
+	AVColorTransferCharacteristic color_trc;
+	AVColorSpace colorspace;
+	AVColorRange color_range;
+	AVRational frame_rate;			// 帧率
+	int64_t bit_rate;				// 码率 bit/s(分块时按面积分，不是整 M)
+	int gop_size;					// 多少帧出一帧关键帧
+	int max_b_frames;				// B 帧数
+	double rc_buffer;				// HRD 缓冲 = 码率 * rc_buffer 秒
+	int pool_size;					// vaapi 编码硬件帧池大小
+	std::string output_filename;	// 编码后输出文件名
+	int checkpoint_frames;			// >0 时按关键帧切分段并写日志，每段至少这么多帧
+	CheckpointState resume;			// 续传起点，从头开始时为空状态
+	AVRational src_time_base;		// 输入视频流时间基，用于和拷贝的流对齐
+	std::vector<AVStream *> copy_streams;	// 要拷贝的输入流(音频/字幕)
+	CPacketRing *ring;				// 编码后的包同时写入这个环，可以为空
+
+	std::string encoder;			// vaapi x264 x265 svtav1 auto
+	std::string preset;				// 软件编码 preset，空为自动
+	int threads;					// 软件编码线程数，0 为可用核数
+	double target_fps;				// 软件编码目标吞吐量，0 为帧率
+
+	StaticConfig static_cfg;		// 静止帧检测，mean_diff 为 0 时关闭
+	bool keyframe_index;			// 在输出文件旁边写关键帧索引
+};
+
+class CEncoderBackend
+{
+public:
+	virtual ~CEncoderBackend() {}
+
+	virtual const char *Name() const = 0;
+	// 创建并打开编码器上下文，由调用者释放；失败抛 std::runtime_error
+	virtual AVCodecContext *Open(const EncodeConfig &cfg) = 0;
+	// 把输入帧转成编码器需要的帧；*out 等于 in 或者是新分配的帧(调用者释放)
+	virtual int Prepare(AVCodecContext *ctx, AVFrame *in, AVFrame **out) = 0;
+};
+
+// hevc_vaapi，内存中的帧先上传到显存
+class CVaapiEncoder : public CEncoderBackend
+{
+public:
+	const char *Name() const override { return "vaapi"; }
+	AVCodecContext *Open(const EncodeConfig &cfg) override;
+	int Prepare(AVCodecContext *ctx, AVFrame *in, AVFrame **out) override;
+};
+
+// libx264/libx265/libsvtav1，硬件帧先下载，像素格式不支持时用 swscale 转换
+class CSoftEncoder : public CEncoderBackend
+{
+public:
+	explicit CSoftEncoder(const std::string &name) : m_name(name) {}
+	~CSoftEncoder() override;
+
+	const char *Name() const override { return m_name.c_str(); }
+	AVCodecContext *Open(const EncodeConfig &cfg) override;
+	int Prepare(AVCodecContext *ctx, AVFrame *in, AVFrame **out) override;
+
+	// 编码器名 libx264 等，不支持的返回 nullptr
+	static const char *CodecName(const std::string &name);
+	// 按每核吞吐量估算选 preset：满足目标吞吐量的最慢(质量最好)的一档
+	static const char *PickPreset(const std::string &name, int cores, int width, int height, double fps);
+
+private:
+	std::string m_name;
+	SwsContext *m_sws = nullptr;
+	AVFrame *m_conv = nullptr;		// 转换后的帧，复用
+};
+
+// 按 cfg.encoder 创建；auto 有 vaapi 设备时用 vaapi，否则用第一个可用的软件编码器
+CEncoderBackend *CreateEncoderBackend(const EncodeConfig &cfg);
+
+// 当前线程可以用的核数(绑核后就是绑定的核)
+int AvailableCores();
+
+#endif // CENCODERBACKEND_H
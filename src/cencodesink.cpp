@@ -0,0 +1,569 @@
+#include "cencodesink.h"
+#include "cspdlog.h"
+#include "timestamp.h"
+#include "ctrace.h"
+
+#include <stdexcept>
+
+CEncodeSink::~CEncodeSink()
+{
+	Free();
+}
+
+void CEncodeSink::Open()
+{
+	CMemTrack *mem = CMemTrack::GetInstance();
+
+	// 2~6. 按配置创建编码后端并打开编码器
+	m_backend.reset(CreateEncoderBackend(m_cfg));
+	m_codec_ctx = m_backend->Open(m_cfg);
+	MYLOG_INFO(LOG_MOD_ENCODE, "encoder backend %s", m_backend->Name());
+	m_static.reset(new CStaticDetector(m_cfg.static_cfg));
+
+	// 拷贝的流，按输入流序号查找
+	for (AVStream *st : m_cfg.copy_streams)
+	{
+		if (st->index >= (int)m_copy_src.size())
+			m_copy_src.resize(st->index + 1, nullptr);
+		m_copy_src[st->index] = st;
+	}
+
+	// 环里的流：0 是视频，后面按顺序是拷贝的流
+	if (m_cfg.ring)
+	{
+		std::vector<RingStream> streams;
+		RingStream video;
+		video.par = avcodec_parameters_alloc();
+		video.time_base = m_codec_ctx->time_base;
+		if (!video.par || avcodec_parameters_from_context(video.par, m_codec_ctx) < 0)
+		{
+			avcodec_parameters_free(&video.par);
+			throw std::runtime_error("Could not allocate codec parameters");
+		}
+		streams.push_back(video);
+		m_ring_map.assign(m_copy_src.size(), -1);
+		for (AVStream *st : m_cfg.copy_streams)
+		{
+			RingStream copy;
+			copy.par = st->codecpar;
+			copy.time_base = st->time_base;
+			m_ring_map[st->index] = (int)streams.size();
+			streams.push_back(copy);
+		}
+		m_cfg.ring->SetStreams(streams);
+		avcodec_parameters_free(&streams[0].par);
+	}
+
+	// 7. 打开输出文件，断点续传时从日志记录的分段接着写
+	m_ckpt = m_cfg.resume;
+	m_num_frames = m_ckpt.frames;
+	m_segment_start = m_num_frames;
+	m_src_base = m_num_frames;
+	if (m_cfg.checkpoint_frames > 0)
+		OpenOutput(CheckpointSegmentPath(m_cfg.output_filename, m_ckpt.segments));
+	else
+		OpenOutput(m_cfg.output_filename);
+
+	// 编码输出的数据包，整个编码过程复用
+	m_pkt = mem->PacketAlloc(MEM_STAGE_ENCODE);
+	if (!m_pkt)
+	{
+		throw std::runtime_error("Could not allocate packet");
+	}
+}
+
+void CEncodeSink::OpenOutput(const std::string &filename)
+{
+	// 创建输出文件上下文
+	int ret = avformat_alloc_output_context2(&m_fmt_ctx, nullptr, nullptr, filename.c_str());
+	if (ret < 0)
+	{
+		throw std::runtime_error("Could not create output context");
+	}
+
+	// 8. 创建视频流
+	m_stream = avformat_new_stream(m_fmt_ctx, nullptr);
+	if (!m_stream)
+	{
+		throw std::runtime_error("Could not create video stream");
+	}
+
+	// 从编码器上下文复制参数到视频流
+	avcodec_parameters_from_context(m_stream->codecpar, m_codec_ctx);
+	m_stream->time_base = AVRational{1, 90000}; // 时间基
+
+	// 拷贝的流，输出格式不支持的编码跳过
+	m_copy_map.assign(m_copy_src.size(), -1);
+	for (AVStream *in : m_cfg.copy_streams)
+	{
+		if (avformat_query_codec(m_fmt_ctx->oformat, in->codecpar->codec_id, FF_COMPLIANCE_NORMAL) == 0)
+		{
+			MYLOG_WARN(LOG_MOD_MUX, "%s cannot hold %s stream #%d, skipped",
+					   filename, avcodec_get_name(in->codecpar->codec_id), in->index);
+			continue;
+		}
+		AVStream *out = avformat_new_stream(m_fmt_ctx, nullptr);
+		if (!out || avcodec_parameters_copy(out->codecpar, in->codecpar) < 0)
+		{
+			throw std::runtime_error("Could not create copied stream");
+		}
+		out->codecpar->codec_tag = 0;	// 让输出格式自己选
+		out->time_base = in->time_base;
+		out->disposition = in->disposition;
+		m_copy_map[in->index] = out->index;
+	}
+
+	// 9. 打开输出文件
+	if (!(m_fmt_ctx->oformat->flags & AVFMT_NOFILE))
+	{
+		ret = avio_open(&m_fmt_ctx->pb, filename.c_str(), AVIO_FLAG_WRITE);
+		if (ret < 0)
+		{
+			throw std::runtime_error("Could not open output file");
+		}
+	}
+
+	// 10. 写入文件头
+	ret = avformat_write_header(m_fmt_ctx, nullptr);
+	if (ret < 0)
+	{
+		throw std::runtime_error("Error writing header to output file");
+	}
+	m_header_written = true;
+
+	// 关键帧索引，时间基用写头之后复用器定下来的
+	if (m_cfg.keyframe_index && m_fmt_ctx->pb)
+	{
+		const char *format = m_fmt_ctx->oformat->name;
+		if (!KeyframeIndexSupported(format))
+			MYLOG_WARN(LOG_MOD_MUX, "%s muxer does not write packets straight through, no keyframe index for %s", format, filename);
+		else if (!m_kfi.Open(KeyframeIndexPath(filename), m_stream->time_base, format))
+			MYLOG_WARN(LOG_MOD_MUX, "Could not create keyframe index for %s", filename);
+	}
+}
+
+// 写文件尾并关闭当前输出文件
+int CEncodeSink::CloseOutput()
+{
+	int ret = 0;
+	if (m_header_written)
+	{
+		// 13. 写入文件尾
+		ret = av_write_trailer(m_fmt_ctx);
+		m_header_written = false;
+	}
+	m_kfi.Close();
+	if (m_fmt_ctx && !(m_fmt_ctx->oformat->flags & AVFMT_NOFILE))
+	{
+		avio_closep(&m_fmt_ctx->pb);
+	}
+	avformat_free_context(m_fmt_ctx);
+	m_fmt_ctx = nullptr;
+	m_stream = nullptr;
+	return ret;
+}
+
+// 当前分段写完，关闭文件后把下一段的起点写进日志
+int CEncodeSink::CommitSegment(int64_t next_frame, bool complete, bool last)
+{
+	std::string seg = CheckpointSegmentPath(m_cfg.output_filename, m_ckpt.segments);
+	int64_t size = m_fmt_ctx && m_fmt_ctx->pb ? avio_tell(m_fmt_ctx->pb) : 0;
+	int ret = CloseOutput();
+	if (ret < 0)
+	{
+		MYLOG_ERROR(LOG_MOD_MUX, "Error closing segment %s", seg);
+		return ret;
+	}
+
+	// 丢掉已提交帧的输入 PTS，剩下第一项就是下一段的起点
+	while (m_src_base < next_frame && !m_src_pts.empty())
+	{
+		m_src_pts.pop_front();
+		m_src_base++;
+	}
+
+	m_ckpt.segments++;
+	m_ckpt.frames = next_frame;
+	m_ckpt.output_bytes += size;
+	m_ckpt.complete = complete;
+	if (!m_src_pts.empty() && m_src_base == next_frame)
+		m_ckpt.input_pts = m_src_pts.front();
+	else if (last && m_last_src_pts != AV_NOPTS_VALUE)
+		m_ckpt.input_pts = m_last_src_pts + 1;	// 输入没读完就结束，续传从最后一帧之后开始
+	if (!CheckpointSave(m_cfg.output_filename, m_ckpt))
+	{
+		MYLOG_ERROR(LOG_MOD_MUX, "Could not write journal for %s", m_cfg.output_filename);
+		return AVERROR(EIO);
+	}
+	MYLOG_INFO(LOG_MOD_MUX, "committed %s, frames %ld, bytes %ld",
+			   seg, (long)m_ckpt.frames, (long)m_ckpt.output_bytes);
+
+	m_segment_start = next_frame;
+	if (!last)
+	{
+		try
+		{
+			OpenOutput(CheckpointSegmentPath(m_cfg.output_filename, m_ckpt.segments));
+		}
+		catch (const std::exception &e)
+		{
+			MYLOG_ERROR(LOG_MOD_MUX, "%s", e.what());
+			return AVERROR(EIO);
+		}
+	}
+	return 0;
+}
+
+void CEncodeSink::PushPacket(const AVPacket *pkt)
+{
+	if (pkt->stream_index >= (int)m_copy_src.size() || !m_copy_src[pkt->stream_index])
+		return;
+
+	CMemTrack *mem = CMemTrack::GetInstance();
+	std::lock_guard<std::mutex> lock(m_copy_mutex);
+	// 编码出错停下来后不再收，避免队列无限增长
+	if (m_copy_closed)
+		return;
+
+	AVPacket *copy = mem->PacketAlloc(MEM_STAGE_MUX);
+	if (!copy || av_packet_ref(copy, pkt) < 0)
+	{
+		MYLOG_ERROR(LOG_MOD_MUX, "Could not queue packet of stream #%d", pkt->stream_index);
+		mem->PacketFree(&copy);
+		return;
+	}
+	mem->PacketUpdate(copy);
+	m_copy_pkts.push_back(copy);
+}
+
+// 出错或关闭后丢掉排队的数据包，之后也不再收
+void CEncodeSink::DropCopyPackets()
+{
+	CMemTrack *mem = CMemTrack::GetInstance();
+	std::lock_guard<std::mutex> lock(m_copy_mutex);
+	m_copy_closed = true;
+	for (AVPacket *pkt : m_copy_pkts)
+		mem->PacketFree(&pkt);
+	m_copy_pkts.clear();
+}
+
+// 把排队的拷贝流数据包写入文件，不晚于已写出视频的先写，其余留到下一个视频包之后，
+// 这样按时间和视频交织，复用器收到包就直接写入，索引里的文件偏移是准确的
+int CEncodeSink::WriteCopyPackets(bool flush)
+{
+	// 第一帧视频之前不知道时间偏移，先留在队列里
+	if (m_start_us == AV_NOPTS_VALUE && !flush)
+		return 0;
+
+	CMemTrack *mem = CMemTrack::GetInstance();
+	std::deque<AVPacket *> pkts;
+	{
+		std::lock_guard<std::mutex> lock(m_copy_mutex);
+		pkts.swap(m_copy_pkts);
+	}
+
+	int ret = 0;
+	while (!pkts.empty())
+	{
+		AVPacket *pkt = pkts.front();
+		int in = pkt->stream_index;
+		int out = m_copy_map[in];
+		if (ret >= 0 && (out >= 0 || m_cfg.ring) && m_header_written)
+		{
+			// 视频从输出时间 0 开始，拷贝的流减去同样的偏移
+			AVRational in_tb = m_copy_src[in]->time_base;
+			int64_t offset = m_start_us == AV_NOPTS_VALUE ? 0 : av_rescale_q(m_start_us, AVRational{1, AV_TIME_BASE}, in_tb);
+			int64_t ts = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+			if (ts != AV_NOPTS_VALUE)
+				ts -= offset;
+
+			// 比已写出的视频晚，等下一个视频包
+			if (!flush && ts != AV_NOPTS_VALUE &&
+				(m_mux_video_us == AV_NOPTS_VALUE || av_rescale_q(ts, in_tb, AVRational{1, AV_TIME_BASE}) > m_mux_video_us))
+				break;
+
+			if (pkt->pts != AV_NOPTS_VALUE)
+				pkt->pts -= offset;
+			if (pkt->dts != AV_NOPTS_VALUE)
+				pkt->dts -= offset;
+
+			// 续传时已提交部分之前的数据包丢掉
+			int64_t begin = av_rescale_q(m_cfg.resume.frames, m_codec_ctx->time_base, in_tb);
+			if (ts != AV_NOPTS_VALUE && ts >= begin && m_cfg.ring)
+			{
+				// 环里保持输入时间基，各输出自己换算
+				pkt->stream_index = m_ring_map[in];
+				m_cfg.ring->Push(pkt);
+			}
+			if (ts != AV_NOPTS_VALUE && ts >= begin && out >= 0)
+			{
+				av_packet_rescale_ts(pkt, in_tb, m_fmt_ctx->streams[out]->time_base);
+				pkt->stream_index = out;
+				ret = av_write_frame(m_fmt_ctx, pkt);
+				if (ret < 0)
+					MYLOG_ERROR(LOG_MOD_MUX, "Error writing copied packet to file");
+			}
+		}
+		pkts.pop_front();
+		mem->PacketFree(&pkt);
+	}
+
+	// 没写的放回队列前面，保持顺序
+	if (!pkts.empty())
+	{
+		std::lock_guard<std::mutex> lock(m_copy_mutex);
+		m_copy_pkts.insert(m_copy_pkts.begin(), pkts.begin(), pkts.end());
+	}
+	return ret;
+}
+
+// 取出编码器里所有可用的数据包写入文件
+int CEncodeSink::ReceivePackets(int64_t start_us)
+{
+	CMemTrack *mem = CMemTrack::GetInstance();
+	int ret = 0;
+
+	while (ret >= 0)
+	{
+		{
+			TRACE_SCOPE("encode_receive");
+			ret = avcodec_receive_packet(m_codec_ctx, m_pkt);
+		}
+		if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+			return 0;
+		if (ret < 0)
+		{
+			MYLOG_ERROR(LOG_MOD_ENCODE, "Error receiving packet from encoder");
+			return ret;
+		}
+		mem->PacketUpdate(m_pkt);
+
+		// 编码延迟：B 帧时数据包按解码顺序出来，按 PTS(帧编号)找送入时间
+		auto sent = m_send_us.find(m_pkt->pts);
+		if (sent != m_send_us.end())
+		{
+			int64_t latency = GetMonotonicUs() - sent->second;
+			m_latency_sum_us += latency;
+			m_latency_count++;
+			if (latency > m_latency_max_us)
+				m_latency_max_us = latency;
+			m_send_us.erase(sent);
+		}
+		m_video_bytes += m_pkt->size;
+
+		if (start_us >= 0)
+		{
+			int64_t temp = (GetMonotonicUs() - start_us) / 1000;
+			if(temp > 50)
+				MYLOG_WARN(LOG_MOD_ENCODE, "++++++++++++++++++encode spends %ld ms", temp);
+			else
+				MYLOG_DEBUG(LOG_MOD_ENCODE, "encode spends %ld ms", temp);
+		}
+
+		// 分段够长后在下一个关键帧处切开，关键帧属于新的分段
+		if (m_cfg.checkpoint_frames > 0 && (m_pkt->flags & AV_PKT_FLAG_KEY))
+		{
+			int64_t index = m_pkt->pts;
+			if (index - m_segment_start >= m_cfg.checkpoint_frames)
+			{
+				ret = CommitSegment(index, false, false);
+				if (ret < 0)
+				{
+					av_packet_unref(m_pkt);
+					mem->PacketUpdate(m_pkt);
+					return ret;
+				}
+			}
+		}
+
+		// 先写时间不晚于这个视频包的拷贝流数据包
+		int64_t video_ts = m_pkt->dts != AV_NOPTS_VALUE ? m_pkt->dts : m_pkt->pts;
+		m_mux_video_us = av_rescale_q(video_ts, m_codec_ctx->time_base, AVRational{1, AV_TIME_BASE});
+		ret = WriteCopyPackets(false);
+		if (ret < 0)
+		{
+			av_packet_unref(m_pkt);
+			mem->PacketUpdate(m_pkt);
+			return ret;
+		}
+
+		// 设置数据包的流索引和时间基
+		m_pkt->stream_index = m_stream->index;
+		if (!m_pkt->duration)
+			m_pkt->duration = 1;
+		// 其他输出从环里取，时间戳还是编码器时间基
+		if (m_cfg.ring)
+			m_cfg.ring->Push(m_pkt);
+		av_packet_rescale_ts(m_pkt, m_codec_ctx->time_base, m_stream->time_base);
+
+		// 写入数据包到输出文件，前后的文件位置就是这个包在文件里的偏移和大小
+		int64_t pos = m_fmt_ctx->pb ? avio_tell(m_fmt_ctx->pb) : -1;
+		{
+			TRACE_SCOPE("mux_write");
+			ret = av_write_frame(m_fmt_ctx, m_pkt);
+		}
+		if (ret < 0)
+		{
+			MYLOG_ERROR(LOG_MOD_MUX, "Error writing packet to file");
+		}
+		else if (pos >= 0)
+			m_kfi.Packet(m_pkt->pts, m_pkt->dts, pos, avio_tell(m_fmt_ctx->pb) - pos, m_pkt->flags & AV_PKT_FLAG_KEY);
+
+		// 释放数据包
+		av_packet_unref(m_pkt);
+		mem->PacketUpdate(m_pkt);
+	}
+	return ret;
+}
+
+int CEncodeSink::Consume(AVFrame *frame)
+{
+	CMemTrack *mem = CMemTrack::GetInstance();
+
+	// 和上一个编码帧相同的帧不送编码器，帧编号照常增加，输出变成可变帧率
+	bool dropped = false;
+	bool force_key = false;
+	if (m_static && m_static->Enabled())
+	{
+		TRACE_SCOPE("static_detect", m_num_frames);
+		dropped = m_static->Check(frame, force_key);
+	}
+
+	// 记下输入 PTS，提交分段时写入日志
+	if (m_cfg.checkpoint_frames > 0)
+	{
+		m_src_pts.push_back(frame->pts);
+		m_last_src_pts = frame->pts;
+	}
+
+	// 第一帧确定拷贝流的时间偏移，续传时扣掉已提交部分的时长
+	if (m_start_us == AV_NOPTS_VALUE && frame->pts != AV_NOPTS_VALUE && !m_cfg.copy_streams.empty())
+		m_start_us = av_rescale_q(frame->pts, m_cfg.src_time_base, AVRational{1, AV_TIME_BASE}) -
+					 av_rescale_q(m_num_frames, m_codec_ctx->time_base, AVRational{1, AV_TIME_BASE});
+
+	int64_t index = m_num_frames++;
+	if (dropped)
+	{
+		// 保留最后一个丢掉的帧，结束时编码它，静止画面的时长不会丢
+		mem->FrameFree(&m_static_tail);
+		m_static_tail = mem->FrameAlloc(MEM_STAGE_ENCODE);
+		if (m_static_tail && av_frame_ref(m_static_tail, frame) < 0)
+			mem->FrameFree(&m_static_tail);
+		m_static_tail_index = index;
+		return 0;
+	}
+	mem->FrameFree(&m_static_tail);
+
+	return SendFrame(frame, index, force_key);
+}
+
+int CEncodeSink::SendFrame(AVFrame *frame, int64_t index, bool force_key)
+{
+	CMemTrack *mem = CMemTrack::GetInstance();
+	AVFrame *enc_frame = NULL;
+	int ret;
+
+	// 转成编码器需要的帧(上传显存/下载到内存/转换像素格式)
+	{
+		TRACE_SCOPE("encode_prepare", index);
+		ret = m_backend->Prepare(m_codec_ctx, frame, &enc_frame);
+	}
+	if (ret < 0)
+		return ret;
+	if (enc_frame == frame)
+		enc_frame = NULL;
+	else
+		frame = enc_frame;
+
+	// 设置帧的显示时间戳（PTS），以编码器时间基(帧率的倒数)计，写文件前换算到流的时间基
+	frame->pts = index;
+	if (force_key)
+		frame->pict_type = AV_PICTURE_TYPE_I;
+
+	int64_t now_start = GetMonotonicUs();
+	// 发送帧到编码器
+	{
+		TRACE_SCOPE("encode_send", index);
+		ret = avcodec_send_frame(m_codec_ctx, frame);
+	}
+	mem->FrameFree(&enc_frame);
+	if (ret < 0)
+	{
+		MYLOG_ERROR(LOG_MOD_ENCODE, "Error sending frame to encoder");
+		DropCopyPackets();
+		return ret;
+	}
+
+	m_send_us[index] = now_start;
+	m_output_frames++;
+
+	// 接收编码后的数据包
+	ret = ReceivePackets(now_start);
+	if (ret < 0)
+		DropCopyPackets();
+	return ret;
+}
+
+int CEncodeSink::Close()
+{
+	int ret = 0;
+	if (m_codec_ctx && m_header_written)
+	{
+		// 结尾是静止画面时把最后一个丢掉的帧编进去
+		if (m_static_tail)
+		{
+			ret = SendFrame(m_static_tail, m_static_tail_index, false);
+			CMemTrack::GetInstance()->FrameFree(&m_static_tail);
+		}
+		if (m_static && m_static->Dropped() > 0)
+			MYLOG_INFO(LOG_MOD_ENCODE, "static frames dropped %ld of %ld", (long)m_static->Dropped(), (long)m_static->Frames());
+
+		// 12. 刷新编码器（发送空帧以刷新缓冲区）
+		if (ret >= 0)
+			ret = avcodec_send_frame(m_codec_ctx, nullptr);
+		if (ret >= 0)
+			ret = ReceivePackets(-1);
+		if (ret >= 0)
+			ret = WriteCopyPackets(true);
+
+		// 最后一个分段也提交；输入完整读完才把日志标记为完成，否则续传从最后一帧之后接着编。
+		// 编码或写文件出错时不提交，Free 里不写文件尾，这一段下次续传时重写
+		int err = 0;
+		if (m_cfg.checkpoint_frames > 0)
+		{
+			if (ret >= 0)
+				err = CommitSegment(m_num_frames, m_input_complete, true);
+		}
+		else
+			err = CloseOutput();
+		if (ret >= 0)
+			ret = err;
+	}
+
+	Free();
+	return ret;
+}
+
+EncodeStats CEncodeSink::Stats() const
+{
+	EncodeStats st;
+	st.frames = m_num_frames;
+	st.bytes = m_video_bytes;
+	st.latency_us = m_latency_count ? (double)m_latency_sum_us / m_latency_count : 0;
+	st.latency_max_us = m_latency_max_us;
+	return st;
+}
+
+void CEncodeSink::Free()
+{
+	CMemTrack::GetInstance()->FrameFree(&m_static_tail);
+	DropCopyPackets();
+	if (m_cfg.ring)
+		m_cfg.ring->Finish();
+
+	// 14. 释放资源，异常退出时不写文件尾，未提交的分段下次续传时覆盖
+	m_header_written = false;
+	CloseOutput();
+	CMemTrack::GetInstance()->PacketFree(&m_pkt);
+	avcodec_free_context(&m_codec_ctx);
+}
@@ -0,0 +1,105 @@
+#ifndef CENCODESINK_H
+#define CENCODESINK_H
+
+// 编码输出端：用选定的编码后端编码并写入输出文件，输入的音频/字幕流直接拷贝数据包一起写入；
+// 配置了数据包环时同时把所有包写入环，供其他输出(直播 socket、HLS、录制)使用；
+// 每个输出文件旁边写一个关键帧索引(.kfi)
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "cframesink.h"
+#include "cencoderbackend.h"
+#include "cpacketring.h"
+#include "cstaticdetect.h"
+#include "ckeyframeindex.h"
+
+// 编码统计，Close 之后读
+struct EncodeStats
+{
+	int64_t frames;			// 输出的帧数(含静止帧)
+	int64_t bytes;			// 视频数据包的字节数
+	double latency_us;		// 帧送入编码器到取出它的数据包，平均，微秒(快的编码器不到 1 毫秒)
+	int64_t latency_max_us;
+};
+
+class CEncodeSink : public CFrameSink
+{
+public:
+	explicit CEncodeSink(const EncodeConfig &cfg) : m_cfg(cfg) {}
+	~CEncodeSink() override;
+
+	const char *Name() const override { return "encode"; }
+	MemStage Stage() const override { return MEM_STAGE_ENCODE; }
+
+	void Open() override;
+	int Consume(AVFrame *frame) override;
+	int Close() override;
+
+	// 解复用线程调用，拷贝流的数据包排队，在编码线程里和视频交织写入
+	void PushPacket(const AVPacket *pkt);
+
+	EncodeStats Stats() const;
+
+private:
+	int SendFrame(AVFrame *frame, int64_t index, bool force_key);
+	int ReceivePackets(int64_t start_us);
+	void OpenOutput(const std::string &filename);
+	int CloseOutput();
+	// last: 结束时提交最后一段，之后不再打开新的分段
+	int CommitSegment(int64_t next_frame, bool complete, bool last);
+	int WriteCopyPackets(bool flush);
+	void DropCopyPackets();
+	void Free();
+
+	EncodeConfig m_cfg;
+	std::unique_ptr<CEncoderBackend> m_backend;
+	AVCodecContext *m_codec_ctx = nullptr;	// 编码器上下文
+	AVFormatContext *m_fmt_ctx = nullptr;	// 输出文件上下文
+	AVStream *m_stream = nullptr;			// 编码后输出流
+	AVPacket *m_pkt = nullptr;				// 编码后的数据包
+	int64_t m_num_frames = 0;
+	bool m_header_written = false;
+
+	// 断点续传
+	CheckpointState m_ckpt;				// 已提交的状态
+	int64_t m_segment_start = 0;		// 当前分段第一帧的编号
+	std::deque<int64_t> m_src_pts;		// 已送入编码器、还没提交的帧的输入 PTS
+	int64_t m_src_base = 0;				// m_src_pts 第一项对应的帧编号
+	int64_t m_last_src_pts = AV_NOPTS_VALUE;	// 最后一个送入的帧的输入 PTS
+
+	// 流拷贝
+	std::vector<int> m_copy_map;		// 输入流序号 -> 输出流序号，-1 不拷贝
+	std::vector<AVStream *> m_copy_src;	// 输入流序号 -> 输入流
+	std::vector<int> m_ring_map;		// 输入流序号 -> 环里的流序号
+	std::deque<AVPacket *> m_copy_pkts;
+	std::mutex m_copy_mutex;
+	bool m_copy_closed = false;
+	int64_t m_start_us = AV_NOPTS_VALUE;	// 输出时间 0 对应的输入时间
+	int64_t m_mux_video_us = AV_NOPTS_VALUE;	// 已写出的最后一个视频包的时间，拷贝流按它交织
+
+	CKeyframeIndexWriter m_kfi;			// 当前输出文件的关键帧索引
+
+	// 编码延迟和码率
+	std::map<int64_t, int64_t> m_send_us;	// 帧编号 -> 送入编码器的时间(单调时钟)
+	int64_t m_video_bytes = 0;
+	int64_t m_latency_sum_us = 0;
+	int64_t m_latency_count = 0;
+	int64_t m_latency_max_us = 0;
+
+	// 静止帧检测
+	std::unique_ptr<CStaticDetector> m_static;
+	AVFrame *m_static_tail = nullptr;	// 最后一个丢掉的帧
+	int64_t m_static_tail_index = 0;
+};
+
+#endif // CENCODESINK_H
@@ -0,0 +1,386 @@
+#include "cframecache.h"
+#include "cspdlog.h"
+
+extern "C"
+{
+#include <libavutil/imgutils.h>
+}
+
+#include <lz4.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdexcept>
+
+std::string FrameCacheDir(const char *cache_root, const char *source)
+{
+	struct stat st;
+	char real[PATH_MAX];
+	if (stat(source, &st) != 0 || !realpath(source, real))
+		return std::string();
+
+	// FNV-1a(路径 + 大小 + 修改时间)
+	uint64_t h = 1469598103934665603ULL;
+	auto mix = [&h](const void *data, size_t len) {
+		const uint8_t *p = (const uint8_t *)data;
+		for (size_t i = 0; i < len; i++)
+		{
+			h ^= p[i];
+			h *= 1099511628211ULL;
+		}
+	};
+	int64_t size = st.st_size;
+	int64_t mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+	mix(real, strlen(real));
+	mix(&size, sizeof(size));
+	mix(&mtime_ns, sizeof(mtime_ns));
+
+	char key[17];
+	snprintf(key, sizeof(key), "%016llx", (unsigned long long)h);
+	return std::string(cache_root) + "/" + key;
+}
+
+static std::string SegmentPath(const std::string &dir, uint32_t index)
+{
+	char name[32];
+	snprintf(name, sizeof(name), "/seg_%05u.lz4", index);
+	return dir + name;
+}
+
+//****************************************** */
+
+CFrameCacheSink::~CFrameCacheSink()
+{
+	if (m_segment)
+		fclose(m_segment);
+}
+
+void CFrameCacheSink::Open()
+{
+	mkdir(m_dir.substr(0, m_dir.rfind('/')).c_str(), 0755);
+
+	m_tmp_dir = m_dir + ".tmp";
+	// 上次中断留下的临时目录直接覆盖
+	if (mkdir(m_tmp_dir.c_str(), 0755) != 0 && errno != EEXIST)
+	{
+		throw std::runtime_error("Could not create frame cache directory " + m_tmp_dir);
+	}
+
+	memset(&m_header, 0, sizeof(m_header));
+	memcpy(m_header.magic, FRAME_CACHE_MAGIC, sizeof(m_header.magic));
+	m_header.version = FRAME_CACHE_VERSION;
+	m_header.format = AV_PIX_FMT_NONE;
+	snprintf(m_header.source, sizeof(m_header.source), "%s", m_source.c_str());
+
+	if (OpenSegment() < 0)
+	{
+		throw std::runtime_error("Could not create frame cache segment in " + m_tmp_dir);
+	}
+}
+
+int CFrameCacheSink::OpenSegment()
+{
+	if (m_segment)
+	{
+		if (fclose(m_segment) != 0)
+			return AVERROR(EIO);
+		m_segment_index++;
+	}
+	m_segment = fopen(SegmentPath(m_tmp_dir, m_segment_index).c_str(), "wb");
+	m_segment_offset = 0;
+	return m_segment ? 0 : AVERROR(errno);
+}
+
+int CFrameCacheSink::Consume(AVFrame *frame)
+{
+	CMemTrack *mem = CMemTrack::GetInstance();
+	int ret = 0;
+
+	// 缓存只是优化，写失败后不再缓存，编码照常进行
+	if (m_failed)
+		return 0;
+
+	AVFrame *sw_frame = DownloadFrame(frame, MEM_STAGE_CACHE, ret);
+	if (!sw_frame)
+		goto failed;
+
+	if (m_header.format == AV_PIX_FMT_NONE)
+	{
+		m_header.width = sw_frame->width;
+		m_header.height = sw_frame->height;
+		m_header.format = sw_frame->format;
+	}
+	else if (m_header.width != sw_frame->width || m_header.height != sw_frame->height || m_header.format != sw_frame->format)
+	{
+		MYLOG_ERROR(LOG_MOD_CACHE, "frame format changed mid-stream, cache disabled");
+		ret = AVERROR(EINVAL);
+		goto failed;
+	}
+
+	{
+		// 各平面紧密排列后整帧压缩
+		int raw_size = av_image_get_buffer_size((AVPixelFormat)sw_frame->format, sw_frame->width, sw_frame->height, 1);
+		m_raw.resize(raw_size);
+		ret = av_image_copy_to_buffer(m_raw.data(), raw_size, (const uint8_t *const *)sw_frame->data, (const int *)sw_frame->linesize,
+									  (AVPixelFormat)sw_frame->format, sw_frame->width, sw_frame->height, 1);
+		if (ret < 0)
+			goto failed;
+
+		m_compressed.resize(LZ4_compressBound(raw_size));
+		int csize = LZ4_compress_default((const char *)m_raw.data(), m_compressed.data(), raw_size, (int)m_compressed.size());
+		if (csize <= 0)
+		{
+			ret = AVERROR_EXTERNAL;
+			goto failed;
+		}
+
+		if (m_segment_offset > 0 && (int64_t)(m_segment_offset + csize) > m_segment_bytes && (ret = OpenSegment()) < 0)
+			goto failed;
+		if (fwrite(m_compressed.data(), 1, csize, m_segment) != (size_t)csize)
+		{
+			ret = AVERROR(EIO);
+			goto failed;
+		}
+
+		FrameCacheEntry entry;
+		entry.segment = m_segment_index;
+		entry.flags = 0;
+		entry.offset = m_segment_offset;
+		entry.compressed_size = csize;
+		entry.raw_size = raw_size;
+		entry.pts = frame->pts;
+		m_entries.push_back(entry);
+		m_segment_offset += csize;
+		m_output_frames++;
+		ret = 0;
+	}
+
+failed:
+	mem->FrameFree(&sw_frame);
+	if (ret < 0)
+	{
+		MYLOG_WARN(LOG_MOD_CACHE, "Failed to write frame cache: %d, cache disabled for this run", ret);
+		m_failed = true;
+		if (m_segment)
+			fclose(m_segment);
+		m_segment = nullptr;
+		RemoveTmp();
+		std::vector<FrameCacheEntry>().swap(m_entries);
+	}
+	return 0;
+}
+
+// 没发布的缓存删掉，下次运行重新生成
+void CFrameCacheSink::RemoveTmp()
+{
+	for (uint32_t i = 0; i <= m_segment_index; i++)
+		unlink(SegmentPath(m_tmp_dir, i).c_str());
+	unlink((m_tmp_dir + "/index.bin").c_str());
+	rmdir(m_tmp_dir.c_str());
+}
+
+int CFrameCacheSink::Close()
+{
+	if (!m_segment)
+		return 0;
+	int ret = fclose(m_segment) == 0 ? 0 : AVERROR(EIO);
+	m_segment = nullptr;
+	// 读输入出错、被 --frames 截断或者其他输出端出错时缓存缺帧，不发布
+	if (ret < 0 || m_failed || m_entries.empty() || !m_input_complete)
+	{
+		if (!m_input_complete)
+			MYLOG_WARN(LOG_MOD_CACHE, "input did not end cleanly, frame cache %s not published", m_dir);
+		RemoveTmp();
+		return ret;
+	}
+
+	m_header.segments = m_segment_index + 1;
+	m_header.frames = m_entries.size();
+
+	// 索引最后写，改名后缓存才可用
+	std::string index_path = m_tmp_dir + "/index.bin";
+	FILE *f = fopen(index_path.c_str(), "wb");
+	if (!f)
+	{
+		ret = AVERROR(errno);
+		RemoveTmp();
+		return ret;
+	}
+	bool ok = fwrite(&m_header, sizeof(m_header), 1, f) == 1 &&
+			  fwrite(m_entries.data(), sizeof(FrameCacheEntry), m_entries.size(), f) == m_entries.size();
+	if (fclose(f) != 0 || !ok)
+	{
+		RemoveTmp();
+		return AVERROR(EIO);
+	}
+
+	if (rename(m_tmp_dir.c_str(), m_dir.c_str()) != 0)
+	{
+		ret = AVERROR(errno);
+		MYLOG_ERROR(LOG_MOD_CACHE, "Could not publish frame cache %s", m_dir);
+		RemoveTmp();
+		return ret;
+	}
+
+	uint64_t total = 0;
+	for (auto &e : m_entries)
+		total += e.compressed_size;
+	MYLOG_INFO(LOG_MOD_CACHE, "frame cache %s: %lu frames, %u segments, %lu bytes (%.1f%% of raw)",
+			   m_dir, (unsigned long)m_entries.size(), m_header.segments, (unsigned long)total,
+			   100.0 * total / ((double)m_entries.size() * m_entries[0].raw_size));
+	return 0;
+}
+
+//****************************************** */
+
+CFrameCacheReader::~CFrameCacheReader()
+{
+	Close();
+}
+
+static const uint8_t *MapFile(const std::string &path, size_t &size)
+{
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return nullptr;
+
+	struct stat st;
+	void *p = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && st.st_size > 0)
+	{
+		size = st.st_size;
+		p = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	}
+	close(fd);
+	if (p == MAP_FAILED)
+		return nullptr;
+	madvise(p, size, MADV_SEQUENTIAL);
+	return (const uint8_t *)p;
+}
+
+bool CFrameCacheReader::Open(const std::string &dir)
+{
+	Close();
+	m_dir = dir;
+
+	m_index_map = MapFile(dir + "/index.bin", m_index_size);
+	if (!m_index_map)
+		return false;
+
+	if (m_index_size < sizeof(FrameCacheHeader))
+		goto invalid;
+	memcpy(&m_header, m_index_map, sizeof(m_header));
+	if (memcmp(m_header.magic, FRAME_CACHE_MAGIC, sizeof(m_header.magic)) != 0 || m_header.version != FRAME_CACHE_VERSION ||
+		m_index_size != sizeof(FrameCacheHeader) + m_header.frames * sizeof(FrameCacheEntry))
+		goto invalid;
+
+	m_entries = (const FrameCacheEntry *)(m_index_map + sizeof(FrameCacheHeader));
+	m_segments.assign(m_header.segments, Segment{ nullptr, 0 });
+	m_next = 0;
+
+	MYLOG_INFO(LOG_MOD_CACHE, "using frame cache %s: %lu frames %dx%d", dir, (unsigned long)m_header.frames,
+			   m_header.width, m_header.height);
+	return true;
+
+invalid:
+	MYLOG_WARN(LOG_MOD_CACHE, "ignoring invalid frame cache %s", dir);
+	Close();
+	return false;
+}
+
+void CFrameCacheReader::Close()
+{
+	for (auto &seg : m_segments)
+	{
+		if (seg.data)
+			munmap((void *)seg.data, seg.size);
+	}
+	m_segments.clear();
+	if (m_index_map)
+		munmap((void *)m_index_map, m_index_size);
+	m_index_map = nullptr;
+	m_entries = nullptr;
+	av_buffer_pool_uninit(&m_pool);
+	m_pool_size = 0;
+}
+
+bool CFrameCacheReader::MapSegment(uint32_t index)
+{
+	Segment &seg = m_segments[index];
+	if (seg.data)
+		return true;
+
+	// 顺序读，前一个分段用完就释放
+	if (index > 0 && m_segments[index - 1].data)
+	{
+		munmap((void *)m_segments[index - 1].data, m_segments[index - 1].size);
+		m_segments[index - 1].data = nullptr;
+	}
+	seg.data = MapFile(SegmentPath(m_dir, index), seg.size);
+	return seg.data != nullptr;
+}
+
+void CFrameCacheReader::Seek(int64_t pts)
+{
+	// 缓存里每帧都是完整的解码帧，不需要找关键帧
+	m_next = 0;
+	while (m_next < m_header.frames && m_entries[m_next].pts < pts)
+		m_next++;
+}
+
+int CFrameCacheReader::Read(AVFrame *frame)
+{
+	if (m_next >= m_header.frames)
+		return AVERROR_EOF;
+
+	const FrameCacheEntry &e = m_entries[m_next];
+	if (e.segment >= m_segments.size() || !MapSegment(e.segment) ||
+		e.offset + e.compressed_size > m_segments[e.segment].size)
+	{
+		MYLOG_ERROR(LOG_MOD_CACHE, "frame cache %s is corrupt at frame %lu", m_dir, (unsigned long)m_next);
+		return AVERROR_INVALIDDATA;
+	}
+
+	if (!m_pool || m_pool_size < (int)e.raw_size)
+	{
+		av_buffer_pool_uninit(&m_pool);
+		m_pool = av_buffer_pool_init(e.raw_size, av_buffer_alloc);
+		m_pool_size = e.raw_size;
+		if (!m_pool)
+			return AVERROR(ENOMEM);
+	}
+
+	// 解压到池里的缓冲区，帧直接引用，不再拷贝
+	AVBufferRef *buf = av_buffer_pool_get(m_pool);
+	if (!buf)
+		return AVERROR(ENOMEM);
+	int n = LZ4_decompress_safe((const char *)m_segments[e.segment].data + e.offset, (char *)buf->data,
+								e.compressed_size, buf->size);
+	if (n != (int)e.raw_size)
+	{
+		av_buffer_unref(&buf);
+		MYLOG_ERROR(LOG_MOD_CACHE, "frame cache %s: bad frame %lu", m_dir, (unsigned long)m_next);
+		return AVERROR_INVALIDDATA;
+	}
+
+	frame->format = m_header.format;
+	frame->width = m_header.width;
+	frame->height = m_header.height;
+	frame->pts = e.pts;
+	frame->buf[0] = buf;
+	int ret = av_image_fill_arrays(frame->data, frame->linesize, buf->data, (AVPixelFormat)m_header.format,
+								   m_header.width, m_header.height, 1);
+	if (ret < 0)
+	{
+		av_frame_unref(frame);
+		return ret;
+	}
+
+	m_next++;
+	return 0;
+}
@@ -0,0 +1,127 @@
+#ifndef CFRAMECACHE_H
+#define CFRAMECACHE_H
+
+// 解码帧缓存
+// 同一个片源反复调参编码时，第一次把解码后的帧按 LZ4 压缩写入分段文件并建立索引，
+// 之后直接 mmap 分段文件解压出帧送给编码器，不再解封装和解码。
+//
+// 目录结构：<cache dir>/<key>/index.bin, seg_00000.lz4, seg_00001.lz4 ...
+// key 由源文件路径、大小、修改时间计算；写入时先写 <key>.tmp，完成后改名。
+
+extern "C"
+{
+#include <libavutil/frame.h>
+#include <libavutil/buffer.h>
+}
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include "cframesink.h"
+
+#define FRAME_CACHE_MAGIC   "FFCACHE1"
+#define FRAME_CACHE_VERSION 1
+
+#pragma pack(push, 1)
+struct FrameCacheHeader
+{
+	char magic[8];
+	uint32_t version;
+	int32_t width;
+	int32_t height;
+	int32_t format;			// AVPixelFormat
+	uint32_t segments;
+	uint64_t frames;
+	char source[256];
+};
+
+struct FrameCacheEntry
+{
+	uint32_t segment;
+	uint32_t flags;
+	uint64_t offset;
+	uint32_t compressed_size;
+	uint32_t raw_size;
+	int64_t pts;
+};
+#pragma pack(pop)
+
+// 源文件对应的缓存目录，源文件不存在返回空串
+std::string FrameCacheDir(const char *cache_root, const char *source);
+
+// 写缓存的输出端
+class CFrameCacheSink : public CFrameSink
+{
+public:
+	CFrameCacheSink(const std::string &dir, const char *source, int64_t segment_bytes)
+		: m_dir(dir), m_source(source), m_segment_bytes(segment_bytes) {}
+	~CFrameCacheSink() override;
+
+	const char *Name() const override { return "cache"; }
+	MemStage Stage() const override { return MEM_STAGE_CACHE; }
+
+	void Open() override;
+	int Consume(AVFrame *frame) override;
+	int Close() override;
+
+private:
+	int OpenSegment();
+	void RemoveTmp();
+
+	std::string m_dir;
+	std::string m_tmp_dir;
+	std::string m_source;
+	int64_t m_segment_bytes;
+
+	FILE *m_segment = nullptr;
+	uint32_t m_segment_index = 0;
+	uint64_t m_segment_offset = 0;
+
+	std::vector<uint8_t> m_raw;
+	std::vector<char> m_compressed;
+	std::vector<FrameCacheEntry> m_entries;
+	FrameCacheHeader m_header;
+	bool m_failed = false;		// 写失败后放弃缓存，Consume 不再返回错误，不中断编码
+};
+
+// 读缓存，分段文件 mmap 后按索引解压
+class CFrameCacheReader
+{
+public:
+	~CFrameCacheReader();
+
+	bool Open(const std::string &dir);
+	void Close();
+
+	int Width() const { return m_header.width; }
+	int Height() const { return m_header.height; }
+	int Format() const { return m_header.format; }
+	uint64_t Frames() const { return m_header.frames; }
+
+	// 读下一帧，结束返回 AVERROR_EOF
+	int Read(AVFrame *frame);
+	// 跳到第一帧 pts >= 给定值的位置，断点续传用
+	void Seek(int64_t pts);
+
+private:
+	struct Segment
+	{
+		const uint8_t *data;
+		size_t size;
+	};
+
+	bool MapSegment(uint32_t index);
+
+	std::string m_dir;
+	FrameCacheHeader m_header;
+	const uint8_t *m_index_map = nullptr;
+	size_t m_index_size = 0;
+	const FrameCacheEntry *m_entries = nullptr;
+	std::vector<Segment> m_segments;
+	AVBufferPool *m_pool = nullptr;
+	int m_pool_size = 0;
+	uint64_t m_next = 0;
+};
+
+#endif // CFRAMECACHE_H
@@ -0,0 +1,241 @@
+#include "cframesink.h"
+#include "cspdlog.h"
+#include "pixfmttraits.h"
+#include "cjobstats.h"
+
+extern "C"
+{
+#include <libavutil/hwcontext.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+}
+
+#include <stdexcept>
+
+AVFrame *DownloadFrame(AVFrame *frame, MemStage stage, int &ret)
+{
+	CMemTrack *mem = CMemTrack::GetInstance();
+	AVFrame *sw_frame = mem->FrameAlloc(stage);
+	if (!sw_frame)
+	{
+		ret = AVERROR(ENOMEM);
+		return nullptr;
+	}
+
+	if (frame->hw_frames_ctx)
+	{
+		/* 将解码后的数据从GPU内存存格式转为CPU内存格式，并完成GPU到CPU内存的拷贝*/
+		ret = HwTransfer(sw_frame, frame);
+		if (ret >= 0)
+			ret = av_frame_copy_props(sw_frame, frame);
+	}
+	else
+		ret = av_frame_ref(sw_frame, frame);
+
+	if (ret < 0)
+	{
+		MYLOG_ERROR(LOG_MOD_HW, "Error transferring the data to system memory");
+		mem->FrameFree(&sw_frame);
+		return nullptr;
+	}
+	mem->FrameUpdate(sw_frame);
+	return sw_frame;
+}
+
+//****************************************** */
+
+int CNullSink::Consume(AVFrame *frame)
+{
+	m_frames++;
+	return 0;
+}
+
+int CNullSink::Close()
+{
+	MYLOG_INFO(LOG_MOD_SINK, "null: %ld frames discarded", (long)m_frames);
+	return 0;
+}
+
+//****************************************** */
+
+CRawDumpSink::~CRawDumpSink()
+{
+	Close();
+}
+
+void CRawDumpSink::Open()
+{
+	/* open the file to dump raw data */
+	m_file = fopen(m_path.c_str(), "w+b");
+	if (!m_file)
+	{
+		throw std::runtime_error("Could not open raw dump file " + m_path);
+	}
+}
+
+struct PackOp
+{
+	template <typename T>
+	static int Run(const AVFrame *frame, uint8_t *dst)
+	{
+		PackFrame<T>(frame, dst);
+		return 0;
+	}
+};
+
+int CRawDumpSink::Consume(AVFrame *frame)
+{
+	CMemTrack *mem = CMemTrack::GetInstance();
+	int ret = 0;
+
+	AVFrame *tmp_frame = DownloadFrame(frame, MEM_STAGE_DUMP, ret);
+	if (!tmp_frame)
+		return ret;
+
+	// 计算一张YUV图需要的内存 大小，缓冲区复用
+	int size = av_image_get_buffer_size((AVPixelFormat)tmp_frame->format, tmp_frame->width, tmp_frame->height, 1);
+	if (size > m_buffer_size)
+	{
+		mem->RawFree(m_buffer);
+		m_buffer = (uint8_t *)mem->RawAlloc(MEM_STAGE_DUMP, size);
+		m_buffer_size = m_buffer ? size : 0;
+	}
+	if (!m_buffer)
+	{
+		MYLOG_ERROR(LOG_MOD_SINK, "Can not alloc buffer");
+		mem->FrameFree(&tmp_frame);
+		return AVERROR(ENOMEM);
+	}
+
+	// 将图片数据拷贝的buffer中(按行拷贝)，NV12/P010 用特化的拷贝，其他格式交给 FFmpeg
+	ret = DispatchPixFmt<PackOp>(tmp_frame->format, tmp_frame, m_buffer);
+	if (ret == AVERROR(ENOSYS))
+		ret = av_image_copy_to_buffer(m_buffer, size, (const uint8_t *const *)tmp_frame->data, (const int *)tmp_frame->linesize,
+									  (AVPixelFormat)tmp_frame->format, tmp_frame->width, tmp_frame->height, 1);
+	mem->FrameFree(&tmp_frame);
+	if (ret < 0)
+	{
+		MYLOG_ERROR(LOG_MOD_SINK, "Can not copy image to buffer");
+		return ret;
+	}
+
+	// buffer数据dump到文件
+	if (fwrite(m_buffer, 1, size, m_file) != (size_t)size)
+	{
+		MYLOG_ERROR(LOG_MOD_SINK, "Failed to dump raw data.");
+		return AVERROR(EIO);
+	}
+	m_output_frames++;
+	return 0;
+}
+
+int CRawDumpSink::Close()
+{
+	int ret = 0;
+	if (m_file && fclose(m_file) != 0)
+		ret = AVERROR(EIO);
+	m_file = nullptr;
+	CMemTrack::GetInstance()->RawFree(m_buffer);
+	m_buffer = nullptr;
+	m_buffer_size = 0;
+	return ret;
+}
+
+//****************************************** */
+
+CHashSink::~CHashSink()
+{
+	Close();
+}
+
+void CHashSink::Open()
+{
+	m_frame_md5 = av_md5_alloc();
+	m_total_md5 = av_md5_alloc();
+	if (!m_frame_md5 || !m_total_md5)
+	{
+		throw std::runtime_error("Could not allocate md5 context");
+	}
+	av_md5_init(m_total_md5);
+
+	if (!m_path.empty())
+	{
+		m_file = fopen(m_path.c_str(), "w");
+		if (!m_file)
+		{
+			throw std::runtime_error("Could not open hash file " + m_path);
+		}
+	}
+}
+
+static void md5_to_hex(const uint8_t md5[16], char hex[33])
+{
+	for (int i = 0; i < 16; i++)
+		snprintf(hex + i * 2, 3, "%02x", md5[i]);
+}
+
+int CHashSink::Consume(AVFrame *frame)
+{
+	CMemTrack *mem = CMemTrack::GetInstance();
+	int ret = 0;
+
+	AVFrame *tmp_frame = DownloadFrame(frame, MEM_STAGE_DUMP, ret);
+	if (!tmp_frame)
+		return ret;
+
+	// 只对有效像素计算，不含每行的对齐填充
+	AVPixelFormat fmt = (AVPixelFormat)tmp_frame->format;
+	const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(fmt);
+	int rows[4];
+	av_image_fill_linesizes(rows, fmt, tmp_frame->width);
+
+	av_md5_init(m_frame_md5);
+	for (int p = 0; p < av_pix_fmt_count_planes(fmt); p++)
+	{
+		int h = tmp_frame->height;
+		if (p == 1 || p == 2)
+			h = -((-h) >> desc->log2_chroma_h);
+
+		const uint8_t *src = tmp_frame->data[p];
+		for (int y = 0; y < h; y++, src += tmp_frame->linesize[p])
+		{
+			av_md5_update(m_frame_md5, src, rows[p]);
+			av_md5_update(m_total_md5, src, rows[p]);
+		}
+	}
+	mem->FrameFree(&tmp_frame);
+
+	uint8_t md5[16];
+	char hex[33];
+	av_md5_final(m_frame_md5, md5);
+	md5_to_hex(md5, hex);
+	if (m_file)
+		fprintf(m_file, "%ld %s\n", (long)m_frames, hex);
+	else
+		MYLOG_DEBUG(LOG_MOD_SINK, "hash: frame %ld %s", (long)m_frames, hex);
+	m_frames++;
+	m_output_frames++;
+	return 0;
+}
+
+int CHashSink::Close()
+{
+	if (m_total_md5)
+	{
+		uint8_t md5[16];
+		char hex[33];
+		av_md5_final(m_total_md5, md5);
+		md5_to_hex(md5, hex);
+		MYLOG_INFO(LOG_MOD_SINK, "hash: %ld frames, md5 %s", (long)m_frames, hex);
+		if (m_file)
+			fprintf(m_file, "total %s\n", hex);
+	}
+
+	int ret = 0;
+	if (m_file && fclose(m_file) != 0)
+		ret = AVERROR(EIO);
+	m_file = nullptr;
+	av_freep(&m_frame_md5);
+	av_freep(&m_total_md5);
+	return ret;
+}
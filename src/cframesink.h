@@ -0,0 +1,98 @@
+#ifndef CFRAMESINK_H
+#define CFRAMESINK_H
+
+// 解码帧的输出端
+// 每个输出端在 CFrameTee 的独立线程里运行，收到的是解码帧的一个引用，不需要释放。
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavutil/frame.h>
+#include <libavutil/md5.h>
+}
+
+#include <stdio.h>
+#include <string>
+#include "cmemtrack.h"
+
+class CFrameSink
+{
+public:
+	virtual ~CFrameSink() {}
+
+	virtual const char *Name() const = 0;
+	virtual MemStage Stage() const { return MEM_STAGE_DUMP; }
+
+	// 在主线程调用，失败抛 std::runtime_error
+	virtual void Open() {}
+	// 以下在输出线程调用，返回 <0 表示失败
+	virtual int Consume(AVFrame *frame) = 0;
+	virtual int Close() { return 0; }
+
+	// 结束前由 CFrameTee 设置：输入完整读完(文件尾、解码器已刷新、其他输出端没有出错)，
+	// 只有这时才能发布缓存、把断点日志标记为完成
+	virtual void SetInputComplete(bool complete) { m_input_complete = complete; }
+
+	// 实际输出(送进编码器或写出)的帧数，静止帧跳过的不算；CFrameTee 结束时汇总给作业统计
+	virtual int64_t OutputFrames() const { return m_output_frames; }
+
+protected:
+	bool m_input_complete = false;
+	int64_t m_output_frames = 0;
+};
+
+// 丢弃，用于纯解码吞吐测试
+class CNullSink : public CFrameSink
+{
+public:
+	const char *Name() const override { return "null"; }
+	int Consume(AVFrame *frame) override;
+	int Close() override;
+
+private:
+	int64_t m_frames = 0;
+};
+
+// 原始 YUV 写文件，硬件帧先拷回内存
+class CRawDumpSink : public CFrameSink
+{
+public:
+	explicit CRawDumpSink(const char *path) : m_path(path) {}
+	~CRawDumpSink() override;
+
+	const char *Name() const override { return "raw"; }
+	void Open() override;
+	int Consume(AVFrame *frame) override;
+	int Close() override;
+
+private:
+	std::string m_path;
+	FILE *m_file = nullptr;
+	uint8_t *m_buffer = nullptr;
+	int m_buffer_size = 0;
+};
+
+// 逐帧 MD5，用于确定性检查；每帧一行写入文件，结束时输出总的 MD5
+class CHashSink : public CFrameSink
+{
+public:
+	explicit CHashSink(const char *path) : m_path(path ? path : "") {}
+	~CHashSink() override;
+
+	const char *Name() const override { return "hash"; }
+	void Open() override;
+	int Consume(AVFrame *frame) override;
+	int Close() override;
+
+private:
+	std::string m_path;
+	FILE *m_file = nullptr;
+	struct AVMD5 *m_frame_md5 = nullptr;
+	struct AVMD5 *m_total_md5 = nullptr;
+	int64_t m_frames = 0;
+};
+
+// 硬件帧拷回内存，普通帧直接引用；返回的帧需用 CMemTrack::FrameFree 释放
+AVFrame *DownloadFrame(AVFrame *frame, MemStage stage, int &ret);
+
+#endif // CFRAMESINK_H
@@ -0,0 +1,219 @@
+#include "cframetee.h"
+#include "cspdlog.h"
+#include "caffinity.h"
+#include "ctrace.h"
+#include "cjobstats.h"
+
+#include <string.h>
+#include <algorithm>
+#include <exception>
+
+void CFrameQueue::Push(AVFrame *frame)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	// 结束标记不受队列长度限制
+	while (frame && m_frames.size() >= m_depth)
+		m_not_full.wait(lock);
+	m_frames.push_back(frame);
+	m_not_empty.notify_one();
+}
+
+AVFrame *CFrameQueue::Pop()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (m_frames.empty())
+		m_not_empty.wait(lock);
+	AVFrame *frame = m_frames.front();
+	m_frames.pop_front();
+	m_not_full.notify_one();
+	return frame;
+}
+
+size_t CFrameQueue::Size()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_frames.size();
+}
+
+//****************************************** */
+
+CFrameTee::~CFrameTee()
+{
+	if (m_started)
+		Finish(false);
+	for (Worker *w : m_workers)
+	{
+		delete w->sink;
+		delete w->queue;
+		delete w;
+	}
+}
+
+void CFrameTee::AddSink(CFrameSink *sink)
+{
+	Worker *w = new Worker;
+	w->sink = sink;
+	w->queue = nullptr;
+	w->status = 0;
+	w->frames = 0;
+	m_workers.push_back(w);
+}
+
+void CFrameTee::Open()
+{
+	for (Worker *w : m_workers)
+	{
+		w->sink->Open();
+		MYLOG_INFO(LOG_MOD_SINK, "sink %s opened", w->sink->Name());
+	}
+}
+
+void CFrameTee::Start(size_t queue_depth)
+{
+	for (Worker *w : m_workers)
+	{
+		w->queue = new CFrameQueue(queue_depth);
+		w->thread = std::thread(&CFrameTee::Run, this, w);
+	}
+	m_started = true;
+}
+
+int CFrameTee::Push(AVFrame *frame)
+{
+	CMemTrack *mem = CMemTrack::GetInstance();
+
+	for (Worker *w : m_workers)
+	{
+		int status = w->status.load();
+		if (status < 0)
+			return status;
+
+		AVFrame *ref = mem->FrameAlloc(w->sink->Stage());
+		if (!ref)
+			return AVERROR(ENOMEM);
+		int ret = av_frame_ref(ref, frame);
+		if (ret < 0)
+		{
+			mem->FrameFree(&ref);
+			return ret;
+		}
+		mem->FrameUpdate(ref);
+		w->queue->Push(ref);
+	}
+	CJobStats::GetInstance()->InputFrame();
+	return 0;
+}
+
+int CFrameTee::Finish(bool complete)
+{
+	if (!m_started)
+		return 0;
+	m_started = false;
+
+	// 已经有输出端出错时，其他输出端的结果也不完整
+	for (Worker *w : m_workers)
+	{
+		if (w->status < 0)
+			complete = false;
+	}
+	// 在结束标记之前设置，输出线程取到结束标记时一定能看到(队列锁保证)
+	for (Worker *w : m_workers)
+	{
+		w->sink->SetInputComplete(complete);
+		w->queue->Push(nullptr);
+	}
+
+	int ret = 0;
+	int64_t output_frames = 0;
+	for (Worker *w : m_workers)
+	{
+		if (w->thread.joinable())
+			w->thread.join();
+		MYLOG_INFO(LOG_MOD_SINK, "sink %s: %ld frames, status %d", w->sink->Name(), (long)w->frames, w->status.load());
+		if (w->status < 0 && ret == 0)
+			ret = w->status;
+		// 各块、各输出端输出的是同一批帧，取最多的那个，不累加
+		output_frames = std::max(output_frames, w->sink->OutputFrames());
+	}
+	CJobStats::GetInstance()->SetOutputFrames(output_frames);
+	return ret;
+}
+
+void CFrameTee::Run(Worker *w)
+{
+	CMemTrack *mem = CMemTrack::GetInstance();
+	CAffinity *affinity = CAffinity::GetInstance();
+	affinity->BindThread(w->sink->Name());
+	CTrace::GetInstance()->SetThreadName(w->sink->Name());
+
+	for (;;)
+	{
+		AVFrame *frame = w->queue->Pop();
+		if (!frame)
+			break;
+
+		// 出错后继续取帧丢弃，避免阻塞解码线程
+		if (w->status >= 0)
+		{
+			int ret;
+			try
+			{
+				TRACE_SCOPE(w->sink->Name(), w->frames);
+				ret = w->sink->Consume(frame);
+			}
+			catch (const std::exception &e)
+			{
+				MYLOG_ERROR(LOG_MOD_SINK, "sink %s: %s", w->sink->Name(), e.what());
+				ret = AVERROR_EXTERNAL;
+			}
+			if (ret < 0)
+			{
+				MYLOG_ERROR(LOG_MOD_SINK, "sink %s failed: %d", w->sink->Name(), ret);
+				w->status = ret;
+			}
+			else
+				w->frames++;
+		}
+		mem->FrameFree(&frame);
+	}
+
+	try
+	{
+		int ret = w->sink->Close();
+		if (ret < 0 && w->status >= 0)
+			w->status = ret;
+	}
+	catch (const std::exception &e)
+	{
+		MYLOG_ERROR(LOG_MOD_SINK, "sink %s: %s", w->sink->Name(), e.what());
+		if (w->status >= 0)
+			w->status = AVERROR_EXTERNAL;
+	}
+	affinity->ThreadDone();
+}
+
+bool ParseSinkSpec(const char *spec, std::vector<std::pair<std::string, std::string> > &sinks)
+{
+	const char *p = spec;
+	while (*p)
+	{
+		const char *end = strchr(p, ',');
+		if (!end)
+			end = p + strlen(p);
+
+		std::string item(p, end - p);
+		std::string arg;
+		size_t colon = item.find(':');
+		if (colon != std::string::npos)
+		{
+			arg = item.substr(colon + 1);
+			item.resize(colon);
+		}
+		if (item != "encode" && item != "raw" && item != "null" && item != "hash" && item != "tiles")
+			return false;
+		sinks.push_back(std::make_pair(item, arg));
+
+		p = *end ? end + 1 : end;
+	}
+	return !sinks.empty();
+}
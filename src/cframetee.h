@@ -0,0 +1,69 @@
+#ifndef CFRAMETEE_H
+#define CFRAMETEE_H
+
+// 把同一个解码帧的引用分发给多个输出端，每个输出端一个线程和一个有界队列
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "cframesink.h"
+
+// 有界帧队列，满了阻塞生产者；nullptr 表示结束
+class CFrameQueue
+{
+public:
+	explicit CFrameQueue(size_t depth) : m_depth(depth ? depth : 1) {}
+
+	void Push(AVFrame *frame);
+	AVFrame *Pop();
+	size_t Size();
+
+private:
+	size_t m_depth;
+	std::deque<AVFrame *> m_frames;
+	std::mutex m_mutex;
+	std::condition_variable m_not_empty;
+	std::condition_variable m_not_full;
+};
+
+class CFrameTee
+{
+public:
+	~CFrameTee();
+
+	// 接管 sink
+	void AddSink(CFrameSink *sink);
+	size_t SinkCount() const { return m_workers.size(); }
+
+	// 依次打开所有输出端，失败抛 std::runtime_error
+	void Open();
+	void Start(size_t queue_depth);
+	// 给每个输出端送一个引用，帧本身仍归调用者；任一输出端出错返回 <0
+	int Push(AVFrame *frame);
+	// 发送结束标记，等待所有输出端处理完并关闭；complete 为输入是否完整结束
+	int Finish(bool complete);
+
+private:
+	struct Worker
+	{
+		CFrameSink *sink;
+		CFrameQueue *queue;
+		std::thread thread;
+		std::atomic<int> status;
+		int64_t frames;
+	};
+
+	void Run(Worker *w);
+
+	std::vector<Worker *> m_workers;
+	bool m_started = false;
+};
+
+// 按 "encode,raw:testout.nv12,null,hash:out.md5,tiles:2x2" 创建输出端；encode/tiles 由调用者提供
+bool ParseSinkSpec(const char *spec, std::vector<std::pair<std::string, std::string> > &sinks);
+
+#endif // CFRAMETEE_H
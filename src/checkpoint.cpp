@@ -0,0 +1,99 @@
+#include "checkpoint.h"
+#include "cspdlog.h"
+
+extern "C"
+{
+#include <libavutil/avutil.h>
+}
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+void CheckpointReset(CheckpointState &st)
+{
+	st.segments = 0;
+	st.frames = 0;
+	st.input_pts = AV_NOPTS_VALUE;
+	st.output_bytes = 0;
+	st.complete = false;
+}
+
+std::string CheckpointSegmentPath(const std::string &output, int index)
+{
+	// name.mp4 -> name.00003.mp4
+	size_t dot = output.rfind('.');
+	size_t slash = output.rfind('/');
+	if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+		dot = output.size();
+
+	char num[16];
+	snprintf(num, sizeof(num), ".%05d", index);
+	return output.substr(0, dot) + num + output.substr(dot);
+}
+
+bool CheckpointLoad(const std::string &output, CheckpointState &st)
+{
+	CheckpointReset(st);
+
+	FILE *f = fopen((output + ".journal").c_str(), "r");
+	if (!f)
+		return false;
+
+	char line[256];
+	int fields = 0;
+	while (fgets(line, sizeof(line), f))
+	{
+		long long v;
+		if (sscanf(line, "segments=%lld", &v) == 1)
+			st.segments = (int)v, fields++;
+		else if (sscanf(line, "frames=%lld", &v) == 1)
+			st.frames = v, fields++;
+		else if (sscanf(line, "input_pts=%lld", &v) == 1)
+			st.input_pts = v, fields++;
+		else if (sscanf(line, "output_bytes=%lld", &v) == 1)
+			st.output_bytes = v, fields++;
+		else if (sscanf(line, "complete=%lld", &v) == 1)
+			st.complete = v != 0, fields++;
+	}
+	fclose(f);
+
+	if (fields != 5)
+	{
+		MYLOG_WARN(LOG_MOD_MUX, "ignoring incomplete journal for %s", output);
+		CheckpointReset(st);
+		return false;
+	}
+	return true;
+}
+
+bool CheckpointSave(const std::string &output, const CheckpointState &st)
+{
+	std::string path = output + ".journal";
+	std::string tmp = path + ".tmp";
+
+	FILE *f = fopen(tmp.c_str(), "w");
+	if (!f)
+		return false;
+	fprintf(f, "segments=%d\nframes=%lld\ninput_pts=%lld\noutput_bytes=%lld\ncomplete=%d\n",
+			st.segments, (long long)st.frames, (long long)st.input_pts, (long long)st.output_bytes, st.complete ? 1 : 0);
+	bool ok = fflush(f) == 0 && fsync(fileno(f)) == 0;
+	ok = fclose(f) == 0 && ok;
+	if (!ok || rename(tmp.c_str(), path.c_str()) != 0)
+		return false;
+
+	// 分段列表，concat 解复用器格式
+	std::string list = output + ".ffconcat";
+	f = fopen((list + ".tmp").c_str(), "w");
+	if (!f)
+		return false;
+	fprintf(f, "ffconcat version 1.0\n");
+	for (int i = 0; i < st.segments; i++)
+	{
+		std::string seg = CheckpointSegmentPath(output, i);
+		size_t slash = seg.rfind('/');
+		fprintf(f, "file '%s'\n", slash == std::string::npos ? seg.c_str() : seg.c_str() + slash + 1);
+	}
+	ok = fclose(f) == 0;
+	return ok && rename((list + ".tmp").c_str(), list.c_str()) == 0;
+}
@@ -0,0 +1,28 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+// 断点续传
+// 开启后编码输出按关键帧切成闭合 GOP 的分段文件 <name>.00000.<ext> ...，每提交一个分段
+// 就原子地重写日志文件 <output>.journal，记录已提交的分段数、帧数、下一段第一帧的输入 PTS
+// 和已写入字节数；重新运行时输入跳到该 PTS 之前的关键帧继续编码，追加后面的分段。
+// <output>.ffconcat 列出已提交的分段，可以直接用 concat 解复用器读取。
+
+#include <stdint.h>
+#include <string>
+
+struct CheckpointState
+{
+	int segments;			// 已提交的分段数
+	int64_t frames;			// 已提交的编码帧数
+	int64_t input_pts;		// 下一段第一帧的输入 PTS(输入流时间基)
+	int64_t output_bytes;	// 已提交分段的总字节数
+	bool complete;			// 整个文件已完成
+};
+
+void CheckpointReset(CheckpointState &st);
+std::string CheckpointSegmentPath(const std::string &output, int index);
+bool CheckpointLoad(const std::string &output, CheckpointState &st);
+// 写临时文件后改名，中途被杀也不会留下半个日志
+bool CheckpointSave(const std::string &output, const CheckpointState &st);
+
+#endif // CHECKPOINT_H
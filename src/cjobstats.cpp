@@ -0,0 +1,190 @@
+#include "cjobstats.h"
+#include "caffinity.h"
+#include "cspdlog.h"
+
+extern "C"
+{
+#include <libavutil/hwcontext.h>
+#include <libavutil/imgutils.h>
+}
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+
+CJobStats *CJobStats::GetInstance()
+{
+	static CJobStats instance;
+	return &instance;
+}
+
+static int64_t NowUs()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+void CJobStats::Start()
+{
+	m_start_us = NowUs();
+}
+
+static int64_t FrameBytes(const AVFrame *frame)
+{
+	int size = av_image_get_buffer_size((AVPixelFormat)frame->format, frame->width, frame->height, 1);
+	return size > 0 ? size : 0;
+}
+
+int HwTransfer(AVFrame *dst, const AVFrame *src)
+{
+	int ret = av_hwframe_transfer_data(dst, src, 0);
+	if (ret < 0)
+		return ret;
+
+	CJobStats *stats = CJobStats::GetInstance();
+	if (src->hw_frames_ctx)
+	{
+		stats->m_download_bytes += FrameBytes(dst);
+		stats->m_downloads++;
+	}
+	else
+	{
+		stats->m_upload_bytes += FrameBytes(src);
+		stats->m_uploads++;
+	}
+	return ret;
+}
+
+int HwMap(AVFrame *dst, const AVFrame *src, int flags)
+{
+	int ret = av_hwframe_map(dst, src, flags);
+	if (ret < 0)
+		return ret;
+
+	CJobStats *stats = CJobStats::GetInstance();
+	stats->m_mapped_bytes += FrameBytes(src->hw_frames_ctx ? dst : src);
+	stats->m_maps++;
+	return ret;
+}
+
+//****************************************** */
+
+struct IoCounters
+{
+	int64_t rchar;			// read 系列调用读的字节，包括网络和页缓存
+	int64_t wchar;
+	int64_t read_bytes;		// 实际从存储设备读的字节
+	int64_t write_bytes;
+};
+
+static void ReadIo(IoCounters &io)
+{
+	memset(&io, 0, sizeof(io));
+	FILE *f = fopen("/proc/self/io", "r");
+	if (!f)
+		return;
+	char line[128];
+	while (fgets(line, sizeof(line), f))
+	{
+		long long v;
+		if (sscanf(line, "rchar: %lld", &v) == 1)
+			io.rchar = v;
+		else if (sscanf(line, "wchar: %lld", &v) == 1)
+			io.wchar = v;
+		else if (sscanf(line, "read_bytes: %lld", &v) == 1)
+			io.read_bytes = v;
+		else if (sscanf(line, "write_bytes: %lld", &v) == 1)
+			io.write_bytes = v;
+	}
+	fclose(f);
+}
+
+std::string JsonEscape(const std::string &s)
+{
+	std::string out;
+	for (unsigned char c : s)
+	{
+		if (c == '"' || c == '\\')
+		{
+			out += '\\';
+			out += c;
+		}
+		else if (c < 0x20)
+		{
+			char hex[8];
+			snprintf(hex, sizeof(hex), "\\u%04x", c);
+			out += hex;
+		}
+		else
+			out += c;
+	}
+	return out;
+}
+
+void CJobStats::Report(const char *json_path)
+{
+	struct rusage ru;
+	memset(&ru, 0, sizeof(ru));
+	getrusage(RUSAGE_SELF, &ru);
+	double user_sec = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6;
+	double sys_sec = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+	double wall_sec = m_start_us ? (NowUs() - m_start_us) / 1e6 : 0;
+
+	IoCounters io;
+	ReadIo(io);
+
+	int64_t input_frames = m_input_frames.load();
+	int64_t frames = m_output_frames.load();
+	if (frames <= 0)
+		frames = input_frames;
+	// 没有帧时按 1 帧算，避免除零
+	double n = frames > 0 ? (double)frames : 1;
+
+	MYLOG_INFO(LOG_MOD_MAIN, "job report for session '%s': %ld output frames (%ld decoded) in %.3f s",
+			   m_session, (long)frames, (long)input_frames, wall_sec);
+	MYLOG_INFO(LOG_MOD_MAIN, "  cpu %.3f ms/frame (user %.3f s, sys %.3f s), ctx switches %.2f voluntary, %.2f involuntary per frame",
+			   (user_sec + sys_sec) * 1000 / n, user_sec, sys_sec, ru.ru_nvcsw / n, ru.ru_nivcsw / n);
+	MYLOG_INFO(LOG_MOD_MAIN, "  io %.0f bytes read, %.0f bytes written per frame",
+			   io.rchar / n, io.wchar / n);
+	MYLOG_INFO(LOG_MOD_HW, "  hw %.0f bytes downloaded, %.0f uploaded, %.0f mapped per frame",
+			   m_download_bytes.load() / n, m_upload_bytes.load() / n, m_mapped_bytes.load() / n);
+
+	if (!json_path)
+		return;
+
+	FILE *f = fopen(json_path, "w");
+	if (!f)
+	{
+		MYLOG_ERROR(LOG_MOD_MAIN, "Cannot open job report file '%s'", json_path);
+		return;
+	}
+	fprintf(f, "{\n  \"session\": \"%s\",\n  \"frames\": %lld,\n  \"input_frames\": %lld,\n  \"wall_sec\": %.6f,\n",
+			JsonEscape(m_session).c_str(), (long long)frames, (long long)input_frames, wall_sec);
+	fprintf(f, "  \"cpu\": { \"user_sec\": %.6f, \"sys_sec\": %.6f, \"voluntary_ctxsw\": %ld, \"involuntary_ctxsw\": %ld },\n",
+			user_sec, sys_sec, ru.ru_nvcsw, ru.ru_nivcsw);
+	fprintf(f, "  \"io\": { \"read_bytes\": %lld, \"written_bytes\": %lld, \"storage_read_bytes\": %lld, \"storage_written_bytes\": %lld },\n",
+			(long long)io.rchar, (long long)io.wchar, (long long)io.read_bytes, (long long)io.write_bytes);
+	fprintf(f, "  \"hw\": { \"download_bytes\": %lld, \"upload_bytes\": %lld, \"mapped_bytes\": %lld, \"downloads\": %lld, \"uploads\": %lld, \"maps\": %lld },\n",
+			(long long)m_download_bytes.load(), (long long)m_upload_bytes.load(), (long long)m_mapped_bytes.load(),
+			(long long)m_downloads.load(), (long long)m_uploads.load(), (long long)m_maps.load());
+	fprintf(f, "  \"per_frame\": { \"cpu_ms\": %.6f, \"voluntary_ctxsw\": %.6f, \"involuntary_ctxsw\": %.6f, \"read_bytes\": %.1f, \"written_bytes\": %.1f, "
+			"\"storage_read_bytes\": %.1f, \"storage_written_bytes\": %.1f, \"download_bytes\": %.1f, \"upload_bytes\": %.1f, \"mapped_bytes\": %.1f },\n",
+			(user_sec + sys_sec) * 1000 / n, ru.ru_nvcsw / n, ru.ru_nivcsw / n, io.rchar / n, io.wchar / n,
+			io.read_bytes / n, io.write_bytes / n, m_download_bytes.load() / n, m_upload_bytes.load() / n, m_mapped_bytes.load() / n);
+
+	// 每个阶段线程的开销，看瓶颈在哪
+	fprintf(f, "  \"threads\": [");
+	bool first = true;
+	for (auto &st : CAffinity::GetInstance()->Threads())
+	{
+		fprintf(f, "%s\n    { \"name\": \"%s\", \"user_sec\": %.6f, \"sys_sec\": %.6f, \"voluntary_ctxsw\": %ld, \"involuntary_ctxsw\": %ld, "
+				"\"cpu_ms_per_frame\": %.6f }",
+				first ? "" : ",", JsonEscape(st.name).c_str(), st.user_sec, st.sys_sec, st.nvcsw, st.nivcsw,
+				(st.user_sec + st.sys_sec) * 1000 / n);
+		first = false;
+	}
+	fprintf(f, "\n  ]\n}\n");
+	fclose(f);
+}
@@ -0,0 +1,60 @@
+#ifndef CJOBSTATS_H
+#define CJOBSTATS_H
+
+// 作业资源统计：一个节点上装多少路转码要靠每路的实际开销来算，
+// 退出时汇总整个会话的 CPU 时间、上下文切换、读写字节数和显存<->内存传输字节数，
+// 都按输出帧数归一化，写一条 JSON 给准入控制用。
+
+extern "C"
+{
+#include <libavutil/frame.h>
+}
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+
+class CJobStats
+{
+public:
+	static CJobStats *GetInstance();
+
+	void SetSession(const char *name) { m_session = name; }
+	// 开始计时，进程开始时调用
+	void Start();
+
+	// 送给输出端的解码帧数
+	void InputFrame() { m_input_frames++; }
+	// 实际输出的帧数，归一化的分母；没有输出帧时(只有 null 输出端)按解码帧数算
+	void SetOutputFrames(int64_t frames) { m_output_frames = frames; }
+
+	// 输出到日志；json_path 非空时另外写一份 JSON
+	// 线程统计取自 CAffinity，需在各线程 ThreadDone 之后调用
+	void Report(const char *json_path = nullptr);
+
+private:
+	friend int HwTransfer(AVFrame *dst, const AVFrame *src);
+	friend int HwMap(AVFrame *dst, const AVFrame *src, int flags);
+
+	CJobStats() {}
+
+	std::string m_session;
+	int64_t m_start_us = 0;
+	std::atomic<int64_t> m_input_frames{ 0 };
+	std::atomic<int64_t> m_output_frames{ 0 };
+	std::atomic<int64_t> m_download_bytes{ 0 };	// 显存 -> 内存
+	std::atomic<int64_t> m_upload_bytes{ 0 };	// 内存 -> 显存
+	std::atomic<int64_t> m_mapped_bytes{ 0 };	// 映射读的帧大小，实际读多少取决于使用者
+	std::atomic<int64_t> m_downloads{ 0 };
+	std::atomic<int64_t> m_uploads{ 0 };
+	std::atomic<int64_t> m_maps{ 0 };
+};
+
+// av_hwframe_transfer_data / av_hwframe_map 加上字节统计，成功时按内存一侧的帧大小计
+int HwTransfer(AVFrame *dst, const AVFrame *src);
+int HwMap(AVFrame *dst, const AVFrame *src, int flags);
+
+// JSON 字符串里的引号、反斜杠和控制字符要转义，各个报告共用
+std::string JsonEscape(const std::string &s);
+
+#endif // CJOBSTATS_H
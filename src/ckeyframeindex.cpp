@@ -0,0 +1,196 @@
+#include "ckeyframeindex.h"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static_assert(sizeof(KeyframeIndexHeader) == 32, "keyframe index header layout");
+static_assert(sizeof(KeyframeEntry) == 32, "keyframe index entry layout");
+
+#define KFI_MAGIC "KFI2"
+#define KFI_WALK 8	// 估算位置附近最多走这么多步，再不行二分
+
+std::string KeyframeIndexPath(const std::string &output)
+{
+	return output + ".kfi";
+}
+
+bool KeyframeIndexSupported(const char *format)
+{
+	// mp4/mov 只在不带 movflags(faststart、分片)时是直写的，CEncodeSink 不设 movflags
+	static const char *s_formats[] = { "mp4", "mov", "mpegts" };
+	for (const char *name : s_formats)
+	{
+		if (strcmp(format, name) == 0)
+			return true;
+	}
+	return false;
+}
+
+//****************************************** */
+
+bool CKeyframeIndexWriter::Open(const std::string &path, AVRational time_base, const char *format)
+{
+	Close();
+	m_fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (m_fd < 0)
+		return false;
+
+	KeyframeIndexHeader hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, KFI_MAGIC, 4);
+	snprintf(hdr.format, sizeof(hdr.format), "%s", format);
+	hdr.entry_size = sizeof(KeyframeEntry);
+	hdr.tb_num = time_base.num;
+	hdr.tb_den = time_base.den;
+	if (pwrite(m_fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr))
+	{
+		close(m_fd);
+		m_fd = -1;
+		return false;
+	}
+	m_count = 0;
+	m_gop_frames = 0;
+	return true;
+}
+
+// 上一个关键帧那一项的 gop_frames
+void CKeyframeIndexWriter::PatchGop()
+{
+	if (m_count == 0)
+		return;
+	off_t pos = sizeof(KeyframeIndexHeader) + (m_count - 1) * sizeof(KeyframeEntry) + offsetof(KeyframeEntry, gop_frames);
+	if (pwrite(m_fd, &m_gop_frames, sizeof(m_gop_frames), pos) != (ssize_t)sizeof(m_gop_frames))
+	{
+		close(m_fd);
+		m_fd = -1;
+	}
+}
+
+void CKeyframeIndexWriter::Packet(int64_t pts, int64_t dts, int64_t offset, int64_t size, bool key)
+{
+	if (m_fd < 0)
+		return;
+	if (!key)
+	{
+		m_gop_frames++;
+		return;
+	}
+
+	PatchGop();
+	if (m_fd < 0)
+		return;
+
+	KeyframeEntry e;
+	e.pts = pts;
+	e.dts = dts;
+	e.offset = offset;
+	e.size = (uint32_t)size;
+	e.gop_frames = 0;
+	off_t pos = sizeof(KeyframeIndexHeader) + m_count * sizeof(KeyframeEntry);
+	if (pwrite(m_fd, &e, sizeof(e), pos) != (ssize_t)sizeof(e))
+	{
+		// 写失败不影响编码，索引停在这里
+		close(m_fd);
+		m_fd = -1;
+		return;
+	}
+	m_count++;
+	m_gop_frames = 1;
+}
+
+void CKeyframeIndexWriter::Close()
+{
+	if (m_fd < 0)
+		return;
+	PatchGop();
+	if (m_fd >= 0)
+		close(m_fd);
+	m_fd = -1;
+}
+
+//****************************************** */
+
+bool CKeyframeIndex::Open(const std::string &path, const char *format)
+{
+	Close();
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(KeyframeIndexHeader))
+	{
+		close(fd);
+		return false;
+	}
+	m_size = st.st_size;
+	m_map = mmap(NULL, m_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (m_map == MAP_FAILED)
+	{
+		m_map = nullptr;
+		return false;
+	}
+
+	const KeyframeIndexHeader *hdr = (const KeyframeIndexHeader *)m_map;
+	m_format.assign(hdr->format, strnlen(hdr->format, sizeof(hdr->format)));
+	if (memcmp(hdr->magic, KFI_MAGIC, 4) != 0 || hdr->entry_size != sizeof(KeyframeEntry) || hdr->tb_den <= 0 ||
+		(format && m_format != format))
+	{
+		Close();
+		return false;
+	}
+	m_time_base = AVRational{ hdr->tb_num, hdr->tb_den };
+	m_entries = (const KeyframeEntry *)((const uint8_t *)m_map + sizeof(KeyframeIndexHeader));
+	// 还在写的文件最后可能有半项，不算
+	m_count = (m_size - sizeof(KeyframeIndexHeader)) / sizeof(KeyframeEntry);
+	return true;
+}
+
+void CKeyframeIndex::Close()
+{
+	if (m_map)
+		munmap(m_map, m_size);
+	m_map = nullptr;
+	m_size = 0;
+	m_entries = nullptr;
+	m_count = 0;
+	m_format.clear();
+}
+
+long CKeyframeIndex::Find(int64_t pts) const
+{
+	if (m_count == 0 || pts < m_entries[0].pts)
+		return -1;
+	size_t last = m_count - 1;
+	if (pts >= m_entries[last].pts)
+		return (long)last;
+
+	// 1. 按平均 GOP 时长估算
+	int64_t span = m_entries[last].pts - m_entries[0].pts;
+	size_t i = span > 0 ? (size_t)((double)(pts - m_entries[0].pts) * last / span) : 0;
+	if (i > last)
+		i = last;
+
+	// 2. 就近修正：找 entries[i].pts <= pts < entries[i + 1].pts
+	for (int step = 0; step < KFI_WALK; step++)
+	{
+		if (m_entries[i].pts > pts)
+			i--;
+		else if (m_entries[i + 1].pts <= pts)
+			i++;
+		else
+			return (long)i;
+	}
+
+	// 3. GOP 很不均匀时二分
+	const KeyframeEntry *end = m_entries + m_count;
+	const KeyframeEntry *it = std::upper_bound(m_entries, end, pts,
+		[](int64_t v, const KeyframeEntry &e) { return v < e.pts; });
+	return (long)(it - m_entries) - 1;
+}
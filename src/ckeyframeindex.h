@@ -0,0 +1,95 @@
+#ifndef CKEYFRAMEINDEX_H
+#define CKEYFRAMEINDEX_H
+
+// 关键帧索引：复用时给每个输出文件写一个 <输出文件>.kfi，每个视频关键帧一项，
+// 预览播放器、片段提取、分块重编码直接 mmap 查找，不用再扫描整个容器。
+//
+// 文件格式(小端)：32 字节头 + 每项 32 字节
+//   头  magic "KFI2" | entry_size u32 | time_base num i32 | den i32 | 容器名 char[16](复用器名，如 mp4)
+//   项  pts i64 | dts i64 | offset i64 | size u32 | gop_frames u32
+// 时间戳是输出文件里视频流的时间基；offset/size 是复用器为这个包写入文件的位置和字节数，
+// 只有每个包直接写进文件的复用器才对(见 KeyframeIndexSupported)；
+// gop_frames 是到下一个关键帧之前的帧数，最后一个 GOP 写完前为 0。
+// 项在关键帧写入时就追加，边写边读的消费者能看到最新的关键帧。
+
+extern "C"
+{
+#include <libavutil/rational.h>
+}
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+struct KeyframeIndexHeader
+{
+	char magic[4];
+	uint32_t entry_size;
+	int32_t tb_num;
+	int32_t tb_den;
+	char format[16];
+};
+
+struct KeyframeEntry
+{
+	int64_t pts;
+	int64_t dts;
+	int64_t offset;
+	uint32_t size;
+	uint32_t gop_frames;
+};
+
+// 复用时写索引，每个视频包调用一次 Packet
+class CKeyframeIndexWriter
+{
+public:
+	~CKeyframeIndexWriter() { Close(); }
+
+	bool Open(const std::string &path, AVRational time_base, const char *format);
+	void Packet(int64_t pts, int64_t dts, int64_t offset, int64_t size, bool key);
+	// 补上最后一个 GOP 的长度
+	void Close();
+
+private:
+	void PatchGop();
+
+	int m_fd = -1;
+	int64_t m_count = 0;		// 已写的项数
+	uint32_t m_gop_frames = 0;	// 当前 GOP 已写的帧数
+};
+
+// 只读 mmap 打开索引，按时间查找关键帧
+class CKeyframeIndex
+{
+public:
+	~CKeyframeIndex() { Close(); }
+
+	// format 非空时要求索引是这种容器写的，不是时打开失败
+	bool Open(const std::string &path, const char *format = nullptr);
+	void Close();
+
+	size_t Count() const { return m_count; }
+	AVRational TimeBase() const { return m_time_base; }
+	const std::string &Format() const { return m_format; }
+	const KeyframeEntry &At(size_t i) const { return m_entries[i]; }
+
+	// pts 之前(含)最后一个关键帧的序号，pts 早于第一个关键帧返回 -1
+	// 按平均 GOP 时长算出位置再就近修正，GOP 固定时是常数时间
+	long Find(int64_t pts) const;
+
+private:
+	void *m_map = nullptr;
+	size_t m_size = 0;
+	const KeyframeEntry *m_entries = nullptr;
+	size_t m_count = 0;
+	AVRational m_time_base = { 0, 1 };
+	std::string m_format;
+};
+
+// 输出文件对应的索引文件名
+std::string KeyframeIndexPath(const std::string &output);
+// 复用器是否把每个包直接写进文件，写之前后的文件位置就是包的偏移和大小；
+// matroska 按簇缓存、faststart/分片 mp4 事后移动数据，都不行
+bool KeyframeIndexSupported(const char *format);
+
+#endif // CKEYFRAMEINDEX_H
@@ -0,0 +1,295 @@
+#include "cmemtrack.h"
+#include "cspdlog.h"
+#include "cjobstats.h"
+
+#include <stdio.h>
+#include <string.h>
+
+static const char *s_stage_names[] = { "demux", "decode", "encode", "mux", "dump", "cache" };
+static const char *s_kind_names[] = { "frame", "packet", "buffer", "raw" };
+
+CMemTrack *CMemTrack::GetInstance()
+{
+	static CMemTrack instance;
+	return &instance;
+}
+
+CMemTrack::CMemTrack()
+{
+	memset(m_counters, 0, sizeof(m_counters));
+	memset(&m_total, 0, sizeof(m_total));
+}
+
+const char *CMemTrack::StageName(MemStage stage)
+{
+	return (stage >= 0 && stage < MEM_STAGE_COUNT) ? s_stage_names[stage] : "?";
+}
+
+const char *CMemTrack::KindName(MemKind kind)
+{
+	return (kind >= 0 && kind < MEM_KIND_COUNT) ? s_kind_names[kind] : "?";
+}
+
+void CMemTrack::Inc(MemCounter &c, int64_t count, int64_t bytes)
+{
+	c.live += count;
+	c.live_bytes += bytes;
+	if (count > 0)
+		c.total += count;
+	if (c.live > c.peak)
+		c.peak = c.live;
+	if (c.live_bytes > c.peak_bytes)
+		c.peak_bytes = c.live_bytes;
+}
+
+void CMemTrack::Add(const void *ptr, MemStage stage, MemKind kind, int64_t bytes)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	Entry &e = m_live[ptr];
+	e.stage = stage;
+	e.kind = kind;
+	e.bytes = bytes;
+	e.bufs = 0;
+	e.buf_bytes = 0;
+	e.hw_pool = nullptr;
+	Inc(m_counters[stage][kind], 1, bytes);
+	Inc(m_total, 0, bytes);
+}
+
+void CMemTrack::Remove(const void *ptr)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto it = m_live.find(ptr);
+	if (it == m_live.end())
+		return;
+
+	Entry &e = it->second;
+	SetBuffers(e, 0, 0, nullptr);
+	Inc(m_counters[e.stage][e.kind], -1, -e.bytes);
+	Inc(m_total, 0, -e.bytes);
+	m_live.erase(it);
+}
+
+// 调用者持有 m_mutex
+void CMemTrack::SetBuffers(Entry &e, int64_t bufs, int64_t buf_bytes, const void *hw_pool)
+{
+	Inc(m_counters[e.stage][MEM_KIND_BUFFER], bufs - e.bufs, buf_bytes - e.buf_bytes);
+	// 总量也算上帧/包引用的数据；Remove 里清零缓冲区时相应减掉
+	Inc(m_total, 0, buf_bytes - e.buf_bytes);
+	e.bufs = bufs;
+	e.buf_bytes = buf_bytes;
+
+	if (e.hw_pool != hw_pool)
+	{
+		auto it = m_pools.find(e.hw_pool);
+		if (it != m_pools.end())
+			it->second.live--;
+
+		if (hw_pool)
+		{
+			HwPool &pool = m_pools[hw_pool];
+			if (pool.name.empty())
+			{
+				pool.name = "hw";
+				pool.size = 0;
+			}
+			if (++pool.live > pool.peak)
+				pool.peak = pool.live;
+		}
+		e.hw_pool = hw_pool;
+	}
+}
+
+AVFrame *CMemTrack::FrameAlloc(MemStage stage)
+{
+	AVFrame *frame = av_frame_alloc();
+	if (frame)
+		Add(frame, stage, MEM_KIND_FRAME, sizeof(AVFrame));
+	return frame;
+}
+
+void CMemTrack::FrameFree(AVFrame **frame)
+{
+	if (!*frame)
+		return;
+	Remove(*frame);
+	av_frame_free(frame);
+}
+
+void CMemTrack::FrameUpdate(AVFrame *frame)
+{
+	int64_t bufs = 0, bytes = 0;
+	for (int i = 0; i < AV_NUM_DATA_POINTERS; i++)
+	{
+		if (frame->buf[i])
+		{
+			bufs++;
+			bytes += frame->buf[i]->size;
+		}
+	}
+	for (int i = 0; i < frame->nb_extended_buf; i++)
+	{
+		bufs++;
+		bytes += frame->extended_buf[i]->size;
+	}
+	const void *hw_pool = frame->hw_frames_ctx ? (const void *)frame->hw_frames_ctx->data : nullptr;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto it = m_live.find(frame);
+	if (it != m_live.end())
+		SetBuffers(it->second, bufs, bytes, hw_pool);
+}
+
+AVPacket *CMemTrack::PacketAlloc(MemStage stage)
+{
+	AVPacket *pkt = av_packet_alloc();
+	if (pkt)
+		Add(pkt, stage, MEM_KIND_PACKET, sizeof(AVPacket));
+	return pkt;
+}
+
+void CMemTrack::PacketFree(AVPacket **pkt)
+{
+	if (!*pkt)
+		return;
+	Remove(*pkt);
+	av_packet_free(pkt);
+}
+
+void CMemTrack::PacketUpdate(AVPacket *pkt)
+{
+	int64_t bufs = pkt->buf ? 1 : 0;
+	int64_t bytes = pkt->buf ? pkt->buf->size : 0;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto it = m_live.find(pkt);
+	if (it != m_live.end())
+		SetBuffers(it->second, bufs, bytes, nullptr);
+}
+
+void *CMemTrack::RawAlloc(MemStage stage, size_t size)
+{
+	void *ptr = av_malloc(size);
+	if (ptr)
+		Add(ptr, stage, MEM_KIND_RAW, (int64_t)size);
+	return ptr;
+}
+
+void CMemTrack::RawFree(void *ptr)
+{
+	if (!ptr)
+		return;
+	Remove(ptr);
+	av_free(ptr);
+}
+
+void CMemTrack::SetHwPool(const AVBufferRef *hw_frames_ref, const char *name, int size)
+{
+	if (!hw_frames_ref)
+		return;
+	std::lock_guard<std::mutex> lock(m_mutex);
+	HwPool &pool = m_pools[hw_frames_ref->data];
+	pool.name = name;
+	pool.size = size;
+}
+
+bool CMemTrack::HasLeaks() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	for (int s = 0; s < MEM_STAGE_COUNT; s++)
+	{
+		for (int k = 0; k < MEM_KIND_COUNT; k++)
+		{
+			if (m_counters[s][k].live > 0)
+				return true;
+		}
+	}
+	return false;
+}
+
+void CMemTrack::ReadRss(int64_t &rss_kb, int64_t &peak_kb)
+{
+	rss_kb = peak_kb = 0;
+	FILE *f = fopen("/proc/self/status", "r");
+	if (!f)
+		return;
+	char line[256];
+	while (fgets(line, sizeof(line), f))
+	{
+		long long v;
+		if (sscanf(line, "VmRSS: %lld kB", &v) == 1)
+			rss_kb = v;
+		else if (sscanf(line, "VmHWM: %lld kB", &v) == 1)
+			peak_kb = v;
+	}
+	fclose(f);
+}
+
+void CMemTrack::Report(const char *json_path)
+{
+	int64_t rss_kb, peak_kb;
+	ReadRss(rss_kb, peak_kb);
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	MYLOG_INFO(LOG_MOD_MAIN, "memory report for session '%s': rss %ld kB, peak rss %ld kB, peak tracked %ld bytes",
+			   m_session, (long)rss_kb, (long)peak_kb, (long)m_total.peak_bytes);
+	for (int s = 0; s < MEM_STAGE_COUNT; s++)
+	{
+		for (int k = 0; k < MEM_KIND_COUNT; k++)
+		{
+			const MemCounter &c = m_counters[s][k];
+			if (!c.total)
+				continue;
+			if (c.live > 0)
+				MYLOG_ERROR(LOG_MOD_MAIN, "  LEAK %s/%s: %ld live (%ld bytes), peak %ld (%ld bytes), %ld allocated",
+							s_stage_names[s], s_kind_names[k], (long)c.live, (long)c.live_bytes,
+							(long)c.peak, (long)c.peak_bytes, (long)c.total);
+			else
+				MYLOG_INFO(LOG_MOD_MAIN, "  %s/%s: peak %ld (%ld bytes), %ld allocated",
+						   s_stage_names[s], s_kind_names[k], (long)c.peak, (long)c.peak_bytes, (long)c.total);
+		}
+	}
+	for (auto &it : m_pools)
+	{
+		const HwPool &p = it.second;
+		MYLOG_INFO(LOG_MOD_HW, "  hw pool %s: %ld surfaces in use, peak %ld of %d", p.name, (long)p.live, (long)p.peak, p.size);
+	}
+
+	if (!json_path)
+		return;
+
+	FILE *f = fopen(json_path, "w");
+	if (!f)
+	{
+		MYLOG_ERROR(LOG_MOD_MAIN, "Cannot open memory report file '%s'", json_path);
+		return;
+	}
+	fprintf(f, "{\n  \"session\": \"%s\",\n  \"rss_kb\": %lld,\n  \"peak_rss_kb\": %lld,\n  \"peak_tracked_bytes\": %lld,\n  \"stages\": [",
+			JsonEscape(m_session).c_str(), (long long)rss_kb, (long long)peak_kb, (long long)m_total.peak_bytes);
+	bool first = true;
+	for (int s = 0; s < MEM_STAGE_COUNT; s++)
+	{
+		for (int k = 0; k < MEM_KIND_COUNT; k++)
+		{
+			const MemCounter &c = m_counters[s][k];
+			if (!c.total)
+				continue;
+			fprintf(f, "%s\n    { \"stage\": \"%s\", \"kind\": \"%s\", \"live\": %lld, \"live_bytes\": %lld, \"peak\": %lld, \"peak_bytes\": %lld, \"allocated\": %lld }",
+					first ? "" : ",", s_stage_names[s], s_kind_names[k], (long long)c.live, (long long)c.live_bytes,
+					(long long)c.peak, (long long)c.peak_bytes, (long long)c.total);
+			first = false;
+		}
+	}
+	fprintf(f, "\n  ],\n  \"hw_pools\": [");
+	first = true;
+	for (auto &it : m_pools)
+	{
+		const HwPool &p = it.second;
+		fprintf(f, "%s\n    { \"name\": \"%s\", \"size\": %d, \"live\": %lld, \"peak\": %lld }",
+				first ? "" : ",", p.name.c_str(), p.size, (long long)p.live, (long long)p.peak);
+		first = false;
+	}
+	fprintf(f, "\n  ]\n}\n");
+	fclose(f);
+}
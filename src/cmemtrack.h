@@ -0,0 +1,112 @@
+#ifndef CMEMTRACK_H
+#define CMEMTRACK_H
+
+// 内存统计
+// 按会话、按阶段统计 AVFrame/AVPacket/AVBufferRef 的当前数量、峰值和字节数，
+// 硬件帧池占用，以及进程 RSS/峰值 RSS，退出时输出报告并检查泄漏。
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavutil/frame.h>
+}
+
+#include <stdint.h>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+enum MemStage
+{
+	MEM_STAGE_DEMUX = 0,
+	MEM_STAGE_DECODE,
+	MEM_STAGE_ENCODE,
+	MEM_STAGE_MUX,
+	MEM_STAGE_DUMP,
+	MEM_STAGE_CACHE,
+	MEM_STAGE_COUNT,
+};
+
+enum MemKind
+{
+	MEM_KIND_FRAME = 0,
+	MEM_KIND_PACKET,
+	MEM_KIND_BUFFER,	// 帧/包引用的 AVBufferRef
+	MEM_KIND_RAW,		// av_malloc 的裸内存
+	MEM_KIND_COUNT,
+};
+
+struct MemCounter
+{
+	int64_t live;
+	int64_t peak;
+	int64_t live_bytes;
+	int64_t peak_bytes;
+	int64_t total;		// 累计分配次数
+};
+
+class CMemTrack
+{
+public:
+	static CMemTrack *GetInstance();
+
+	void SetSession(const char *name) { m_session = name; }
+
+	AVFrame *FrameAlloc(MemStage stage);
+	void FrameFree(AVFrame **frame);
+	// 帧填充数据后调用，重新计算引用的缓冲区大小，识别硬件帧
+	void FrameUpdate(AVFrame *frame);
+
+	AVPacket *PacketAlloc(MemStage stage);
+	void PacketFree(AVPacket **pkt);
+	void PacketUpdate(AVPacket *pkt);
+
+	void *RawAlloc(MemStage stage, size_t size);
+	void RawFree(void *ptr);
+
+	// 登记硬件帧池容量(initial_pool_size，0 表示不限)
+	void SetHwPool(const AVBufferRef *hw_frames_ref, const char *name, int size);
+
+	bool HasLeaks() const;
+	// 输出到日志；json_path 非空时另外写一份 JSON
+	void Report(const char *json_path = nullptr);
+
+	static void ReadRss(int64_t &rss_kb, int64_t &peak_kb);
+	static const char *StageName(MemStage stage);
+	static const char *KindName(MemKind kind);
+
+private:
+	struct Entry
+	{
+		MemStage stage;
+		MemKind kind;
+		int64_t bytes;
+		int64_t bufs;
+		int64_t buf_bytes;
+		const void *hw_pool;
+	};
+
+	struct HwPool
+	{
+		std::string name;
+		int size;
+		int64_t live;
+		int64_t peak;
+	};
+
+	CMemTrack();
+
+	void Add(const void *ptr, MemStage stage, MemKind kind, int64_t bytes);
+	void Remove(const void *ptr);
+	void SetBuffers(Entry &e, int64_t bufs, int64_t buf_bytes, const void *hw_pool);
+	void Inc(MemCounter &c, int64_t count, int64_t bytes);
+
+	mutable std::mutex m_mutex;
+	std::string m_session;
+	std::unordered_map<const void *, Entry> m_live;
+	std::unordered_map<const void *, HwPool> m_pools;
+	MemCounter m_counters[MEM_STAGE_COUNT][MEM_KIND_COUNT];
+	MemCounter m_total;
+};
+
+#endif // CMEMTRACK_H
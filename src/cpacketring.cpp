@@ -0,0 +1,308 @@
+#include "cpacketring.h"
+#include "cmemtrack.h"
+#include "cspdlog.h"
+#include "ctrace.h"
+#include "caffinity.h"
+
+extern "C"
+{
+#include <libavutil/dict.h>
+}
+
+#include <string.h>
+
+CPacketRing::CPacketRing(size_t capacity)
+{
+	m_slots.assign(capacity ? capacity : 1, nullptr);
+}
+
+CPacketRing::~CPacketRing()
+{
+	CMemTrack *mem = CMemTrack::GetInstance();
+	for (AVPacket *&pkt : m_slots)
+		mem->PacketFree(&pkt);
+	for (RingStream &st : m_streams)
+		avcodec_parameters_free(&st.par);
+}
+
+void CPacketRing::SetStreams(const std::vector<RingStream> &streams)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	for (const RingStream &in : streams)
+	{
+		RingStream st;
+		st.par = avcodec_parameters_alloc();
+		st.time_base = in.time_base;
+		if (st.par)
+			avcodec_parameters_copy(st.par, in.par);
+		m_streams.push_back(st);
+	}
+	m_has_streams = true;
+	m_cond.notify_all();
+}
+
+void CPacketRing::Push(const AVPacket *pkt)
+{
+	CMemTrack *mem = CMemTrack::GetInstance();
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	// 满了直接覆盖最旧的，读得慢的输出自己跳过
+	AVPacket *&slot = m_slots[m_next % m_slots.size()];
+	if (!slot)
+		slot = mem->PacketAlloc(MEM_STAGE_MUX);
+	if (!slot)
+		return;
+	av_packet_unref(slot);
+	if (av_packet_ref(slot, pkt) < 0)
+		return;
+	mem->PacketUpdate(slot);
+	m_next++;
+	m_cond.notify_all();
+}
+
+void CPacketRing::Finish()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_finished = true;
+	m_cond.notify_all();
+}
+
+bool CPacketRing::WaitStreams()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (!m_has_streams && !m_finished)
+		m_cond.wait(lock);
+	return m_has_streams;
+}
+
+int CPacketRing::Read(uint64_t &cursor, bool &resync, AVPacket *pkt, int64_t &dropped)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	for (;;)
+	{
+		while (cursor >= m_next && !m_finished)
+			m_cond.wait(lock);
+		if (cursor >= m_next)
+			return AVERROR_EOF;
+
+		// 已经被覆盖，从还在的最旧的包开始找关键帧
+		uint64_t oldest = m_next > m_slots.size() ? m_next - m_slots.size() : 0;
+		if (cursor < oldest)
+		{
+			dropped += oldest - cursor;
+			cursor = oldest;
+			resync = true;
+		}
+
+		const AVPacket *slot = m_slots[cursor % m_slots.size()];
+		cursor++;
+		if (resync)
+		{
+			if (slot->stream_index != 0 || !(slot->flags & AV_PKT_FLAG_KEY))
+			{
+				dropped++;
+				continue;
+			}
+			resync = false;
+		}
+		return av_packet_ref(pkt, slot);
+	}
+}
+
+//****************************************** */
+
+CRingOutput::CRingOutput(CPacketRing *ring, const std::string &kind, const std::string &url)
+	: m_ring(ring), m_kind(kind), m_url(url)
+{
+}
+
+CRingOutput::~CRingOutput()
+{
+	if (m_thread.joinable())
+		m_thread.join();
+	Close();
+}
+
+void CRingOutput::Start()
+{
+	m_thread = std::thread(&CRingOutput::Run, this);
+}
+
+int CRingOutput::Join()
+{
+	if (m_thread.joinable())
+		m_thread.join();
+	return m_status;
+}
+
+int CRingOutput::Open()
+{
+	const char *format = m_kind == "ts" ? "mpegts" : m_kind == "hls" ? "hls" : nullptr;
+	int ret = avformat_alloc_output_context2(&m_fmt_ctx, nullptr, format, m_url.c_str());
+	if (ret < 0)
+	{
+		MYLOG_ERROR(LOG_MOD_MUX, "output %s: could not create output context", m_url);
+		return ret;
+	}
+
+	// 输出格式放不下的流跳过
+	const std::vector<RingStream> &streams = m_ring->Streams();
+	m_map.assign(streams.size(), -1);
+	for (size_t i = 0; i < streams.size(); i++)
+	{
+		if (!streams[i].par ||
+			avformat_query_codec(m_fmt_ctx->oformat, streams[i].par->codec_id, FF_COMPLIANCE_NORMAL) == 0)
+			continue;
+		AVStream *out = avformat_new_stream(m_fmt_ctx, nullptr);
+		if (!out || avcodec_parameters_copy(out->codecpar, streams[i].par) < 0)
+			return AVERROR(ENOMEM);
+		out->codecpar->codec_tag = 0;
+		out->time_base = streams[i].time_base;
+		m_map[i] = out->index;
+	}
+	if (m_map.empty() || m_map[0] < 0)
+	{
+		MYLOG_ERROR(LOG_MOD_MUX, "output %s cannot hold the video stream", m_url);
+		return AVERROR(EINVAL);
+	}
+
+	if (!(m_fmt_ctx->oformat->flags & AVFMT_NOFILE))
+	{
+		ret = avio_open(&m_fmt_ctx->pb, m_url.c_str(), AVIO_FLAG_WRITE);
+		if (ret < 0)
+		{
+			MYLOG_ERROR(LOG_MOD_MUX, "output %s: could not open", m_url);
+			return ret;
+		}
+	}
+
+	// 直播输出：小包立刻发出去；HLS 只保留最近几个分片
+	AVDictionary *opts = nullptr;
+	if (m_kind == "ts")
+		m_fmt_ctx->flags |= AVFMT_FLAG_FLUSH_PACKETS;
+	else if (m_kind == "hls")
+	{
+		av_dict_set(&opts, "hls_time", "2", 0);
+		av_dict_set(&opts, "hls_list_size", "6", 0);
+		av_dict_set(&opts, "hls_flags", "delete_segments+independent_segments", 0);
+	}
+	ret = avformat_write_header(m_fmt_ctx, &opts);
+	av_dict_free(&opts);
+	if (ret < 0)
+	{
+		MYLOG_ERROR(LOG_MOD_MUX, "output %s: error writing header", m_url);
+		return ret;
+	}
+	m_header_written = true;
+	return 0;
+}
+
+void CRingOutput::Close()
+{
+	if (m_header_written)
+	{
+		int ret = av_write_trailer(m_fmt_ctx);
+		if (ret < 0 && m_status >= 0)
+			m_status = ret;
+		m_header_written = false;
+	}
+	if (m_fmt_ctx && !(m_fmt_ctx->oformat->flags & AVFMT_NOFILE))
+		avio_closep(&m_fmt_ctx->pb);
+	avformat_free_context(m_fmt_ctx);
+	m_fmt_ctx = nullptr;
+}
+
+// 和输出端线程一样绑核、按节点分配内存，结束时记下线程开销给作业统计
+void CRingOutput::Run()
+{
+	CAffinity *affinity = CAffinity::GetInstance();
+	affinity->BindThread(("publish " + m_url).c_str());
+	CTrace::GetInstance()->SetThreadName("publish");
+	Publish();
+	affinity->ThreadDone();
+}
+
+void CRingOutput::Publish()
+{
+	CMemTrack *mem = CMemTrack::GetInstance();
+
+	if (!m_ring->WaitStreams())
+		return;
+	if ((m_status = Open()) < 0)
+	{
+		Close();
+		return;
+	}
+
+	AVPacket *pkt = mem->PacketAlloc(MEM_STAGE_MUX);
+	if (!pkt)
+	{
+		m_status = AVERROR(ENOMEM);
+		Close();
+		return;
+	}
+
+	uint64_t cursor = 0;
+	bool resync = true;
+	int64_t reported = 0;
+	while (m_ring->Read(cursor, resync, pkt, m_dropped) >= 0)
+	{
+		mem->PacketUpdate(pkt);
+		if (m_dropped != reported)
+		{
+			MYLOG_WARN(LOG_MOD_MUX, "output %s fell behind, dropped %ld packets to the next keyframe",
+					   m_url, (long)(m_dropped - reported));
+			reported = m_dropped;
+		}
+
+		int in = pkt->stream_index;
+		int out = in < (int)m_map.size() ? m_map[in] : -1;
+		if (out >= 0)
+		{
+			av_packet_rescale_ts(pkt, m_ring->Streams()[in].time_base, m_fmt_ctx->streams[out]->time_base);
+			pkt->stream_index = out;
+			int ret;
+			{
+				TRACE_SCOPE("publish_write");
+				ret = av_interleaved_write_frame(m_fmt_ctx, pkt);
+			}
+			if (ret < 0)
+			{
+				// 对端断开等错误只影响这一个输出
+				MYLOG_ERROR(LOG_MOD_MUX, "output %s: write failed: %d", m_url, ret);
+				m_status = ret;
+				break;
+			}
+			m_packets++;
+		}
+		av_packet_unref(pkt);
+		mem->PacketUpdate(pkt);
+	}
+
+	mem->PacketFree(&pkt);
+	Close();
+	MYLOG_INFO(LOG_MOD_MUX, "output %s: %ld packets, %ld dropped", m_url, (long)m_packets, (long)m_dropped);
+}
+
+bool ParseOutputSpec(const char *spec, std::vector<std::pair<std::string, std::string> > &outputs)
+{
+	const char *p = spec;
+	while (*p)
+	{
+		const char *end = strchr(p, ',');
+		if (!end)
+			end = p + strlen(p);
+
+		std::string item(p, end - p);
+		size_t colon = item.find(':');
+		if (colon == std::string::npos || colon + 1 == item.size())
+			return false;
+		std::string kind = item.substr(0, colon);
+		if (kind != "file" && kind != "ts" && kind != "hls")
+			return false;
+		outputs.push_back(std::make_pair(kind, item.substr(colon + 1)));
+
+		p = *end ? end + 1 : end;
+	}
+	return !outputs.empty();
+}
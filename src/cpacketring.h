@@ -0,0 +1,90 @@
+#ifndef CPACKETRING_H
+#define CPACKETRING_H
+
+// 编码后数据包的环形缓冲区
+// 编码线程写入后不等待，任意多个输出(文件、本机 UDP/UNIX socket 上的 MPEG-TS、HLS)各自一个线程
+// 按自己的进度读；读得太慢被覆盖时跳到下一个视频关键帧继续，编码器不会被拖住。
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+
+#include <stdint.h>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// 环里的一路流，0 是视频，后面是拷贝的音频/字幕
+struct RingStream
+{
+	AVCodecParameters *par;
+	AVRational time_base;	// 数据包时间戳的时间基
+};
+
+class CPacketRing
+{
+public:
+	explicit CPacketRing(size_t capacity);
+	~CPacketRing();
+
+	// 生产者：编码器打开后设置流信息(参数会被拷贝)，之后写包，最后 Finish
+	void SetStreams(const std::vector<RingStream> &streams);
+	void Push(const AVPacket *pkt);
+	void Finish();
+
+	// 消费者：等到流信息，结束前没有设置返回 false
+	bool WaitStreams();
+	const std::vector<RingStream> &Streams() const { return m_streams; }
+
+	// 按 cursor 读下一个包，没有新包时等待；被覆盖后跳到下一个关键帧，跳过的包计入 dropped
+	// 新消费者 cursor 为 0、resync 为 true，从第一个关键帧开始；结束返回 AVERROR_EOF
+	int Read(uint64_t &cursor, bool &resync, AVPacket *pkt, int64_t &dropped);
+
+private:
+	std::vector<AVPacket *> m_slots;
+	uint64_t m_next = 0;	// 下一个写入的序号
+	bool m_finished = false;
+	bool m_has_streams = false;
+	std::vector<RingStream> m_streams;
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+};
+
+// 一个输出，从环里读包写入自己的复用器
+class CRingOutput
+{
+public:
+	// kind: file ts hls；url: 文件名、udp://127.0.0.1:port、unix:/path、m3u8 路径
+	CRingOutput(CPacketRing *ring, const std::string &kind, const std::string &url);
+	~CRingOutput();
+
+	void Start();
+	// 等线程结束，返回错误码
+	int Join();
+
+private:
+	void Run();
+	void Publish();
+	int Open();
+	void Close();
+
+	CPacketRing *m_ring;
+	std::string m_kind;
+	std::string m_url;
+	AVFormatContext *m_fmt_ctx = nullptr;
+	std::vector<int> m_map;		// 环里的流序号 -> 输出流序号，-1 不输出
+	bool m_header_written = false;
+	std::thread m_thread;
+	int m_status = 0;
+	int64_t m_packets = 0;
+	int64_t m_dropped = 0;
+};
+
+// 按 "ts:udp://127.0.0.1:5000,hls:/var/live/index.m3u8,file:rec.mkv" 解析
+bool ParseOutputSpec(const char *spec, std::vector<std::pair<std::string, std::string> > &outputs);
+
+#endif // CPACKETRING_H
@@ -0,0 +1,397 @@
+#include "cshmring.h"
+
+extern "C"
+{
+#include <libavutil/buffer.h>
+#include <libavutil/error.h>
+}
+
+#include <atomic>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <stdexcept>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SHM_RING_MAGIC 0x47525346	// "FSRG"
+#define SHM_RING_VERSION 1
+#define SHM_RING_PAGE 4096
+#define SHM_RING_ALIGN(x, a) (((x) + (a) - 1) / (a) * (a))
+
+// 两个进程共用的结构，只用定长类型，原子量必须是无锁的
+struct ShmRingHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t slots;
+	int32_t format;					// AVPixelFormat
+	int32_t width;
+	int32_t height;
+	int32_t linesize[2];
+	uint64_t plane_offset[2];		// 槽位内各平面的偏移
+	uint64_t slot_size;
+	uint64_t slots_offset;			// 槽位描述的偏移
+	uint64_t data_offset;			// 帧数据的偏移
+	int32_t producer_pid;
+
+	alignas(64) std::atomic<uint64_t> write_seq;	// 已发布的帧数
+	std::atomic<uint32_t> data_futex;				// 发布时加一，消费者在上面等
+	std::atomic<uint32_t> finished;
+	alignas(64) std::atomic<uint64_t> read_seq;		// 已归还的帧数
+	std::atomic<uint32_t> space_futex;				// 归还时加一，生产者在上面等
+};
+
+struct alignas(64) ShmRingSlot
+{
+	uint64_t seq;
+	int64_t pts_us;
+	int64_t capture_us;
+};
+
+static_assert(sizeof(ShmRingHeader) <= SHM_RING_PAGE, "shm ring header too large");
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "shm ring needs lock free 64-bit atomics");
+
+static int64_t MonotonicUs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// 跨进程的 futex，不能用 FUTEX_PRIVATE_FLAG
+static void FutexWait(std::atomic<uint32_t> *addr, uint32_t val, int timeout_ms)
+{
+	struct timespec ts;
+	ts.tv_sec = timeout_ms / 1000;
+	ts.tv_nsec = (long)(timeout_ms % 1000) * 1000000;
+	syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAIT, val, &ts, NULL, 0);
+}
+
+static void FutexWake(std::atomic<uint32_t> *addr)
+{
+	addr->fetch_add(1, std::memory_order_release);
+	syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+CShmRing::~CShmRing()
+{
+	if (m_base)
+		munmap(m_base, m_size);
+	if (m_fd >= 0)
+		close(m_fd);
+	if (!m_name.empty())
+		shm_unlink(m_name.c_str());
+}
+
+bool CShmRing::IsSpec(const char *spec)
+{
+	return strncmp(spec, "shm:", 4) == 0 || strncmp(spec, "fd:", 3) == 0;
+}
+
+CShmRing *CShmRing::Create(const std::string &name, int width, int height, AVPixelFormat format, int slots)
+{
+	if (format != AV_PIX_FMT_NV12 && format != AV_PIX_FMT_P010)
+		throw std::runtime_error("shm ring supports nv12 and p010 only");
+	if (width <= 0 || height <= 0 || slots < 2)
+		throw std::runtime_error("invalid shm ring geometry");
+
+	// 1. 计算布局，行宽按 64 字节对齐，方便上传显存
+	ShmRingHeader hdr;
+	memset((void *)&hdr, 0, sizeof(hdr));
+	int sample = format == AV_PIX_FMT_P010 ? 2 : 1;
+	hdr.magic = SHM_RING_MAGIC;
+	hdr.version = SHM_RING_VERSION;
+	hdr.slots = slots;
+	hdr.format = format;
+	hdr.width = width;
+	hdr.height = height;
+	hdr.linesize[0] = SHM_RING_ALIGN(width * sample, 64);
+	hdr.linesize[1] = hdr.linesize[0];
+	hdr.plane_offset[0] = 0;
+	hdr.plane_offset[1] = SHM_RING_ALIGN((uint64_t)hdr.linesize[0] * height, 64);
+	hdr.slot_size = SHM_RING_ALIGN(hdr.plane_offset[1] + (uint64_t)hdr.linesize[1] * ((height + 1) / 2), SHM_RING_PAGE);
+	hdr.slots_offset = SHM_RING_PAGE;
+	hdr.data_offset = hdr.slots_offset + SHM_RING_ALIGN(sizeof(ShmRingSlot) * slots, SHM_RING_PAGE);
+	hdr.producer_pid = getpid();
+	if (hdr.slot_size > INT_MAX)
+		throw std::runtime_error("shm ring slot too large");
+
+	// 2. 创建共享内存段
+	int fd;
+	if (name.empty())
+		fd = syscall(SYS_memfd_create, "shm_ring", 0);
+	else
+		fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0)
+		throw std::runtime_error("Failed to create shared memory " + name + ": " + strerror(errno));
+
+	CShmRing *ring = new CShmRing();
+	ring->m_fd = fd;
+	ring->m_name = name;
+	ring->m_size = hdr.data_offset + hdr.slot_size * slots;
+	if (ftruncate(fd, ring->m_size) < 0)
+	{
+		delete ring;
+		throw std::runtime_error("Failed to size shared memory");
+	}
+
+	// 3. 映射并写头，原子量最后初始化
+	ring->Map(fd, true);
+	memcpy((void *)ring->m_hdr, &hdr, sizeof(hdr));
+	ring->m_hdr->write_seq.store(0);
+	ring->m_hdr->data_futex.store(0);
+	ring->m_hdr->finished.store(0);
+	ring->m_hdr->read_seq.store(0);
+	ring->m_hdr->space_futex.store(0);
+	ring->LoadGeometry();
+	return ring;
+}
+
+CShmRing *CShmRing::Open(const std::string &spec)
+{
+	int fd;
+	if (spec.compare(0, 3, "fd:") == 0)
+		fd = dup(atoi(spec.c_str() + 3));
+	else if (spec.compare(0, 4, "shm:") == 0)
+		fd = shm_open(spec.c_str() + 4, O_RDWR, 0);
+	else
+		throw std::runtime_error("Unknown shm ring spec " + spec);
+	if (fd < 0)
+		throw std::runtime_error("Failed to open shared memory " + spec + ": " + strerror(errno));
+
+	CShmRing *ring = new CShmRing();
+	ring->m_fd = fd;
+	struct stat st;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < SHM_RING_PAGE)
+	{
+		delete ring;
+		throw std::runtime_error("Shared memory " + spec + " is not a frame ring");
+	}
+	ring->m_size = st.st_size;
+	ring->Map(fd, false);
+
+	if (!ring->LoadGeometry())
+	{
+		delete ring;
+		throw std::runtime_error("Shared memory " + spec + " is not a frame ring");
+	}
+	ring->m_released.assign(ring->m_slot_count, 0);
+	// 消费者重启时从生产者还没回收的地方接着读
+	ring->m_next_read = ring->m_hdr->read_seq.load(std::memory_order_acquire);
+	return ring;
+}
+
+void CShmRing::Map(int fd, bool create)
+{
+	void *p = mmap(NULL, m_size, PROT_READ | PROT_WRITE, MAP_SHARED | (create ? MAP_POPULATE : 0), fd, 0);
+	if (p == MAP_FAILED)
+		throw std::runtime_error(std::string("Failed to map shared memory: ") + strerror(errno));
+	m_base = (uint8_t *)p;
+	m_hdr = (ShmRingHeader *)m_base;
+}
+
+bool CShmRing::LoadGeometry()
+{
+	// 1. 每个字段只读一次，检查的和用的是同一份
+	const ShmRingHeader *hdr = m_hdr;
+	if (hdr->magic != SHM_RING_MAGIC || hdr->version != SHM_RING_VERSION)
+		return false;
+	uint32_t slots = hdr->slots;
+	int format = hdr->format;
+	int width = hdr->width;
+	int height = hdr->height;
+	uint64_t slot_size = hdr->slot_size;
+	uint64_t slots_offset = hdr->slots_offset;
+	uint64_t data_offset = hdr->data_offset;
+	int linesize[2];
+	uint64_t plane_offset[2];
+	for (int i = 0; i < 2; i++)
+	{
+		linesize[i] = hdr->linesize[i];
+		plane_offset[i] = hdr->plane_offset[i];
+	}
+
+	// 2. 格式和尺寸
+	if (format != AV_PIX_FMT_NV12 && format != AV_PIX_FMT_P010)
+		return false;
+	if (slots < 2 || width <= 0 || height <= 0 || slot_size == 0 || slot_size > INT_MAX)
+		return false;
+	int64_t row = (int64_t)width * (format == AV_PIX_FMT_P010 ? 2 : 1);
+	int plane_height[2] = { height, (height + 1) / 2 };
+	for (int i = 0; i < 2; i++)
+	{
+		// 平面必须整个落在槽位里
+		if (linesize[i] < row || plane_offset[i] > slot_size ||
+			(uint64_t)linesize[i] * plane_height[i] > slot_size - plane_offset[i])
+			return false;
+	}
+
+	// 3. 槽位描述和帧数据都在段内，不重叠
+	if (slots_offset < SHM_RING_PAGE || slots_offset % alignof(ShmRingSlot) != 0 || slots_offset > m_size ||
+		slots > (m_size - slots_offset) / sizeof(ShmRingSlot) ||
+		data_offset < slots_offset + (uint64_t)slots * sizeof(ShmRingSlot) || data_offset > m_size ||
+		slots > (m_size - data_offset) / slot_size)
+		return false;
+
+	m_slot_count = slots;
+	m_format = (AVPixelFormat)format;
+	m_width = width;
+	m_height = height;
+	for (int i = 0; i < 2; i++)
+	{
+		m_linesize[i] = linesize[i];
+		m_plane_offset[i] = plane_offset[i];
+	}
+	m_slot_size = slot_size;
+	m_producer_pid = hdr->producer_pid;
+	m_slots = (ShmRingSlot *)(m_base + slots_offset);
+	m_data = m_base + data_offset;
+	return true;
+}
+
+uint8_t *CShmRing::SlotData(uint64_t seq) const
+{
+	return m_data + (seq % m_slot_count) * m_slot_size;
+}
+
+//****************************************** */
+// 生产者
+
+int CShmRing::Acquire(uint8_t *data[2], int linesize[2], int timeout_ms)
+{
+	uint64_t seq = m_hdr->write_seq.load(std::memory_order_relaxed);
+	int64_t deadline = MonotonicUs() + (int64_t)timeout_ms * 1000;
+	for (;;)
+	{
+		uint32_t f = m_hdr->space_futex.load(std::memory_order_acquire);
+		if (seq - m_hdr->read_seq.load(std::memory_order_acquire) < m_slot_count)
+			break;
+		int64_t left = deadline - MonotonicUs();
+		if (left <= 0)
+			return AVERROR(EAGAIN);
+		FutexWait(&m_hdr->space_futex, f, (int)(left / 1000) + 1);
+	}
+
+	uint8_t *p = SlotData(seq);
+	for (int i = 0; i < 2; i++)
+	{
+		data[i] = p + m_plane_offset[i];
+		linesize[i] = m_linesize[i];
+	}
+	return 0;
+}
+
+int CShmRing::Publish(int64_t pts_us)
+{
+	uint64_t seq = m_hdr->write_seq.load(std::memory_order_relaxed);
+	ShmRingSlot *slot = &m_slots[seq % m_slot_count];
+	slot->seq = seq;
+	slot->pts_us = pts_us;
+	slot->capture_us = MonotonicUs();
+	// release 保证槽位数据先于序号对消费者可见
+	m_hdr->write_seq.store(seq + 1, std::memory_order_release);
+	FutexWake(&m_hdr->data_futex);
+	return 0;
+}
+
+void CShmRing::Finish()
+{
+	m_hdr->finished.store(1, std::memory_order_release);
+	FutexWake(&m_hdr->data_futex);
+}
+
+//****************************************** */
+// 消费者
+
+struct ShmFrameRef
+{
+	CShmRing *ring;
+	uint64_t seq;
+};
+
+void CShmRing::FreeSlot(void *opaque, uint8_t *data)
+{
+	ShmFrameRef *ref = (ShmFrameRef *)opaque;
+	ref->ring->Release(ref->seq);
+	delete ref;
+}
+
+void CShmRing::Release(uint64_t seq)
+{
+	std::lock_guard<std::mutex> lock(m_release_mutex);
+	m_released[seq % m_slot_count] = 1;
+
+	// 只归还从 read_seq 开始连续释放的槽位，生产者才能按顺序复用
+	uint64_t read = m_hdr->read_seq.load(std::memory_order_relaxed);
+	uint64_t start = read;
+	while (read < m_next_read && m_released[read % m_slot_count])
+	{
+		m_released[read % m_slot_count] = 0;
+		read++;
+	}
+	if (read != start)
+	{
+		m_hdr->read_seq.store(read, std::memory_order_release);
+		FutexWake(&m_hdr->space_futex);
+	}
+}
+
+int CShmRing::Read(AVFrame *frame, int timeout_ms)
+{
+	// 1. 等生产者发布下一帧
+	int64_t deadline = MonotonicUs() + (int64_t)timeout_ms * 1000;
+	for (;;)
+	{
+		uint32_t f = m_hdr->data_futex.load(std::memory_order_acquire);
+		if (m_next_read < m_hdr->write_seq.load(std::memory_order_acquire))
+			break;
+		if (m_hdr->finished.load(std::memory_order_acquire))
+			return AVERROR_EOF;
+		// 生产者进程已经不在了
+		if (m_producer_pid > 0 && kill(m_producer_pid, 0) < 0 && errno == ESRCH)
+			return AVERROR_EOF;
+		int64_t left = deadline - MonotonicUs();
+		if (left <= 0)
+			return AVERROR(EAGAIN);
+		FutexWait(&m_hdr->data_futex, f, (int)(left / 1000) + 1);
+	}
+
+	// 2. 槽位包装成只读的 AVBuffer，最后一个引用释放时归还
+	uint64_t seq = m_next_read;
+	const ShmRingSlot *slot = &m_slots[seq % m_slot_count];
+	uint8_t *p = SlotData(seq);
+	ShmFrameRef *ref = new ShmFrameRef{this, seq};
+	AVBufferRef *buf = av_buffer_create(p, (int)m_slot_size, FreeSlot, ref, AV_BUFFER_FLAG_READONLY);
+	if (!buf)
+	{
+		delete ref;
+		return AVERROR(ENOMEM);
+	}
+	{
+		std::lock_guard<std::mutex> lock(m_release_mutex);
+		m_next_read = seq + 1;
+	}
+
+	av_frame_unref(frame);
+	frame->buf[0] = buf;
+	frame->format = m_format;
+	frame->width = m_width;
+	frame->height = m_height;
+	for (int i = 0; i < 2; i++)
+	{
+		frame->data[i] = p + m_plane_offset[i];
+		frame->linesize[i] = m_linesize[i];
+	}
+	frame->pts = slot->pts_us;
+	m_last_seq = slot->seq;
+	m_last_capture_us = slot->capture_us;
+	return 0;
+}
@@ -0,0 +1,90 @@
+#ifndef CSHMRING_H
+#define CSHMRING_H
+
+// 共享内存帧环：采集/合成进程把原始帧(NV12/P010)写进共享内存里的固定大小槽位，编码进程原地读取，
+// 不经过文件或管道拷贝。单生产者单消费者，两边只靠原子序号同步，等待用 futex。
+// 消费者把槽位包装成 AVFrame 的缓冲区，帧的最后一个引用释放(上传显存或编码完)后槽位才还给生产者。
+//
+// 共享内存布局：头(4K) | 槽位描述(每个 64 字节，按 4K 对齐) | 帧数据(每个槽位按 4K 对齐)
+// 段可以是 POSIX shm(shm:/name)或者 memfd(生产者创建后把 fd 传给子进程，fd:N)
+
+extern "C"
+{
+#include <libavutil/frame.h>
+#include <libavutil/pixfmt.h>
+}
+
+#include <stdint.h>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct ShmRingHeader;
+struct ShmRingSlot;
+
+class CShmRing
+{
+public:
+	~CShmRing();
+
+	// 生产者：name 以 / 开头时用 shm_open 创建，为空时用 memfd，通过 Fd() 传给消费者
+	static CShmRing *Create(const std::string &name, int width, int height, AVPixelFormat format, int slots);
+	// 消费者：spec 为 shm:/name 或 fd:N
+	static CShmRing *Open(const std::string &spec);
+	static bool IsSpec(const char *spec);
+
+	int Fd() const { return m_fd; }
+	int Width() const { return m_width; }
+	int Height() const { return m_height; }
+	AVPixelFormat Format() const { return m_format; }
+
+	// 生产者：取一个空闲槽位写入，没有空闲槽位时最多等 timeout_ms，超时返回 AVERROR(EAGAIN)
+	int Acquire(uint8_t *data[2], int linesize[2], int timeout_ms);
+	// 发布刚写好的槽位，pts_us 为帧时间戳(微秒)，采集时间取当前单调时钟
+	int Publish(int64_t pts_us);
+	// 不再写入，消费者读完已发布的帧后返回 EOF
+	void Finish();
+
+	// 消费者：按顺序取下一帧，frame 引用槽位内存(只读)，没有新帧时最多等 timeout_ms
+	// 成功返回 0，超时 AVERROR(EAGAIN)，生产者结束或退出 AVERROR_EOF
+	int Read(AVFrame *frame, int timeout_ms);
+	// 最近一次 Read 的帧序号和采集时间(CLOCK_MONOTONIC 微秒)
+	uint64_t LastSeq() const { return m_last_seq; }
+	int64_t LastCaptureUs() const { return m_last_capture_us; }
+
+private:
+	CShmRing() {}
+	void Map(int fd, bool create);
+	// 头里的布局拷贝到成员并检查，之后只用拷贝，对端改了头也不会越界
+	bool LoadGeometry();
+	uint8_t *SlotData(uint64_t seq) const;
+	void Release(uint64_t seq);
+	static void FreeSlot(void *opaque, uint8_t *data);
+
+	int m_fd = -1;
+	std::string m_name;			// 生产者创建的 shm 名字，析构时删除
+	uint8_t *m_base = nullptr;
+	size_t m_size = 0;
+	ShmRingHeader *m_hdr = nullptr;
+	ShmRingSlot *m_slots = nullptr;
+	uint8_t *m_data = nullptr;
+
+	// 创建/打开时从头里拷贝的布局
+	uint32_t m_slot_count = 0;
+	AVPixelFormat m_format = AV_PIX_FMT_NONE;
+	int m_width = 0;
+	int m_height = 0;
+	int m_linesize[2] = { 0, 0 };
+	uint64_t m_plane_offset[2] = { 0, 0 };
+	uint64_t m_slot_size = 0;
+	int32_t m_producer_pid = 0;
+
+	// 消费者：AVFrame 的释放顺序不一定和读取顺序一致，按顺序归还连续释放的槽位
+	std::mutex m_release_mutex;
+	std::vector<uint8_t> m_released;
+	uint64_t m_next_read = 0;
+	uint64_t m_last_seq = 0;
+	int64_t m_last_capture_us = 0;
+};
+
+#endif // CSHMRING_H
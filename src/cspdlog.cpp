@@ -0,0 +1,546 @@
+#include "cspdlog.h"
+
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unordered_map>
+
+namespace MYSPDLOG
+{
+
+static std::mutex s_instance_mutex;
+static std::atomic<CSpdlog *> s_instance(nullptr);
+
+CSpdlog *GetInstance()
+{
+	CSpdlog *p = s_instance.load(std::memory_order_acquire);
+	if (p)
+		return p;
+
+	std::lock_guard<std::mutex> lock(s_instance_mutex);
+	p = s_instance.load(std::memory_order_relaxed);
+	if (!p)
+	{
+		p = new CSpdlog();
+		p->Init();
+		s_instance.store(p, std::memory_order_release);
+	}
+	return p;
+}
+
+static int64_t NowUs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint32_t CurrentTid()
+{
+	static thread_local uint32_t tid = 0;
+	if (!tid)
+		tid = (uint32_t)syscall(SYS_gettid);
+	return tid;
+}
+
+static const char *s_level_names[] = { "trace", "debug", "info", "warn", "error", "off" };
+static const char *s_module_names[] = { "main", "demux", "decode", "encode", "mux", "hw", "sink", "cache" };
+
+const char *CSpdlog::LevelName(LogLevel level)
+{
+	return (level >= LV_TRACE && level <= LV_OFF) ? s_level_names[level] : "?";
+}
+
+const char *CSpdlog::ModuleName(LogModule module)
+{
+	return (module >= 0 && module < LOG_MOD_COUNT) ? s_module_names[module] : "?";
+}
+
+CSpdlog::CSpdlog()
+	: m_slots(nullptr), m_mask(0), m_head(0), m_tail(0), m_dropped(0),
+	  m_sinks(LOG_SINK_STDERR), m_rate_limit(50), m_file(nullptr),
+	  m_level_file_mtime(0), m_running(false), m_waiting(false)
+{
+	for (int i = 0; i < LOG_MOD_COUNT; i++)
+		m_levels[i].store(LV_INFO);
+}
+
+CSpdlog::~CSpdlog()
+{
+	Shutdown();
+
+	CSpdlog *self = this;
+	s_instance.compare_exchange_strong(self, nullptr);
+}
+
+bool CSpdlog::Init(size_t capacity)
+{
+	if (m_slots)
+		return true;
+
+	size_t n = 2;
+	while (n < capacity)
+		n <<= 1;
+
+	m_slots = new Slot[n];
+	for (size_t i = 0; i < n; i++)
+		m_slots[i].seq.store(i, std::memory_order_relaxed);
+	m_mask = n - 1;
+	m_head.store(0);
+	m_tail = 0;
+
+	const char *env = getenv("MYSPDLOG_LEVEL");
+	if (env)
+		SetLevels(env);
+
+	m_running = true;
+	m_thread = std::thread(&CSpdlog::Run, this);
+	return true;
+}
+
+void CSpdlog::Shutdown()
+{
+	if (!m_running.exchange(false))
+		return;
+
+	m_cond.notify_one();
+	if (m_thread.joinable())
+		m_thread.join();
+
+	if (m_dropped.load())
+		fprintf(stderr, "[log] %llu records dropped (queue full)\n", (unsigned long long)m_dropped.load());
+
+	if (m_sinks & LOG_SINK_SYSLOG)
+		closelog();
+	if (m_file)
+	{
+		fclose(m_file);
+		m_file = nullptr;
+	}
+	delete[] m_slots;
+	m_slots = nullptr;
+}
+
+bool CSpdlog::SetLogFile(const char *path)
+{
+	FILE *f = fopen(path, "a");
+	if (!f)
+		return false;
+
+	// 只在后台线程写，这里只做替换
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_file)
+		fclose(m_file);
+	m_file = f;
+	m_sinks |= LOG_SINK_FILE;
+	return true;
+}
+
+void CSpdlog::AddSinks(int sinks)
+{
+	if ((sinks & LOG_SINK_SYSLOG) && !(m_sinks & LOG_SINK_SYSLOG))
+		openlog("testFFmpeg", LOG_PID, LOG_USER);
+	m_sinks |= sinks;
+}
+
+static bool ParseLevel(const char *s, size_t len, LogLevel &level)
+{
+	for (int i = LV_TRACE; i <= LV_OFF; i++)
+	{
+		if (strlen(s_level_names[i]) == len && strncmp(s_level_names[i], s, len) == 0)
+		{
+			level = (LogLevel)i;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool CSpdlog::SetLevels(const char *spec)
+{
+	bool ok = true;
+	const char *p = spec;
+	while (*p)
+	{
+		const char *end = strchr(p, ',');
+		if (!end)
+			end = p + strlen(p);
+
+		const char *eq = (const char *)memchr(p, '=', end - p);
+		LogLevel level;
+		if (!eq)
+		{
+			// 只给级别，等同于 *=level
+			if (ParseLevel(p, end - p, level))
+			{
+				for (int i = 0; i < LOG_MOD_COUNT; i++)
+					SetLevel((LogModule)i, level);
+			}
+			else
+				ok = false;
+		}
+		else if (!ParseLevel(eq + 1, end - eq - 1, level))
+			ok = false;
+		else if (eq - p == 1 && *p == '*')
+		{
+			for (int i = 0; i < LOG_MOD_COUNT; i++)
+				SetLevel((LogModule)i, level);
+		}
+		else
+		{
+			int i;
+			for (i = 0; i < LOG_MOD_COUNT; i++)
+			{
+				if (strlen(s_module_names[i]) == (size_t)(eq - p) && strncmp(s_module_names[i], p, eq - p) == 0)
+				{
+					SetLevel((LogModule)i, level);
+					break;
+				}
+			}
+			if (i == LOG_MOD_COUNT)
+				ok = false;
+		}
+
+		p = *end ? end + 1 : end;
+	}
+	return ok;
+}
+
+void CSpdlog::WatchLevelFile(const char *path)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_level_file = path;
+	m_level_file_mtime = 0;
+}
+
+void CSpdlog::CheckLevelFile()
+{
+	std::string path;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		path = m_level_file;
+	}
+	if (path.empty())
+		return;
+
+	struct stat st;
+	if (stat(path.c_str(), &st) != 0 || (int64_t)st.st_mtime == m_level_file_mtime)
+		return;
+	m_level_file_mtime = st.st_mtime;
+
+	FILE *f = fopen(path.c_str(), "r");
+	if (!f)
+		return;
+	char line[256];
+	while (fgets(line, sizeof(line), f))
+	{
+		line[strcspn(line, "\r\n# ")] = 0;
+		if (line[0])
+			SetLevels(line);
+	}
+	fclose(f);
+}
+
+void CSpdlog::SetArg(LogRecord *rec, LogArg &a, const char *v)
+{
+	a.type = LogArg::T_STR;
+	a.str_off = rec->text_len;
+	if (!v)
+		v = "(null)";
+
+	size_t room = LOG_TEXT_SIZE - rec->text_len;
+	if (room == 0)
+	{
+		// 没有空间了，指向最后一个 '\0'
+		a.str_off = LOG_TEXT_SIZE - 1;
+		return;
+	}
+	size_t n = strlen(v);
+	if (n >= room)
+		n = room - 1;
+	memcpy(rec->text + rec->text_len, v, n);
+	rec->text[rec->text_len + n] = 0;
+	rec->text_len = (uint8_t)(rec->text_len + n + 1 < LOG_TEXT_SIZE ? rec->text_len + n + 1 : LOG_TEXT_SIZE);
+}
+
+// 多生产者单消费者有界队列，每个槽带序号，满了直接丢弃，不阻塞调用线程
+CSpdlog::Slot *CSpdlog::BeginRecord()
+{
+	if (!m_slots)
+		return nullptr;
+
+	size_t pos = m_head.load(std::memory_order_relaxed);
+	for (;;)
+	{
+		Slot *slot = &m_slots[pos & m_mask];
+		size_t seq = slot->seq.load(std::memory_order_acquire);
+		intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+		if (diff == 0)
+		{
+			if (m_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+			{
+				slot->pos = pos;
+				slot->rec.ts_us = NowUs();
+				slot->rec.tid = CurrentTid();
+				return slot;
+			}
+		}
+		else if (diff < 0)
+		{
+			m_dropped.fetch_add(1, std::memory_order_relaxed);
+			return nullptr;
+		}
+		else
+			pos = m_head.load(std::memory_order_relaxed);
+	}
+}
+
+void CSpdlog::CommitRecord(Slot *slot)
+{
+	slot->seq.store(slot->pos + 1, std::memory_order_release);
+	if (m_waiting.load(std::memory_order_relaxed))
+		m_cond.notify_one();
+}
+
+bool CSpdlog::Pop(LogRecord &out)
+{
+	Slot *slot = &m_slots[m_tail & m_mask];
+	if (slot->seq.load(std::memory_order_acquire) != m_tail + 1)
+		return false;
+
+	out = slot->rec;
+	slot->seq.store(m_tail + m_mask + 1, std::memory_order_release);
+	m_tail++;
+	return true;
+}
+
+// 按 printf 格式串格式化，参数类型以记录里的为准，长度修饰符忽略
+void CSpdlog::Format(const LogRecord &rec, std::string &out)
+{
+	char spec[32];
+	char buf[256];
+	int argi = 0;
+
+	for (const char *p = rec.fmt; *p; p++)
+	{
+		if (*p != '%')
+		{
+			out += *p;
+			continue;
+		}
+		if (p[1] == '%')
+		{
+			out += '%';
+			p++;
+			continue;
+		}
+
+		// flags/width/precision
+		size_t n = 0;
+		spec[n++] = '%';
+		const char *q = p + 1;
+		while (*q && strchr("-+ #0123456789.", *q) && n < sizeof(spec) - 4)
+			spec[n++] = *q++;
+		while (*q && strchr("hlLqjzt", *q))
+			q++;
+		char conv = *q;
+		if (!conv)
+			break;
+		p = q;
+
+		if (argi >= rec.nargs)
+		{
+			out += "<?>";
+			continue;
+		}
+		const LogArg &a = rec.args[argi++];
+
+		switch (conv)
+		{
+		case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+			if (conv == 'c')
+			{
+				spec[n++] = 'c';
+				spec[n] = 0;
+				snprintf(buf, sizeof(buf), spec, (int)(a.type == LogArg::T_DOUBLE ? (int64_t)a.d : a.i));
+				break;
+			}
+			spec[n++] = 'l';
+			spec[n++] = 'l';
+			spec[n++] = conv;
+			spec[n] = 0;
+			if (a.type == LogArg::T_DOUBLE)
+				snprintf(buf, sizeof(buf), spec, (long long)a.d);
+			else if (a.type == LogArg::T_STR)
+				snprintf(buf, sizeof(buf), "%s", rec.text + a.str_off);
+			else
+				snprintf(buf, sizeof(buf), spec, (long long)a.i);
+			break;
+		case 'f': case 'F': case 'g': case 'G': case 'e': case 'E':
+			spec[n++] = conv;
+			spec[n] = 0;
+			if (a.type == LogArg::T_INT)
+				snprintf(buf, sizeof(buf), spec, (double)a.i);
+			else if (a.type == LogArg::T_UINT)
+				snprintf(buf, sizeof(buf), spec, (double)a.u);
+			else if (a.type == LogArg::T_DOUBLE)
+				snprintf(buf, sizeof(buf), spec, a.d);
+			else
+				snprintf(buf, sizeof(buf), "<?>");
+			break;
+		case 's':
+			spec[n++] = 's';
+			spec[n] = 0;
+			snprintf(buf, sizeof(buf), spec, a.type == LogArg::T_STR ? rec.text + a.str_off : "<?>");
+			break;
+		case 'p':
+			snprintf(buf, sizeof(buf), "%p", a.p);
+			break;
+		default:
+			snprintf(buf, sizeof(buf), "<%%%c?>", conv);
+			break;
+		}
+		out += buf;
+	}
+}
+
+void CSpdlog::Emit(const LogRecord &rec)
+{
+	char head[96];
+	time_t sec = (time_t)(rec.ts_us / 1000000);
+	struct tm tm;
+	localtime_r(&sec, &tm);
+	size_t n = strftime(head, sizeof(head), "%Y-%m-%d %H:%M:%S", &tm);
+	snprintf(head + n, sizeof(head) - n, ".%06d [%s] [%s] [%u] ", (int)(rec.ts_us % 1000000),
+			 LevelName((LogLevel)rec.level), ModuleName((LogModule)rec.module), rec.tid);
+
+	std::string msg;
+	Format(rec, msg);
+	if (msg.empty() || msg.back() != '\n')
+		msg += '\n';
+
+	if (m_sinks & LOG_SINK_STDERR)
+	{
+		fputs(head, stderr);
+		fputs(msg.c_str(), stderr);
+	}
+	if (m_sinks & LOG_SINK_FILE)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_file)
+		{
+			fputs(head, m_file);
+			fputs(msg.c_str(), m_file);
+		}
+	}
+	if (m_sinks & LOG_SINK_SYSLOG)
+	{
+		static const int prio[] = { LOG_DEBUG, LOG_DEBUG, LOG_INFO, LOG_WARNING, LOG_ERR, LOG_ERR };
+		syslog(prio[rec.level], "[%s] %s", ModuleName((LogModule)rec.module), msg.c_str());
+	}
+}
+
+void CSpdlog::Run()
+{
+	// 按调用点(格式串地址)限流
+	struct RateState
+	{
+		int64_t window;
+		int count;
+		uint64_t suppressed;
+		LogRecord last;
+	};
+	std::unordered_map<const char *, RateState> rate;
+	int64_t last_check = 0;
+
+	auto report_suppressed = [this](RateState &st) {
+		if (!st.suppressed)
+			return;
+		LogRecord note = st.last;
+		note.level = LV_WARN;
+		note.fmt = "%llu similar messages suppressed: %s";
+		note.nargs = 0;
+		note.text_len = 0;
+		SetArg(&note, note.args[note.nargs++], (unsigned long long)st.suppressed);
+		SetArg(&note, note.args[note.nargs++], st.last.fmt);
+		Emit(note);
+		st.suppressed = 0;
+	};
+
+	if (m_sinks & LOG_SINK_SYSLOG)
+		openlog("testFFmpeg", LOG_PID, LOG_USER);
+
+	LogRecord rec;
+	for (;;)
+	{
+		bool got = false;
+		while (Pop(rec))
+		{
+			got = true;
+			int64_t window = rec.ts_us / 1000000;
+			if (m_rate_limit > 0)
+			{
+				RateState &st = rate[rec.fmt];
+				if (st.window != window)
+				{
+					report_suppressed(st);
+					st.window = window;
+					st.count = 0;
+				}
+				if (++st.count > m_rate_limit && rec.level < LV_ERROR)
+				{
+					st.suppressed++;
+					st.last = rec;
+					continue;
+				}
+			}
+			Emit(rec);
+		}
+
+		int64_t now = NowUs();
+		if (now - last_check > 1000000)
+		{
+			// 安静的调用点也要按时报告被限流的条数
+			for (auto &it : rate)
+			{
+				if (it.second.window != now / 1000000)
+					report_suppressed(it.second);
+			}
+			CheckLevelFile();
+			last_check = now;
+		}
+
+		if (got)
+		{
+			fflush(stderr);
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (m_file)
+				fflush(m_file);
+		}
+
+		if (!m_running.load())
+		{
+			// 退出前把剩余记录写完
+			if (!got)
+				break;
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_waiting = true;
+		m_cond.wait_for(lock, std::chrono::milliseconds(20));
+		m_waiting = false;
+	}
+
+	for (auto &it : rate)
+		report_suppressed(it.second);
+	fflush(stderr);
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_file)
+		fflush(m_file);
+}
+
+} // namespace MYSPDLOG
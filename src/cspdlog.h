@@ -0,0 +1,209 @@
+#ifndef CSPDLOG_H
+#define CSPDLOG_H
+
+// 异步日志
+// 热路径线程只把小的结构化记录(时间戳/线程/模块/级别/格式串/参数)压入无锁环形队列，
+// 格式化、限流和输出(文件、stderr、syslog)都在后台线程完成，慢终端不会拖住转码线程。
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+namespace MYSPDLOG
+{
+
+enum LogLevel
+{
+	LV_TRACE = 0,
+	LV_DEBUG,
+	LV_INFO,
+	LV_WARN,
+	LV_ERROR,
+	LV_OFF,
+};
+
+// 模块，每个模块单独设置日志级别
+enum LogModule
+{
+	LOG_MOD_MAIN = 0,
+	LOG_MOD_DEMUX,
+	LOG_MOD_DECODE,
+	LOG_MOD_ENCODE,
+	LOG_MOD_MUX,
+	LOG_MOD_HW,
+	LOG_MOD_SINK,
+	LOG_MOD_CACHE,
+	LOG_MOD_COUNT,
+};
+
+// 输出目标
+enum LogSink
+{
+	LOG_SINK_STDERR = 1 << 0,
+	LOG_SINK_FILE   = 1 << 1,
+	LOG_SINK_SYSLOG = 1 << 2,
+};
+
+#define LOG_MAX_ARGS  6
+#define LOG_TEXT_SIZE 128
+
+// 一个参数，字符串参数拷贝到记录的 text 中
+struct LogArg
+{
+	enum Type : uint8_t { T_INT, T_UINT, T_DOUBLE, T_STR, T_PTR } type;
+	union
+	{
+		int64_t  i;
+		uint64_t u;
+		double   d;
+		uint32_t str_off;
+		const void *p;
+	};
+};
+
+// 队列中的一条记录，fmt 必须是字符串常量
+struct LogRecord
+{
+	int64_t ts_us;
+	uint32_t tid;
+	uint8_t level;
+	uint8_t module;
+	uint8_t nargs;
+	uint8_t text_len;
+	const char *fmt;
+	LogArg args[LOG_MAX_ARGS];
+	char text[LOG_TEXT_SIZE];
+};
+
+class CSpdlog
+{
+public:
+	CSpdlog();
+	~CSpdlog();
+
+	// capacity 为队列槽数，取 2 的幂
+	bool Init(size_t capacity = 8192);
+	void Shutdown();
+
+	void SetSinks(int sinks) { m_sinks = sinks; }
+	void AddSinks(int sinks);
+	bool SetLogFile(const char *path);
+	// 每个调用点每秒最多输出多少条，0 不限
+	void SetRateLimit(int per_sec) { m_rate_limit = per_sec; }
+
+	void SetLevel(LogModule module, LogLevel level) { m_levels[module].store(level, std::memory_order_relaxed); }
+	// "decode=debug,encode=info" 或 "*=warn"
+	bool SetLevels(const char *spec);
+	// 后台线程定时检查该文件，修改后重新加载级别
+	void WatchLevelFile(const char *path);
+
+	bool ShouldLog(LogModule module, LogLevel level) const
+	{
+		return level >= m_levels[module].load(std::memory_order_relaxed);
+	}
+
+	template <typename... Args>
+	void Log(LogLevel level, LogModule module, const char *fmt, Args... args)
+	{
+		if (!ShouldLog(module, level))
+			return;
+
+		Slot *slot = BeginRecord();
+		if (!slot)
+			return;
+		LogRecord *rec = &slot->rec;
+		rec->level = (uint8_t)level;
+		rec->module = (uint8_t)module;
+		rec->fmt = fmt;
+		rec->nargs = 0;
+		rec->text_len = 0;
+		PackArgs(rec, args...);
+		CommitRecord(slot);
+	}
+
+	uint64_t Dropped() const { return m_dropped.load(std::memory_order_relaxed); }
+
+	static const char *LevelName(LogLevel level);
+	static const char *ModuleName(LogModule module);
+
+private:
+	struct Slot
+	{
+		std::atomic<size_t> seq;
+		size_t pos;
+		LogRecord rec;
+	};
+
+	Slot *BeginRecord();
+	void CommitRecord(Slot *slot);
+	bool Pop(LogRecord &out);
+	void Run();
+	void Emit(const LogRecord &rec);
+	void Format(const LogRecord &rec, std::string &out);
+	void CheckLevelFile();
+
+	static void PackArgs(LogRecord *) {}
+	template <typename T, typename... Rest>
+	static void PackArgs(LogRecord *rec, T first, Rest... rest)
+	{
+		if (rec->nargs < LOG_MAX_ARGS)
+			SetArg(rec, rec->args[rec->nargs++], first);
+		PackArgs(rec, rest...);
+	}
+
+	static void SetArg(LogRecord *, LogArg &a, int v) { a.type = LogArg::T_INT; a.i = v; }
+	static void SetArg(LogRecord *, LogArg &a, long v) { a.type = LogArg::T_INT; a.i = v; }
+	static void SetArg(LogRecord *, LogArg &a, long long v) { a.type = LogArg::T_INT; a.i = v; }
+	static void SetArg(LogRecord *, LogArg &a, unsigned v) { a.type = LogArg::T_UINT; a.u = v; }
+	static void SetArg(LogRecord *, LogArg &a, unsigned long v) { a.type = LogArg::T_UINT; a.u = v; }
+	static void SetArg(LogRecord *, LogArg &a, unsigned long long v) { a.type = LogArg::T_UINT; a.u = v; }
+	static void SetArg(LogRecord *, LogArg &a, double v) { a.type = LogArg::T_DOUBLE; a.d = v; }
+	static void SetArg(LogRecord *, LogArg &a, const void *v) { a.type = LogArg::T_PTR; a.p = v; }
+	static void SetArg(LogRecord *rec, LogArg &a, const char *v);
+	static void SetArg(LogRecord *rec, LogArg &a, char *v) { SetArg(rec, a, (const char *)v); }
+	static void SetArg(LogRecord *rec, LogArg &a, const std::string &v) { SetArg(rec, a, v.c_str()); }
+
+	Slot *m_slots;
+	size_t m_mask;
+	std::atomic<size_t> m_head;	// 生产者
+	size_t m_tail;				// 消费者(后台线程)
+	std::atomic<uint64_t> m_dropped;
+
+	std::atomic<uint8_t> m_levels[LOG_MOD_COUNT];
+	std::atomic<int> m_sinks;
+	int m_rate_limit;
+	FILE *m_file;
+
+	std::string m_level_file;
+	int64_t m_level_file_mtime;
+
+	std::thread m_thread;
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	std::atomic<bool> m_running;
+	std::atomic<bool> m_waiting;
+};
+
+CSpdlog *GetInstance();
+
+} // namespace MYSPDLOG
+
+#define MYLOG(level, module, ...) \
+	do { \
+		MYSPDLOG::CSpdlog *mylog_ = MYSPDLOG::GetInstance(); \
+		if (mylog_->ShouldLog(module, level)) \
+			mylog_->Log(level, module, __VA_ARGS__); \
+	} while (0)
+
+#define MYLOG_TRACE(module, ...) MYLOG(MYSPDLOG::LV_TRACE, MYSPDLOG::module, __VA_ARGS__)
+#define MYLOG_DEBUG(module, ...) MYLOG(MYSPDLOG::LV_DEBUG, MYSPDLOG::module, __VA_ARGS__)
+#define MYLOG_INFO(module, ...)  MYLOG(MYSPDLOG::LV_INFO,  MYSPDLOG::module, __VA_ARGS__)
+#define MYLOG_WARN(module, ...)  MYLOG(MYSPDLOG::LV_WARN,  MYSPDLOG::module, __VA_ARGS__)
+#define MYLOG_ERROR(module, ...) MYLOG(MYSPDLOG::LV_ERROR, MYSPDLOG::module, __VA_ARGS__)
+
+#endif // CSPDLOG_H
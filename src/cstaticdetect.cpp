@@ -0,0 +1,187 @@
+#include "cstaticdetect.h"
+#include "cmemtrack.h"
+#include "cspdlog.h"
+#include "pixfmttraits.h"
+#include "cjobstats.h"
+
+extern "C"
+{
+#include <libavutil/hwcontext.h>
+#include <libavutil/pixdesc.h>
+}
+
+#include <stdlib.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define THUMB_BLOCK 8
+
+// 每个 8x8 块求亮度平均，后面接两个色度(U/V)的块平均，得到 3 张 1/8 大小的缩略图；
+// 只在一两行里的变化(滚动字幕、鼠标)和只有色度的变化也能看到。
+// sparse 时只取亮度第 4 行的 8 个像素，只读 1/8 的行，显存映射时读得少，但会漏掉上面那些变化
+struct ThumbOp
+{
+	template <typename T>
+	static int Run(const AVFrame *frame, uint8_t *thumb, int tw, int th, bool sparse)
+	{
+		typedef typename T::Sample Sample;
+		int first = sparse ? THUMB_BLOCK / 2 : 0;
+		int rows = sparse ? 1 : THUMB_BLOCK;
+		for (int y = 0; y < th; y++)
+		{
+			for (int x = 0; x < tw; x++)
+			{
+				uint32_t sum = 0;
+				for (int r = first; r < first + rows; r++)
+				{
+					const Sample *p = (const Sample *)(frame->data[0] + (size_t)(y * THUMB_BLOCK + r) * frame->linesize[0]) + x * THUMB_BLOCK;
+					for (int i = 0; i < THUMB_BLOCK; i++)
+						sum += T::To16(p[i]);
+				}
+				thumb[y * tw + x] = (uint8_t)(sum / (THUMB_BLOCK * rows) >> 8);
+			}
+		}
+		if (sparse)
+			return 0;
+
+		// 4:2:0 交错色度，8x8 亮度块对应 4x4 个 UV 对
+		const int cb = THUMB_BLOCK / 2;
+		uint8_t *u = thumb + (size_t)tw * th;
+		uint8_t *v = u + (size_t)tw * th;
+		for (int y = 0; y < th; y++)
+		{
+			for (int x = 0; x < tw; x++)
+			{
+				uint32_t su = 0, sv = 0;
+				for (int r = 0; r < cb; r++)
+				{
+					const Sample *p = (const Sample *)(frame->data[1] + (size_t)(y * cb + r) * frame->linesize[1]) + x * cb * 2;
+					for (int i = 0; i < cb; i++)
+					{
+						su += T::To16(p[2 * i]);
+						sv += T::To16(p[2 * i + 1]);
+					}
+				}
+				u[y * tw + x] = (uint8_t)(su / (cb * cb) >> 8);
+				v[y * tw + x] = (uint8_t)(sv / (cb * cb) >> 8);
+			}
+		}
+		return 0;
+	}
+};
+
+void CStaticDetector::Compare(const uint8_t *a, const uint8_t *b, size_t n, uint64_t &sad, int &max_diff)
+{
+	size_t i = 0;
+	sad = 0;
+	max_diff = 0;
+#ifdef __SSE2__
+	__m128i acc = _mm_setzero_si128();
+	__m128i mx = _mm_setzero_si128();
+	for (; i + 16 <= n; i += 16)
+	{
+		__m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+		__m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(va, vb));
+		__m128i diff = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+		mx = _mm_max_epu8(mx, diff);
+	}
+	sad = (uint64_t)_mm_cvtsi128_si32(acc) + (uint64_t)_mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+	uint8_t lanes[16];
+	_mm_storeu_si128((__m128i *)lanes, mx);
+	for (int k = 0; k < 16; k++)
+	{
+		if (lanes[k] > max_diff)
+			max_diff = lanes[k];
+	}
+#endif
+	for (; i < n; i++)
+	{
+		int d = abs((int)a[i] - (int)b[i]);
+		sad += d;
+		if (d > max_diff)
+			max_diff = d;
+	}
+}
+
+int CStaticDetector::Thumbnail(const AVFrame *frame, std::vector<uint8_t> &thumb)
+{
+	CMemTrack *mem = CMemTrack::GetInstance();
+	const AVFrame *src = frame;
+	AVFrame *mapped = nullptr;
+	int ret = 0;
+
+	// 硬件帧优先映射只读，失败再下载
+	if (frame->hw_frames_ctx)
+	{
+		mapped = mem->FrameAlloc(MEM_STAGE_ENCODE);
+		if (!mapped)
+			return AVERROR(ENOMEM);
+		mapped->format = ((AVHWFramesContext *)frame->hw_frames_ctx->data)->sw_format;
+		ret = HwMap(mapped, frame, AV_HWFRAME_MAP_READ);
+		if (ret < 0)
+		{
+			av_frame_unref(mapped);
+			ret = HwTransfer(mapped, frame);
+		}
+		if (ret < 0)
+		{
+			mem->FrameFree(&mapped);
+			return ret;
+		}
+		src = mapped;
+	}
+
+	int tw = src->width / THUMB_BLOCK;
+	int th = src->height / THUMB_BLOCK;
+	thumb.resize((size_t)tw * th * (m_cfg.sparse ? 1 : 3));
+	ret = DispatchPixFmt<ThumbOp>(src->format, src, thumb.data(), tw, th, m_cfg.sparse);
+	mem->FrameFree(&mapped);
+	return ret;
+}
+
+bool CStaticDetector::Check(const AVFrame *frame, bool &force_key)
+{
+	force_key = false;
+	m_frames++;
+
+	// 取不到缩略图(不支持的格式等)时照常编码，并且不再和这一帧比较
+	int ret = Thumbnail(frame, m_cur);
+	if (ret < 0 || m_cur.empty())
+	{
+		if (ret == AVERROR(ENOSYS) && !m_warned)
+		{
+			MYLOG_WARN(LOG_MOD_ENCODE, "static frame detection supports nv12/p010 only, %s frames are always encoded",
+					   av_get_pix_fmt_name((AVPixelFormat)frame->format));
+			m_warned = true;
+		}
+		m_ref.clear();
+		m_run = 0;
+		return false;
+	}
+
+	if (m_ref.size() == m_cur.size())
+	{
+		uint64_t sad;
+		int max_diff;
+		Compare(m_ref.data(), m_cur.data(), m_cur.size(), sad, max_diff);
+		double mean = (double)sad / m_cur.size();
+		if (mean <= m_cfg.mean_diff && max_diff <= m_cfg.max_diff)
+		{
+			if (m_cfg.keyint <= 0 || m_run < m_cfg.keyint)
+			{
+				m_run++;
+				m_dropped++;
+				return true;
+			}
+			// 静止太久，编一个关键帧
+			force_key = true;
+		}
+	}
+
+	// 送去编码的帧作为下一次比较的参考
+	m_ref.swap(m_cur);
+	m_run = 0;
+	return false;
+}
@@ -0,0 +1,53 @@
+#ifndef CSTATICDETECT_H
+#define CSTATICDETECT_H
+
+// 静止帧检测
+// 每 8x8 块求亮度和色度的平均，得到 1/8 大小的缩略图(sparse 时只取亮度中间一行)，和上一个送去编码的帧比较
+// (SSE2 SAD 和最大差值)。平均差和最大差都低于阈值的帧认为和上一帧相同，编码端直接丢掉；
+// 连续丢够一定帧数后强制编一个关键帧，中途加入的直播输出也能尽快解码。
+
+extern "C"
+{
+#include <libavutil/frame.h>
+}
+
+#include <stdint.h>
+#include <vector>
+
+struct StaticConfig
+{
+	double mean_diff;	// 缩略图平均绝对差阈值(0~255)，<=0 关闭检测
+	int max_diff;		// 任一缩略图像素差超过它就不算静止，避免漏掉鼠标等小的变化
+	int keyint;			// 最多连续丢多少帧，之后强制编一个关键帧；0 为不限
+	bool sparse;		// 每块只取亮度一行，读得少，但看不到只在其他行或者只在色度上的变化
+};
+
+class CStaticDetector
+{
+public:
+	explicit CStaticDetector(const StaticConfig &cfg) : m_cfg(cfg) {}
+
+	bool Enabled() const { return m_cfg.mean_diff > 0; }
+
+	// 返回 true 表示和上一个编码帧相同可以丢掉；返回 false 时 force_key 表示需要编成关键帧
+	bool Check(const AVFrame *frame, bool &force_key);
+
+	int64_t Frames() const { return m_frames; }
+	int64_t Dropped() const { return m_dropped; }
+
+	// 缩略图的 SAD 和最大差，SSE2 每次处理 16 个像素
+	static void Compare(const uint8_t *a, const uint8_t *b, size_t n, uint64_t &sad, int &max_diff);
+
+private:
+	int Thumbnail(const AVFrame *frame, std::vector<uint8_t> &thumb);
+
+	StaticConfig m_cfg;
+	std::vector<uint8_t> m_ref;		// 上一个编码帧的缩略图
+	std::vector<uint8_t> m_cur;
+	bool m_warned = false;			// 不支持的格式只提示一次
+	int m_run = 0;					// 当前连续丢掉的帧数
+	int64_t m_frames = 0;
+	int64_t m_dropped = 0;
+};
+
+#endif // CSTATICDETECT_H
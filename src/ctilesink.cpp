@@ -0,0 +1,266 @@
+#include "ctilesink.h"
+#include "cspdlog.h"
+#include "ctrace.h"
+#include "cjobstats.h"
+
+extern "C"
+{
+#include <libavutil/hwcontext.h>
+}
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+
+#define TILE_ALIGN 16
+
+static int64_t NowUs()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool ParseTileGrid(const std::string &spec, int &cols, int &rows)
+{
+	char *end;
+	cols = (int)strtol(spec.c_str(), &end, 10);
+	if (*end != 'x')
+		return false;
+	rows = (int)strtol(end + 1, &end, 10);
+	return *end == '\0' && cols > 0 && rows > 0 && cols * rows > 1;
+}
+
+std::vector<TileRect> TileLayout(int width, int height, int cols, int rows)
+{
+	std::vector<TileRect> tiles;
+	int tw = width / cols / TILE_ALIGN * TILE_ALIGN;
+	int th = height / rows / TILE_ALIGN * TILE_ALIGN;
+	if (tw <= 0 || th <= 0)
+		return tiles;
+
+	for (int r = 0; r < rows; r++)
+	{
+		for (int c = 0; c < cols; c++)
+		{
+			TileRect t;
+			t.x = c * tw;
+			t.y = r * th;
+			t.w = c == cols - 1 ? width - t.x : tw;
+			t.h = r == rows - 1 ? height - t.y : th;
+			tiles.push_back(t);
+		}
+	}
+	return tiles;
+}
+
+std::string TilePath(const std::string &output, int index)
+{
+	size_t dot = output.rfind('.');
+	size_t slash = output.rfind('/');
+	if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+		dot = output.size();
+
+	char num[16];
+	snprintf(num, sizeof(num), ".tile%d", index);
+	return output.substr(0, dot) + num + output.substr(dot);
+}
+
+//****************************************** */
+
+CTileStats::CTileStats(const std::vector<TileRect> &tiles)
+{
+	for (const TileRect &rect : tiles)
+		m_tiles.push_back(Tile{ rect, 0, 0 });
+}
+
+void CTileStats::Frame(int tile, int64_t busy_us)
+{
+	int64_t now = NowUs();
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_start_us == 0)
+		m_start_us = now - busy_us;
+	m_end_us = now;
+	m_tiles[tile].frames++;
+	m_tiles[tile].busy_us += busy_us;
+}
+
+void CTileStats::Report()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	double wall = (m_end_us - m_start_us) / 1e6;
+	if (wall <= 0)
+		return;
+
+	// 每块：只算它自己忙的时间，就是一个编码会话单独能跑到的速度
+	int64_t min_frames = -1;
+	double busy = 0;
+	double pixels = 0;
+	for (size_t i = 0; i < m_tiles.size(); i++)
+	{
+		const Tile &t = m_tiles[i];
+		double sec = t.busy_us / 1e6;
+		MYLOG_INFO(LOG_MOD_ENCODE, "tile %d %dx%d+%d+%d: %ld frames, %.1f fps alone, %.1f fps in parallel",
+				   (int)i, t.rect.w, t.rect.h, t.rect.x, t.rect.y, (long)t.frames,
+				   sec > 0 ? t.frames / sec : 0.0, t.frames / wall);
+		if (min_frames < 0 || t.frames < min_frames)
+			min_frames = t.frames;
+		busy += sec;
+		pixels += (double)t.rect.w * t.rect.h * t.frames;
+	}
+
+	// 总的：整帧速度受最慢的一块限制；并行度为各块忙的时间之和除以墙钟时间
+	MYLOG_INFO(LOG_MOD_ENCODE, "tiles: %d sessions, %.1f full frames/s, %.1f Mpixel/s, parallelism %.2f",
+			   (int)m_tiles.size(), min_frames / wall, pixels / wall / 1e6, busy / wall);
+}
+
+//****************************************** */
+
+CTileSource::~CTileSource()
+{
+	// 有块出错提前退出时，剩下没用完的帧
+	for (auto &it : m_entries)
+		CMemTrack::GetInstance()->FrameFree(&it.second->mapped);
+}
+
+int CTileSource::Get(int64_t seq, const AVFrame *frame, AVFrame *dst)
+{
+	std::shared_ptr<Entry> entry;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		std::shared_ptr<Entry> &e = m_entries[seq];
+		if (!e)
+			e.reset(new Entry());
+		entry = e;
+	}
+
+	// 只锁这一帧，其他块可以同时处理别的帧
+	std::lock_guard<std::mutex> lock(entry->mutex);
+	if (!entry->done)
+	{
+		TRACE_SCOPE("tile_map");
+		CMemTrack *mem = CMemTrack::GetInstance();
+		entry->done = true;
+		AVFrame *mapped = mem->FrameAlloc(MEM_STAGE_ENCODE);
+		if (!mapped)
+		{
+			entry->ret = AVERROR(ENOMEM);
+			return entry->ret;
+		}
+		// 映射成内存帧，映射不了再整帧下载
+		mapped->format = ((AVHWFramesContext *)frame->hw_frames_ctx->data)->sw_format;
+		int ret = HwMap(mapped, frame, AV_HWFRAME_MAP_READ);
+		if (ret < 0)
+		{
+			av_frame_unref(mapped);
+			ret = HwTransfer(mapped, frame);
+		}
+		if (ret >= 0)
+			ret = av_frame_copy_props(mapped, frame);
+		if (ret < 0)
+		{
+			mem->FrameFree(&mapped);
+			entry->ret = ret;
+			return ret;
+		}
+		mem->FrameUpdate(mapped);
+		entry->mapped = mapped;
+	}
+	if (entry->ret < 0)
+		return entry->ret;
+	return av_frame_ref(dst, entry->mapped);
+}
+
+void CTileSource::Put(int64_t seq)
+{
+	std::shared_ptr<Entry> entry;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto it = m_entries.find(seq);
+		if (it == m_entries.end() || ++it->second->users < m_tiles)
+			return;
+		entry = it->second;
+		m_entries.erase(it);
+	}
+	std::lock_guard<std::mutex> lock(entry->mutex);
+	CMemTrack::GetInstance()->FrameFree(&entry->mapped);
+}
+
+//****************************************** */
+
+CTileSink::CTileSink(CEncodeSink *encoder, int index, const TileRect &rect, std::shared_ptr<CTileSource> source,
+					 std::shared_ptr<CTileStats> stats)
+	: m_encoder(encoder), m_index(index), m_rect(rect), m_source(source), m_stats(stats)
+{
+	m_name = "tile" + std::to_string(index);
+}
+
+CTileSink::~CTileSink()
+{
+	delete m_encoder;
+}
+
+void CTileSink::Open()
+{
+	m_encoder->Open();
+}
+
+int CTileSink::Consume(AVFrame *frame)
+{
+	CMemTrack *mem = CMemTrack::GetInstance();
+	int64_t start = NowUs();
+	int64_t seq = m_seq++;
+	int ret;
+
+	// 1. 取整帧的内存帧引用：硬件帧由这组块共用的映射/下载结果，软件帧直接引用
+	AVFrame *tile = mem->FrameAlloc(MEM_STAGE_ENCODE);
+	if (!tile)
+	{
+		m_source->Put(seq);
+		return AVERROR(ENOMEM);
+	}
+	if (frame->hw_frames_ctx)
+		ret = m_source->Get(seq, frame, tile);
+	else
+		ret = av_frame_ref(tile, frame);
+	m_source->Put(seq);
+	if (ret < 0)
+	{
+		MYLOG_ERROR(LOG_MOD_HW, "%s: Error transferring the data to system memory", m_name);
+		mem->FrameFree(&tile);
+		return ret;
+	}
+
+	// 2. 裁剪只改数据指针和宽高
+	int width = tile->width;
+	int height = tile->height;
+	tile->crop_left = m_rect.x;
+	tile->crop_top = m_rect.y;
+	tile->crop_right = width - m_rect.x - m_rect.w;
+	tile->crop_bottom = height - m_rect.y - m_rect.h;
+	ret = av_frame_apply_cropping(tile, AV_FRAME_CROP_UNALIGNED);
+	if (ret < 0)
+	{
+		MYLOG_ERROR(LOG_MOD_ENCODE, "%s: cannot crop %dx%d frame", m_name, width, height);
+		mem->FrameFree(&tile);
+		return ret;
+	}
+	mem->FrameUpdate(tile);
+
+	// 3. 编码
+	ret = m_encoder->Consume(tile);
+	mem->FrameFree(&tile);
+	if (ret >= 0)
+		m_stats->Frame(m_index, NowUs() - start);
+	return ret;
+}
+
+void CTileSink::SetInputComplete(bool complete)
+{
+	CFrameSink::SetInputComplete(complete);
+	m_encoder->SetInputComplete(complete);
+}
+
+int CTileSink::Close()
+{
+	return m_encoder->Close();
+}
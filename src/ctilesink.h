@@ -0,0 +1,110 @@
+#ifndef CTILESINK_H
+#define CTILESINK_H
+
+// 分块编码：8K 这类一个编码器跑不动的源，每帧切成 cols x rows 块，每块一个编码会话，
+// 在 CFrameTee 各自的线程里并行编码，输出为各自的文件(name.tile2.mp4 等)。
+// 软件帧直接调整数据指针裁剪，不拷贝；硬件帧每帧只映射(不行再下载)一次，各块共用，每块只读自己那部分。
+
+#include <stdint.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "cframesink.h"
+#include "cencodesink.h"
+
+struct TileRect
+{
+	int x;
+	int y;
+	int w;
+	int h;
+};
+
+// 解析 "<cols>x<rows>"
+bool ParseTileGrid(const std::string &spec, int &cols, int &rows);
+// 切分，块的边界按 16 像素对齐，最后一行/列拿剩下的部分
+std::vector<TileRect> TileLayout(int width, int height, int cols, int rows);
+// name.mp4 -> name.tile3.mp4
+std::string TilePath(const std::string &output, int index);
+
+// 各块的吞吐量统计，所有块结束后输出每块和总的吞吐量
+class CTileStats
+{
+public:
+	explicit CTileStats(const std::vector<TileRect> &tiles);
+
+	void Frame(int tile, int64_t busy_us);
+	void Report();
+
+private:
+	struct Tile
+	{
+		TileRect rect;
+		int64_t frames;
+		int64_t busy_us;	// 裁剪+编码用的时间
+	};
+
+	std::mutex m_mutex;
+	std::vector<Tile> m_tiles;
+	int64_t m_start_us = 0;		// 第一块收到第一帧
+	int64_t m_end_us = 0;		// 最后一块处理完最后一帧
+};
+
+// 一组块共用的内存帧：每个块按相同顺序收到同样的帧，按帧序号共享，
+// 第一个处理到这一帧的块映射或下载，其他块直接引用，所有块用完后释放
+class CTileSource
+{
+public:
+	explicit CTileSource(int tiles) : m_tiles(tiles) {}
+	~CTileSource();
+
+	// frame 为第 seq 个输入帧，dst 得到它的内存帧引用
+	int Get(int64_t seq, const AVFrame *frame, AVFrame *dst);
+	// 这一块用完第 seq 帧(不管 Get 是否成功都要调用)
+	void Put(int64_t seq);
+
+private:
+	struct Entry
+	{
+		std::mutex mutex;
+		AVFrame *mapped = nullptr;
+		int ret = 0;
+		bool done = false;
+		int users = 0;
+	};
+
+	int m_tiles;
+	std::mutex m_mutex;
+	std::map<int64_t, std::shared_ptr<Entry> > m_entries;
+};
+
+// 一块的输出端：裁剪后交给自己的编码输出端
+class CTileSink : public CFrameSink
+{
+public:
+	CTileSink(CEncodeSink *encoder, int index, const TileRect &rect, std::shared_ptr<CTileSource> source,
+			  std::shared_ptr<CTileStats> stats);
+	~CTileSink() override;
+
+	const char *Name() const override { return m_name.c_str(); }
+	MemStage Stage() const override { return MEM_STAGE_ENCODE; }
+
+	void Open() override;
+	int Consume(AVFrame *frame) override;
+	int Close() override;
+	void SetInputComplete(bool complete) override;
+	int64_t OutputFrames() const override { return m_encoder->OutputFrames(); }
+
+private:
+	CEncodeSink *m_encoder;
+	int m_index;
+	TileRect m_rect;
+	std::shared_ptr<CTileSource> m_source;
+	std::shared_ptr<CTileStats> m_stats;
+	int64_t m_seq = 0;			// 收到的帧数，和 CTileSource 对帧用
+	std::string m_name;
+};
+
+#endif // CTILESINK_H
@@ -0,0 +1,250 @@
+#include "ctrace.h"
+#include "cspdlog.h"
+
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <algorithm>
+
+// 看门狗两次导出之间至少间隔，最多导出次数
+#define TRACE_DUMP_INTERVAL_US 1000000
+#define TRACE_MAX_DUMPS 10
+
+static thread_local void *s_local = nullptr;
+
+CTrace *CTrace::GetInstance()
+{
+	static CTrace instance;
+	return &instance;
+}
+
+int64_t CTrace::NowUs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// 提前退出没有调用 Stop 时只停掉看门狗
+CTrace::~CTrace()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_running = false;
+		m_cond.notify_all();
+	}
+	if (m_watchdog.joinable())
+		m_watchdog.join();
+}
+
+void CTrace::Start(const char *path, size_t events_per_thread, int stall_ms, int window_ms)
+{
+	m_path = path ? path : "";
+	m_capacity = events_per_thread ? events_per_thread : 1;
+	m_stall_us = (int64_t)stall_ms * 1000;
+	m_window_us = (int64_t)(window_ms > 0 ? window_ms : 2000) * 1000;
+	m_stalled = false;
+	m_enabled = true;
+
+	if (m_stall_us > 0)
+	{
+		m_running = true;
+		m_watchdog = std::thread(&CTrace::Watchdog, this);
+	}
+}
+
+void CTrace::Stop()
+{
+	if (!m_enabled)
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_running = false;
+		m_cond.notify_all();
+	}
+	if (m_watchdog.joinable())
+		m_watchdog.join();
+
+	if (!m_path.empty())
+	{
+		if (Write(m_path, 0, NowUs()))
+			MYLOG_INFO(LOG_MOD_MAIN, "trace written to %s", m_path);
+		else
+			MYLOG_ERROR(LOG_MOD_MAIN, "Cannot write trace file '%s'", m_path);
+	}
+	m_enabled = false;
+}
+
+CTrace::ThreadBuffer *CTrace::Local()
+{
+	if (s_local)
+		return (ThreadBuffer *)s_local;
+
+	std::unique_ptr<ThreadBuffer> buf(new ThreadBuffer());
+	buf->tid = (uint32_t)syscall(SYS_gettid);
+	buf->events.resize(m_capacity);
+	buf->next = 0;
+	buf->depth = 0;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	s_local = buf.get();
+	m_buffers.push_back(std::move(buf));
+	return (ThreadBuffer *)s_local;
+}
+
+void CTrace::SetThreadName(const char *name)
+{
+	if (!Enabled())
+		return;
+	ThreadBuffer *buf = Local();
+	std::lock_guard<std::mutex> lock(buf->mutex);
+	buf->name = name;
+}
+
+void CTrace::Begin(const char *name, int64_t frame)
+{
+	ThreadBuffer *buf = Local();
+	std::lock_guard<std::mutex> lock(buf->mutex);
+	if (buf->depth < TRACE_MAX_DEPTH)
+	{
+		Open &o = buf->open[buf->depth];
+		o.name = name;
+		o.ts_us = NowUs();
+		o.frame = frame;
+		o.reported = false;
+	}
+	buf->depth++;
+}
+
+void CTrace::End()
+{
+	ThreadBuffer *buf = Local();
+	int64_t now = NowUs();
+	bool stalled = false;
+	{
+		std::lock_guard<std::mutex> lock(buf->mutex);
+		if (buf->depth <= 0)
+			return;
+		buf->depth--;
+		if (buf->depth >= TRACE_MAX_DEPTH)
+			return;
+
+		const Open &o = buf->open[buf->depth];
+		Event &e = buf->events[buf->next % buf->events.size()];
+		e.name = o.name;
+		e.ts_us = o.ts_us;
+		e.dur_us = now - o.ts_us;
+		e.frame = o.frame;
+		buf->next++;
+		stalled = m_stall_us > 0 && e.dur_us > m_stall_us && !o.reported;
+	}
+
+	// 导出在看门狗线程里做，不占用当前线程
+	if (stalled && !m_stalled.exchange(true))
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_cond.notify_all();
+	}
+}
+
+void CTrace::Watchdog()
+{
+	int64_t last_dump = 0;
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (m_running)
+	{
+		// 检查周期取期限的四分之一，最长 100ms
+		int64_t period = std::min<int64_t>(m_stall_us / 4, 100000);
+		m_cond.wait_for(lock, std::chrono::microseconds(std::max<int64_t>(period, 1000)));
+		if (!m_running)
+			break;
+
+		int64_t now = NowUs();
+		bool stalled = m_stalled.exchange(false);
+		std::string stage, thread;
+		int64_t elapsed = 0;
+		for (auto &buf : m_buffers)
+		{
+			std::lock_guard<std::mutex> block(buf->mutex);
+			for (int i = 0; i < buf->depth && i < TRACE_MAX_DEPTH; i++)
+			{
+				Open &o = buf->open[i];
+				if (!o.reported && now - o.ts_us > m_stall_us)
+				{
+					o.reported = true;
+					stalled = true;
+					stage = o.name;
+					thread = buf->name;
+					elapsed = now - o.ts_us;
+				}
+			}
+		}
+		if (!stalled || m_dumps >= TRACE_MAX_DUMPS || now - last_dump < TRACE_DUMP_INTERVAL_US)
+			continue;
+
+		char path[512];
+		snprintf(path, sizeof(path), "%s.stall-%d.json", m_path.empty() ? "trace" : m_path.c_str(), ++m_dumps);
+		last_dump = now;
+
+		lock.unlock();
+		if (!stage.empty())
+			MYLOG_WARN(LOG_MOD_MAIN, "stall: %s on thread %s running for %ld ms, timeline in %s",
+					   stage, thread, (long)(elapsed / 1000), path);
+		else
+			MYLOG_WARN(LOG_MOD_MAIN, "stall: a stage exceeded %ld ms, timeline in %s", (long)(m_stall_us / 1000), path);
+		if (!Write(path, now - m_window_us, now))
+			MYLOG_ERROR(LOG_MOD_MAIN, "Cannot write trace file '%s'", path);
+		lock.lock();
+	}
+}
+
+// 写 Chrome trace-event JSON；since_us 之前结束的事件不写，正在执行的阶段写到 now_us 为止
+bool CTrace::Write(const std::string &path, int64_t since_us, int64_t now_us)
+{
+	FILE *f = fopen(path.c_str(), "w");
+	if (!f)
+		return false;
+
+	int pid = (int)getpid();
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	bool first = true;
+
+	// 缓冲区不会释放，拷贝指针后逐个加锁读取
+	std::vector<ThreadBuffer *> buffers;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		for (auto &buf : m_buffers)
+			buffers.push_back(buf.get());
+	}
+
+	for (ThreadBuffer *buf : buffers)
+	{
+		std::lock_guard<std::mutex> lock(buf->mutex);
+		fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+				first ? "" : ",\n", pid, buf->tid, buf->name.empty() ? "thread" : buf->name.c_str());
+		first = false;
+
+		size_t count = std::min(buf->next, buf->events.size());
+		for (size_t i = buf->next - count; i < buf->next; i++)
+		{
+			const Event &e = buf->events[i % buf->events.size()];
+			if (e.ts_us + e.dur_us < since_us)
+				continue;
+			fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"stage\",\"ph\":\"X\",\"pid\":%d,\"tid\":%u,\"ts\":%lld,\"dur\":%lld",
+					e.name, pid, buf->tid, (long long)e.ts_us, (long long)e.dur_us);
+			if (e.frame >= 0)
+				fprintf(f, ",\"args\":{\"frame\":%lld}", (long long)e.frame);
+			fprintf(f, "}");
+		}
+		for (int i = 0; i < buf->depth && i < TRACE_MAX_DEPTH; i++)
+		{
+			const Open &o = buf->open[i];
+			fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"stage\",\"ph\":\"X\",\"pid\":%d,\"tid\":%u,\"ts\":%lld,\"dur\":%lld,\"args\":{\"frame\":%lld,\"in_flight\":1}}",
+					o.name, pid, buf->tid, (long long)o.ts_us, (long long)(now_us - o.ts_us), (long long)o.frame);
+		}
+	}
+	fprintf(f, "\n]}\n");
+	return fclose(f) == 0;
+}
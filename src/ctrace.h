@@ -0,0 +1,113 @@
+#ifndef CTRACE_H
+#define CTRACE_H
+
+// 时间线跟踪
+// 每个线程把各阶段每帧的开始/结束记在自己的环形缓冲区里，退出时导出 Chrome trace-event JSON，
+// 可以用 Perfetto(ui.perfetto.dev) 或 chrome://tracing 打开；
+// 看门狗线程发现某个阶段超过期限(正在执行或已经结束)时，把最近一段时间的时间线单独导出。
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define TRACE_MAX_DEPTH 8
+
+class CTrace
+{
+public:
+	static CTrace *GetInstance();
+
+	// path 为空时不导出完整时间线；stall_ms > 0 时开启看门狗，超时导出最近 window_ms 的时间线
+	void Start(const char *path, size_t events_per_thread, int stall_ms, int window_ms);
+	void Stop();
+
+	bool Enabled() const { return m_enabled.load(std::memory_order_relaxed); }
+
+	void SetThreadName(const char *name);
+	// name 必须是字符串常量；frame < 0 表示不是某一帧
+	void Begin(const char *name, int64_t frame);
+	void End();
+
+	static int64_t NowUs();
+
+private:
+	struct Event
+	{
+		const char *name;
+		int64_t ts_us;
+		int64_t dur_us;
+		int64_t frame;
+	};
+
+	struct Open
+	{
+		const char *name;
+		int64_t ts_us;
+		int64_t frame;
+		bool reported;		// 看门狗已经报过
+	};
+
+	struct ThreadBuffer
+	{
+		std::mutex mutex;	// 只和导出/看门狗竞争
+		uint32_t tid;
+		std::string name;
+		std::vector<Event> events;
+		size_t next;		// 累计写入的事件数
+		Open open[TRACE_MAX_DEPTH];
+		int depth;
+	};
+
+	CTrace() : m_enabled(false) {}
+	~CTrace();
+
+	ThreadBuffer *Local();
+	void Watchdog();
+	bool Write(const std::string &path, int64_t since_us, int64_t now_us);
+
+	std::atomic<bool> m_enabled;
+	std::string m_path;
+	size_t m_capacity = 0;
+	int64_t m_stall_us = 0;
+	int64_t m_window_us = 0;
+
+	std::mutex m_mutex;
+	std::vector<std::unique_ptr<ThreadBuffer> > m_buffers;
+
+	std::thread m_watchdog;
+	std::condition_variable m_cond;
+	bool m_running = false;
+	std::atomic<bool> m_stalled;	// 有阶段结束时超时，等看门狗导出
+	int m_dumps = 0;
+};
+
+// 作用域内记一个阶段
+class CTraceScope
+{
+public:
+	explicit CTraceScope(const char *name, int64_t frame = -1)
+		: m_on(CTrace::GetInstance()->Enabled())
+	{
+		if (m_on)
+			CTrace::GetInstance()->Begin(name, frame);
+	}
+	~CTraceScope()
+	{
+		if (m_on)
+			CTrace::GetInstance()->End();
+	}
+
+private:
+	bool m_on;
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(...) CTraceScope TRACE_CONCAT(trace_scope_, __LINE__)(__VA_ARGS__)
+
+#endif // CTRACE_H
@@ -0,0 +1,136 @@
+#ifndef PIXFMTTRAITS_H
+#define PIXFMTTRAITS_H
+
+// 像素格式特化
+// NV12(8 位)和 P010(10 位，样本放在 16 位的高 10 位)都是一个亮度平面加一个 UV 交织的色度平面，
+// 只有样本宽度不同。逐行读写、打包和两种格式之间的转换按格式写成模板，循环里没有按格式的判断；
+// 运行时只在每帧入口用 DispatchPixFmt 分派一次。
+
+extern "C"
+{
+#include <libavutil/frame.h>
+#include <libavutil/pixfmt.h>
+#include <libavutil/avutil.h>
+}
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <utility>
+
+template <AVPixelFormat F>
+struct PixFmtTraits;
+
+template <>
+struct PixFmtTraits<AV_PIX_FMT_NV12>
+{
+	typedef uint8_t Sample;
+	static const AVPixelFormat Format = AV_PIX_FMT_NV12;
+	static const int Bits = 8;
+	static const char *Name() { return "nv12"; }
+	// 和 16 位(高位对齐)之间换算，用于格式转换
+	static uint16_t To16(Sample v) { return (uint16_t)(v << 8); }
+	static Sample From16(uint16_t v) { return (Sample)(v >> 8); }
+};
+
+template <>
+struct PixFmtTraits<AV_PIX_FMT_P010>
+{
+	typedef uint16_t Sample;
+	static const AVPixelFormat Format = AV_PIX_FMT_P010;
+	static const int Bits = 10;
+	static const char *Name() { return "p010"; }
+	static uint16_t To16(Sample v) { return v; }
+	static Sample From16(uint16_t v) { return (Sample)(v & 0xFFC0); }
+};
+
+typedef PixFmtTraits<AV_PIX_FMT_NV12> Nv12Traits;
+typedef PixFmtTraits<AV_PIX_FMT_P010> P010Traits;
+
+// 平面 0 为亮度，平面 1 为 UV 交织，色度宽高各减半
+template <typename T>
+static inline int PlaneRowBytes(int plane, int width)
+{
+	return (plane == 0 ? width : (width + 1) & ~1) * (int)sizeof(typename T::Sample);
+}
+
+template <typename T>
+static inline int PlaneRows(int plane, int height)
+{
+	return plane == 0 ? height : (height + 1) / 2;
+}
+
+// 从紧密排列的文件读一帧到 frame(按 linesize 逐行)，读不满返回 AVERROR_EOF
+template <typename T>
+static inline int ReadFrame(FILE *f, AVFrame *frame)
+{
+	for (int plane = 0; plane < 2; plane++)
+	{
+		int row_bytes = PlaneRowBytes<T>(plane, frame->width);
+		int rows = PlaneRows<T>(plane, frame->height);
+		for (int y = 0; y < rows; y++)
+		{
+			if (fread(frame->data[plane] + (size_t)y * frame->linesize[plane], 1, row_bytes, f) != (size_t)row_bytes)
+				return AVERROR_EOF;
+		}
+	}
+	return 0;
+}
+
+// 把 frame 紧密排列拷到 dst，dst 至少 av_image_get_buffer_size(..., 1) 字节
+template <typename T>
+static inline void PackFrame(const AVFrame *frame, uint8_t *dst)
+{
+	for (int plane = 0; plane < 2; plane++)
+	{
+		int row_bytes = PlaneRowBytes<T>(plane, frame->width);
+		int rows = PlaneRows<T>(plane, frame->height);
+		const uint8_t *src = frame->data[plane];
+		for (int y = 0; y < rows; y++)
+		{
+			memcpy(dst, src, row_bytes);
+			dst += row_bytes;
+			src += frame->linesize[plane];
+		}
+	}
+}
+
+// NV12 <-> P010，dst 已分配好缓冲区
+template <typename Src, typename Dst>
+static inline void ConvertFrame(const AVFrame *src, AVFrame *dst)
+{
+	for (int plane = 0; plane < 2; plane++)
+	{
+		int samples = PlaneRowBytes<Src>(plane, src->width) / (int)sizeof(typename Src::Sample);
+		int rows = PlaneRows<Src>(plane, src->height);
+		for (int y = 0; y < rows; y++)
+		{
+			const typename Src::Sample *s = (const typename Src::Sample *)(src->data[plane] + (size_t)y * src->linesize[plane]);
+			typename Dst::Sample *d = (typename Dst::Sample *)(dst->data[plane] + (size_t)y * dst->linesize[plane]);
+			for (int x = 0; x < samples; x++)
+				d[x] = Dst::From16(Src::To16(s[x]));
+		}
+	}
+}
+
+static inline bool IsSemiPlanar(int format)
+{
+	return format == AV_PIX_FMT_NV12 || format == AV_PIX_FMT_P010;
+}
+
+// 按帧格式分派到 Op::Run<Traits>(args...)，不支持的格式返回 AVERROR(ENOSYS)
+template <typename Op, typename... Args>
+static inline int DispatchPixFmt(int format, Args &&... args)
+{
+	switch (format)
+	{
+	case AV_PIX_FMT_NV12:
+		return Op::template Run<Nv12Traits>(std::forward<Args>(args)...);
+	case AV_PIX_FMT_P010:
+		return Op::template Run<P010Traits>(std::forward<Args>(args)...);
+	default:
+		return AVERROR(ENOSYS);
+	}
+}
+
+#endif // PIXFMTTRAITS_H
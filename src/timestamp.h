@@ -0,0 +1,24 @@
+#ifndef TIMESTAMP_H
+#define TIMESTAMP_H
+
+#include <stdint.h>
+#include <sys/time.h>
+#include <time.h>
+
+// 当前时间，毫秒
+static inline int64_t GetCurrentStamp()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+// 单调时钟，微秒，测量短的耗时用
+static inline int64_t GetMonotonicUs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+#endif // TIMESTAMP_H